@@ -4,26 +4,34 @@
 #include "vff.h"
 #include "png.h"
 
-static void Screenshot_Transpose(u16 *dest, const u16 *fb, u32 w, u32 stride)
+#define SNAP_PNG_LEVEL  3 // fast, most of the gain comes from the PNG filters anyways
+
+static void Screenshot_GetRow(u16 *dest, u32 y)
 {
-    for (u32 y = 0; y < SCREEN_HEIGHT; y++) {
-        for (u32 x = 0; x < w; x++)
-            *(dest++) = GetColor(fb, x, y);
-        dest += stride;
+    // top screen above bottom screen, bottom screen centered on gray background
+    if (y < SCREEN_HEIGHT) {
+        for (u32 x = 0; x < SCREEN_WIDTH_TOP; x++)
+            *(dest++) = (u16) ~GetColor(TOP_SCREEN, x, y);
+    } else {
+        const u32 bot_x = (SCREEN_WIDTH_TOP - SCREEN_WIDTH_BOT) / 2;
+        for (u32 x = 0; x < SCREEN_WIDTH_TOP; x++)
+            *(dest++) = ((x < bot_x) || (x >= bot_x + SCREEN_WIDTH_BOT)) ? RGB(0x1F, 0x1F, 0x1F) :
+                (u16) ~GetColor(BOT_SCREEN, x - bot_x, y - SCREEN_HEIGHT);
     }
 }
 
+static void Screenshot_Invert(u16 *screen, u32 size)
+{
+    u32 *fb = (u32*) (void*) screen;
+    for (u32 i = 0; i < size / 4; i++)
+        fb[i] = ~fb[i];
+}
+
 void CreateScreenshot(void) {
-    u8 *png;
-    u16 *buffer;
+    u16 row[SCREEN_WIDTH_TOP];
+    PngWriter *png;
     DsTime dstime;
-    size_t png_size;
     char filename[64];
-    u32 snapbuf_size, snap_w, snap_h, bot_offset;
-
-    snapbuf_size = (SCREEN_WIDTH_TOP * SCREEN_HEIGHT * BYTES_PER_PIXEL) * 2;
-    snap_w = SCREEN_WIDTH_TOP;
-    snap_h = SCREEN_HEIGHT * 2;
 
     fvx_rmkdir(OUTPUT_PATH);
     get_dstime(&dstime);
@@ -32,35 +40,21 @@ void CreateScreenshot(void) {
         dstime.bcd_h, dstime.bcd_m, dstime.bcd_s);
     filename[63] = '\0';
 
-    buffer = malloc(snapbuf_size);
-    if (!buffer) return;
-
-    for (unsigned i = snapbuf_size/4; i < snapbuf_size/2; i++)
-        buffer[i] = RGB(0x1F, 0x1F, 0x1F); // gray background
-
-    bot_offset = (SCREEN_WIDTH_TOP * SCREEN_HEIGHT) + 40;
-
-    Screenshot_Transpose(buffer, TOP_SCREEN, SCREEN_WIDTH_TOP, 0);
-    Screenshot_Transpose(buffer + bot_offset, BOT_SCREEN, SCREEN_WIDTH_BOT, 80);
-
-    png = PNG_Compress(buffer, snap_w, snap_h, &png_size);
-
-    if (png && png_size) {
-        u16 *buffer_top = buffer, *buffer_bottom = buffer + bot_offset;
-
-        // "snap effect"
-        memcpy(buffer_bottom, BOT_SCREEN, SCREEN_SIZE_BOT);
-        memcpy(buffer_top, TOP_SCREEN, SCREEN_SIZE_TOP);
-        memset(BOT_SCREEN, 0, SCREEN_SIZE_BOT);
-        memset(TOP_SCREEN, 0, SCREEN_SIZE_TOP);
+    png = PNG_WriteStart(filename, SCREEN_WIDTH_TOP, SCREEN_HEIGHT * 2, SNAP_PNG_LEVEL);
+    if (!png) return;
 
-        fvx_qwrite(filename, png, 0, png_size, NULL);
+    // "snap effect", screens stay inverted while the PNG is written row by row
+    // (rows are inverted back when read, so no copy of the framebuffers is needed)
+    Screenshot_Invert(TOP_SCREEN, SCREEN_SIZE_TOP);
+    Screenshot_Invert(BOT_SCREEN, SCREEN_SIZE_BOT);
 
-        memcpy(BOT_SCREEN, buffer_bottom, SCREEN_SIZE_BOT);
-        memcpy(TOP_SCREEN, buffer_top, SCREEN_SIZE_TOP);
+    for (u32 y = 0; y < SCREEN_HEIGHT * 2; y++) {
+        Screenshot_GetRow(row, y);
+        if (!PNG_WriteRow(png, row)) break;
     }
+    PNG_WriteEnd(png);
     // what to do on error...?
 
-    free(buffer);
-    free(png);
+    Screenshot_Invert(TOP_SCREEN, SCREEN_SIZE_TOP);
+    Screenshot_Invert(BOT_SCREEN, SCREEN_SIZE_BOT);
 }
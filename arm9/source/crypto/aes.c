@@ -3,8 +3,13 @@
 
 // FIXME some things make assumptions about alignemnts!
 // setup_aeskey? and set_ctr do not anymore (c) d0k3
+
+// counts key setups per keyslot, so users can tell if a keyslot changed
+static uint32_t aeskey_generation[0x40] = { 0 };
+
 void setup_aeskeyX(uint8_t keyslot, const void* keyx)
 {
+    if (keyslot < 0x40) aeskey_generation[keyslot]++;
     uint32_t _keyx[4] __attribute__((aligned(32)));
     for (uint32_t i = 0; i < 16u; i++)
         ((uint8_t*)_keyx)[i] = ((uint8_t*)keyx)[i];
@@ -28,6 +33,7 @@ void setup_aeskeyX(uint8_t keyslot, const void* keyx)
 
 void setup_aeskeyY(uint8_t keyslot, const void* keyy)
 {
+    if (keyslot < 0x40) aeskey_generation[keyslot]++;
     uint32_t _keyy[4] __attribute__((aligned(32)));
     for (uint32_t i = 0; i < 16u; i++)
         ((uint8_t*)_keyy)[i] = ((uint8_t*)keyy)[i];
@@ -51,6 +57,7 @@ void setup_aeskeyY(uint8_t keyslot, const void* keyy)
 
 void setup_aeskey(uint8_t keyslot, const void* key)
 {
+    if (keyslot < 0x40) aeskey_generation[keyslot]++;
     uint32_t _key[4] __attribute__((aligned(32)));
     for (uint32_t i = 0; i < 16u; i++)
         ((uint8_t*)_key)[i] = ((uint8_t*)key)[i];
@@ -72,6 +79,11 @@ void setup_aeskey(uint8_t keyslot, const void* key)
     }
 }
 
+uint32_t get_aeskey_generation(uint32_t keyslot)
+{
+    return (keyslot < 0x40) ? aeskey_generation[keyslot] : 0;
+}
+
 void use_aeskey(uint32_t keyno)
 {
     if (keyno > 0x3F)
@@ -49,6 +49,7 @@ extern "C" {
 void setup_aeskeyX(uint8_t keyslot, const void* keyx);
 void setup_aeskeyY(uint8_t keyslot, const void* keyy);
 void setup_aeskey(uint8_t keyslot, const void* keyy);
+uint32_t get_aeskey_generation(uint32_t keyslot);
 void use_aeskey(uint32_t keyno);
 void set_ctr(void* iv);
 void add_ctr(void* ctr, uint32_t carry);
@@ -5,22 +5,26 @@
     0xA001, 0x6C00, 0x7800, 0xB401, 0x5000, 0x9C01, 0x8801, 0x4400
 
 
+static u16 crc16_table[256];
+static bool crc16_table_init = false;
+
+// bytewise table, built from the nibble table above
+static void crc16_build_table(void) {
+    static const u16 tabval[] = { CRC16_TABVAL };
+    for (u32 i = 0; i < 256; i++)
+        crc16_table[i] = (tabval[i & 0xF] >> 4) ^ tabval[(tabval[i & 0xF] ^ (i >> 4)) & 0xF];
+    crc16_table_init = true;
+}
+
 // see: https://github.com/TASVideos/desmume/blob/master/desmume/src/bios.cpp#L1070tions
+// only full halfwords are processed, same as the BIOS
 u16 crc16_quick(const void* src, u32 len) {
-    static const u16 tabval[] = { CRC16_TABVAL };
-    u16* data = (u16*) src;
+    const u8* data = (const u8*) src;
     u16 crc = 0xFFFF;
     
-    for (len >>= 1; len; len--) {
-        u16 curr = *(data++);
-        for (u32 i = 0; i < 4; i++) {
-            u16 tval = tabval[crc&0xF];
-            crc >>= 4;
-            crc ^= tval;
-            tval = tabval[(curr >> (4*i))&0xF];
-            crc ^= tval;
-        }
-    }
+    if (!crc16_table_init) crc16_build_table();
+    for (len &= ~0x1; len; len--)
+        crc = (crc >> 8) ^ crc16_table[(crc ^ *(data++)) & 0xFF];
     
     return crc;
 }
@@ -55,13 +55,85 @@ u32 crc32_adjust(u32 crc32, u8 input) {
     return ((crc32 >> 8) & 0x00ffffff) ^ crc32_table[(crc32 ^ input) & 0xff];
 }
 
+// slice-by-8 tables, derived from the table above on first use
+static u32 crc32_slice_table[8][256];
+static bool crc32_slice_init = false;
+
+static void crc32_build_slice_table(void) {
+    for (u32 i = 0; i < 256; i++)
+        crc32_slice_table[0][i] = crc32_adjust(0, i);
+    for (u32 i = 0; i < 256; i++) {
+        for (u32 k = 1; k < 8; k++) {
+            u32 prev = crc32_slice_table[k-1][i];
+            crc32_slice_table[k][i] = (prev >> 8) ^ crc32_slice_table[0][prev & 0xFF];
+        }
+    }
+    crc32_slice_init = true;
+}
+
 u32 crc32_calculate(u32 crc32, const u8* data, u32 length) {
-    for(unsigned i = 0; i < length; i++) {
-        crc32 = crc32_adjust(crc32, data[i]);
+    // bytewise until word aligned, ARM9 can't do unaligned word loads
+    for (; length && ((size_t) data & 0x3); length--)
+        crc32 = crc32_adjust(crc32, *(data++));
+    
+    // slice-by-8 for the bulk of the data (little endian word loads)
+    if (length >= 8) {
+        if (!crc32_slice_init) crc32_build_slice_table();
+        const u32 (*t)[256] = (const u32 (*)[256]) crc32_slice_table;
+        for (; length >= 8; length -= 8, data += 8) {
+            u32 one = *(const u32*)(const void*) data ^ crc32;
+            u32 two = *(const u32*)(const void*) (data + 4);
+            crc32 = t[7][one & 0xFF] ^ t[6][(one >> 8) & 0xFF] ^ t[5][(one >> 16) & 0xFF] ^ t[4][one >> 24] ^
+                t[3][two & 0xFF] ^ t[2][(two >> 8) & 0xFF] ^ t[1][(two >> 16) & 0xFF] ^ t[0][two >> 24];
+        }
     }
+    
+    for (; length; length--)
+        crc32 = crc32_adjust(crc32, *(data++));
     return crc32;
 }
 
+// GF(2) matrix helpers for crc32_combine(), see zlib's crc32.c
+static u32 gf2_matrix_times(const u32* mat, u32 vec) {
+    u32 sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square(u32* square, const u32* mat) {
+    for (u32 n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+u32 crc32_combine(u32 crc1, u32 crc2, u32 len2) {
+    u32 even[32]; // even power of two zeros operator
+    u32 odd[32]; // odd power of two zeros operator
+    
+    if (!len2) return crc1;
+    
+    // operator for one zero bit
+    odd[0] = 0xEDB88320;
+    for (u32 n = 1, row = 1; n < 32; n++, row <<= 1)
+        odd[n] = row;
+    
+    gf2_matrix_square(even, odd); // two zero bits
+    gf2_matrix_square(odd, even); // four zero bits
+    
+    // apply len2 zeros to crc1 (first square puts the operator for one zero byte in even)
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1) crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+        if (!len2) break;
+        gf2_matrix_square(odd, even);
+        if (len2 & 1) crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+    
+    return crc1 ^ crc2;
+}
+
 u32 crc32_calculate_from_file(const char* fileName, u32 offset, u32 length) {
     FIL inputFile;
     u32 crc32 = ~0;
@@ -26,9 +26,16 @@ void sha_update(const void* src, u32 size)
     if(size) iomemcpy((void*)REG_SHAINFIFO, src32, size);
 }
 
+void sha_feed(const void* src)
+{
+    while(*REG_SHACNT & 1);
+    *((volatile _sha_block*)REG_SHAINFIFO) = *((const _sha_block*)src);
+}
+
 void sha_get(void* res) {
     u32 hash_size = (*REG_SHACNT&SHA224_MODE) ? (224/8) :
                     (*REG_SHACNT&SHA1_MODE) ? (160/8) : (256/8);
+    while(*REG_SHACNT & 1); // last block from sha_feed() may still be in progress
     *REG_SHACNT = (*REG_SHACNT & ~SHA_NORMAL_ROUND) | SHA_FINAL_ROUND;
     while(*REG_SHACNT & SHA_FINAL_ROUND);
     while(*REG_SHACNT & 1);
@@ -24,6 +24,7 @@
 
 void sha_init(u32 mode);
 void sha_update(const void* src, u32 size);
+void sha_feed(const void* src); // one 0x40 byte block (word aligned), does not wait for it to be processed
 void sha_get(void* res);
 void sha_quick(void* res, const void* src, u32 size, u32 mode);
 int sha_cmp(const void* sha, const void* src, u32 size, u32 mode);
@@ -0,0 +1,100 @@
+#include "sha1.h"
+
+#define ROL32(x,n)  (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_sw_block(u32* state, const u8* block) {
+    u32 w[16];
+    u32 a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+    
+    for (u32 i = 0; i < 16; i++)
+        w[i] = getbe32(block + (i * 4));
+    
+    for (u32 i = 0; i < 80; i++) {
+        u32 f, k;
+        if (i >= 16) { // message schedule, in place
+            u32 t = w[(i+13)&0xF] ^ w[(i+8)&0xF] ^ w[(i+2)&0xF] ^ w[i&0xF];
+            w[i&0xF] = ROL32(t, 1);
+        }
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        u32 t = ROL32(a, 5) + f + e + k + w[i&0xF];
+        e = d;
+        d = c;
+        c = ROL32(b, 30);
+        b = a;
+        a = t;
+    }
+    
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+}
+
+void sha1_sw_init(Sha1Context* ctx) {
+    static const u32 sha1_iv[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    memcpy(ctx->state, sha1_iv, sizeof(sha1_iv));
+    ctx->count = 0;
+    ctx->length = 0;
+}
+
+void sha1_sw_update(Sha1Context* ctx, const void* src, u32 size) {
+    const u8* src8 = (const u8*) src;
+    ctx->length += size;
+    
+    // fill up a partial block first
+    if (ctx->count) {
+        u32 fill = min(64 - ctx->count, size);
+        memcpy(ctx->buffer + ctx->count, src8, fill);
+        ctx->count += fill;
+        src8 += fill;
+        size -= fill;
+        if (ctx->count < 64) return;
+        sha1_sw_block(ctx->state, ctx->buffer);
+        ctx->count = 0;
+    }
+    
+    for (; size >= 64; src8 += 64, size -= 64)
+        sha1_sw_block(ctx->state, src8);
+    
+    if (size) {
+        memcpy(ctx->buffer, src8, size);
+        ctx->count = size;
+    }
+}
+
+void sha1_sw_get(Sha1Context* ctx, void* res) {
+    u64 length_bits = ctx->length << 3;
+    u8* res8 = (u8*) res;
+    
+    // padding: 0x80, zeroes, 64 bit big endian length
+    ctx->buffer[ctx->count++] = 0x80;
+    if (ctx->count > 56) {
+        memset(ctx->buffer + ctx->count, 0x00, 64 - ctx->count);
+        sha1_sw_block(ctx->state, ctx->buffer);
+        ctx->count = 0;
+    }
+    memset(ctx->buffer + ctx->count, 0x00, 56 - ctx->count);
+    for (u32 i = 0; i < 8; i++)
+        ctx->buffer[56 + i] = (u8) (length_bits >> (56 - (i * 8)));
+    sha1_sw_block(ctx->state, ctx->buffer);
+    
+    for (u32 i = 0; i < 5; i++) {
+        res8[(i*4)+0] = (u8) (ctx->state[i] >> 24);
+        res8[(i*4)+1] = (u8) (ctx->state[i] >> 16);
+        res8[(i*4)+2] = (u8) (ctx->state[i] >> 8);
+        res8[(i*4)+3] = (u8) (ctx->state[i] >> 0);
+    }
+}
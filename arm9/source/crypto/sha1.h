@@ -0,0 +1,16 @@
+#pragma once
+
+#include "common.h"
+
+// software SHA-1, for when the SHA engine is busy with another hash
+
+typedef struct {
+    u32 state[5];
+    u32 count; // bytes in buffer
+    u64 length; // total bytes processed
+    u8  buffer[64];
+} Sha1Context;
+
+void sha1_sw_init(Sha1Context* ctx);
+void sha1_sw_update(Sha1Context* ctx, const void* src, u32 size);
+void sha1_sw_get(Sha1Context* ctx, void* res);
@@ -0,0 +1,247 @@
+#include "diskcache.h"
+
+#define DC_NIL          0xFFFF
+#define DC_UNUSED       0xFF
+#define DC_BUCKETS      (DISK_CACHE_SECTORS ? DISK_CACHE_SECTORS : 1)
+#define DC_HASH(p,s)    (((s) ^ ((u32) (p) << 27)) % DC_BUCKETS)
+#define DC_DATA(i)      (cache_data + ((i) * 0x200))
+
+STATIC_ASSERT(DISK_CACHE_SECTORS < DC_NIL);
+
+typedef struct {
+    u32 sector;
+    u8  pdrv; // DC_UNUSED if not in use
+    u8  dirty;
+    u16 hnext; // next entry in hash bucket
+    u16 prev; // LRU list, towards most recently used
+    u16 next; // LRU list, towards least recently used
+} DiskCacheEntry;
+
+static DiskCacheDevIO cache_dev_io = NULL;
+static DiskCacheEntry* cache_entries = NULL;
+static u8* cache_data = NULL;
+static u16 cache_buckets[DC_BUCKETS];
+static u16 lru_first = DC_NIL;
+static u16 lru_last = DC_NIL;
+static bool in_dev_io = false;
+
+static DiskCacheStats cache_stats[DISKCACHE_MAX_PDRV] = { 0 };
+
+
+static int DevIO(u8 pdrv, void* buffer, u32 sector, u32 count, bool write) {
+    in_dev_io = true;
+    int res = cache_dev_io(pdrv, buffer, sector, count, write);
+    in_dev_io = false;
+    return res;
+}
+
+static void LruUnlink(u16 i) {
+    DiskCacheEntry* e = cache_entries + i;
+    if (e->prev != DC_NIL) cache_entries[e->prev].next = e->next;
+    else lru_first = e->next;
+    if (e->next != DC_NIL) cache_entries[e->next].prev = e->prev;
+    else lru_last = e->prev;
+}
+
+static void LruPushFirst(u16 i) {
+    DiskCacheEntry* e = cache_entries + i;
+    e->prev = DC_NIL;
+    e->next = lru_first;
+    if (lru_first != DC_NIL) cache_entries[lru_first].prev = i;
+    else lru_last = i;
+    lru_first = i;
+}
+
+static void LruPushLast(u16 i) {
+    DiskCacheEntry* e = cache_entries + i;
+    e->next = DC_NIL;
+    e->prev = lru_last;
+    if (lru_last != DC_NIL) cache_entries[lru_last].next = i;
+    else lru_first = i;
+    lru_last = i;
+}
+
+static u16 FindEntry(u8 pdrv, u32 sector) {
+    for (u16 i = cache_buckets[DC_HASH(pdrv, sector)]; i != DC_NIL; i = cache_entries[i].hnext)
+        if ((cache_entries[i].sector == sector) && (cache_entries[i].pdrv == pdrv)) return i;
+    return DC_NIL;
+}
+
+static void BindEntry(u16 i, u8 pdrv, u32 sector) {
+    DiskCacheEntry* e = cache_entries + i;
+    u16* bucket = cache_buckets + DC_HASH(pdrv, sector);
+    e->pdrv = pdrv;
+    e->sector = sector;
+    e->dirty = 0;
+    e->hnext = *bucket;
+    *bucket = i;
+}
+
+static void DropEntry(u16 i) {
+    DiskCacheEntry* e = cache_entries + i;
+    if (e->pdrv == DC_UNUSED) return;
+    u16* link = cache_buckets + DC_HASH(e->pdrv, e->sector);
+    while (*link != i) link = &(cache_entries[*link].hnext);
+    *link = e->hnext;
+    e->pdrv = DC_UNUSED;
+    e->dirty = 0;
+    // unused entries are reused first
+    LruUnlink(i);
+    LruPushLast(i);
+}
+
+static int WriteBackEntry(u16 i) {
+    DiskCacheEntry* e = cache_entries + i;
+    if ((e->pdrv == DC_UNUSED) || !e->dirty) return 0;
+    int res = DevIO(e->pdrv, DC_DATA(i), e->sector, 1, true);
+    if (res != 0) return res;
+    cache_stats[e->pdrv].writebacks++;
+    e->dirty = 0;
+    return 0;
+}
+
+static u16 GetFreeEntry(void) {
+    u16 i = lru_last;
+    DiskCacheEntry* e = cache_entries + i;
+    if (e->pdrv != DC_UNUSED) {
+        if (WriteBackEntry(i) != 0) return DC_NIL;
+        cache_stats[e->pdrv].evictions++;
+        DropEntry(i);
+    }
+    return i;
+}
+
+static void TouchEntry(u16 i) {
+    if (lru_first == i) return;
+    LruUnlink(i);
+    LruPushFirst(i);
+}
+
+void InitDiskCache(DiskCacheDevIO dev_io) {
+    cache_dev_io = dev_io;
+    if (cache_entries || !DISK_CACHE_SECTORS) return;
+    
+    cache_entries = (DiskCacheEntry*) malloc(DISK_CACHE_SECTORS * sizeof(DiskCacheEntry));
+    cache_data = (u8*) malloc(DISK_CACHE_SECTORS * 0x200);
+    if (!cache_entries || !cache_data) { // run without cache
+        free(cache_entries);
+        free(cache_data);
+        cache_entries = NULL;
+        cache_data = NULL;
+        return;
+    }
+    
+    for (u32 b = 0; b < DC_BUCKETS; b++)
+        cache_buckets[b] = DC_NIL;
+    lru_first = lru_last = DC_NIL;
+    for (u16 i = 0; i < DISK_CACHE_SECTORS; i++) {
+        cache_entries[i].pdrv = DC_UNUSED;
+        cache_entries[i].dirty = 0;
+        LruPushLast(i);
+    }
+}
+
+int ReadDiskCache(u8 pdrv, void* buffer, u32 sector, u32 count) {
+    if (!cache_entries || (pdrv >= DISKCACHE_MAX_PDRV))
+        return DevIO(pdrv, buffer, sector, count, false);
+    
+    DiskCacheStats* stats = cache_stats + pdrv;
+    stats->reads += count;
+    
+    if (count == 1) { // single sector reads (FAT / directory) go through the cache
+        u16 i = FindEntry(pdrv, sector);
+        if (i != DC_NIL) {
+            stats->read_hits++;
+        } else {
+            i = GetFreeEntry();
+            if (i == DC_NIL) return DevIO(pdrv, buffer, sector, count, false);
+            int res = DevIO(pdrv, DC_DATA(i), sector, 1, false);
+            if (res != 0) return res;
+            BindEntry(i, pdrv, sector);
+        }
+        memcpy(buffer, DC_DATA(i), 0x200);
+        TouchEntry(i);
+        return 0;
+    }
+    
+    // multi sector reads bypass the cache, dirty sectors in range are patched in
+    int res = DevIO(pdrv, buffer, sector, count, false);
+    if (res != 0) return res;
+    for (u16 i = 0; i < DISK_CACHE_SECTORS; i++) {
+        DiskCacheEntry* e = cache_entries + i;
+        if ((e->pdrv == pdrv) && e->dirty && (e->sector - sector < count))
+            memcpy(((u8*) buffer) + ((e->sector - sector) * 0x200), DC_DATA(i), 0x200);
+    }
+    
+    return 0;
+}
+
+int WriteDiskCache(u8 pdrv, const void* buffer, u32 sector, u32 count) {
+    if (!cache_entries || (pdrv >= DISKCACHE_MAX_PDRV))
+        return DevIO(pdrv, (void*) buffer, sector, count, true);
+    
+    DiskCacheStats* stats = cache_stats + pdrv;
+    stats->writes += count;
+    
+    if (count == 1) { // single sector writes are held back until the next flush
+        u16 i = FindEntry(pdrv, sector);
+        if (i != DC_NIL) {
+            stats->write_hits++;
+        } else {
+            i = GetFreeEntry();
+            if (i == DC_NIL) return DevIO(pdrv, (void*) buffer, sector, count, true);
+            BindEntry(i, pdrv, sector);
+        }
+        memcpy(DC_DATA(i), buffer, 0x200);
+        cache_entries[i].dirty = 1;
+        TouchEntry(i);
+        return 0;
+    }
+    
+    // multi sector writes bypass the cache, cached sectors in range are outdated
+    int res = DevIO(pdrv, (void*) buffer, sector, count, true);
+    if (res != 0) return res;
+    for (u16 i = 0; i < DISK_CACHE_SECTORS; i++) {
+        DiskCacheEntry* e = cache_entries + i;
+        if ((e->pdrv == pdrv) && (e->sector - sector < count))
+            DropEntry(i);
+    }
+    
+    return 0;
+}
+
+int FlushDiskCache(u8 pdrv) {
+    int res = 0;
+    if (!cache_entries) return 0;
+    for (u16 i = 0; i < DISK_CACHE_SECTORS; i++) {
+        DiskCacheEntry* e = cache_entries + i;
+        if ((e->pdrv == DC_UNUSED) || ((pdrv != DISKCACHE_ALL) && (e->pdrv != pdrv)))
+            continue;
+        int res_e = WriteBackEntry(i);
+        if (!res) res = res_e;
+    }
+    return res;
+}
+
+int InvalidateDiskCache(u8 pdrv) {
+    // writes coming from the cache itself don't invalidate anything
+    if (!cache_entries || in_dev_io) return 0;
+    int res = FlushDiskCache(pdrv);
+    DropDiskCache(pdrv);
+    return res;
+}
+
+void DropDiskCache(u8 pdrv) {
+    if (!cache_entries) return;
+    for (u16 i = 0; i < DISK_CACHE_SECTORS; i++) {
+        DiskCacheEntry* e = cache_entries + i;
+        if ((e->pdrv != DC_UNUSED) && ((pdrv == DISKCACHE_ALL) || (e->pdrv == pdrv)))
+            DropEntry(i);
+    }
+}
+
+bool GetDiskCacheStats(u8 pdrv, DiskCacheStats* stats) {
+    if (pdrv >= DISKCACHE_MAX_PDRV) return false;
+    memcpy(stats, cache_stats + pdrv, sizeof(DiskCacheStats));
+    return true;
+}
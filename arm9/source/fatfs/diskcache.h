@@ -0,0 +1,30 @@
+#pragma once
+
+#include "common.h"
+
+// number of cached sectors (0 disables the cache)
+#ifndef DISK_CACHE_SECTORS
+#define DISK_CACHE_SECTORS  256 // 128kB
+#endif
+
+#define DISKCACHE_ALL       0xFF // use as pdrv to address all drives
+#define DISKCACHE_MAX_PDRV  10
+
+typedef int (*DiskCacheDevIO)(u8 pdrv, void* buffer, u32 sector, u32 count, bool write);
+
+typedef struct {
+    u32 reads;
+    u32 read_hits;
+    u32 writes;
+    u32 write_hits;
+    u32 writebacks;
+    u32 evictions;
+} DiskCacheStats;
+
+void InitDiskCache(DiskCacheDevIO dev_io);
+int ReadDiskCache(u8 pdrv, void* buffer, u32 sector, u32 count);
+int WriteDiskCache(u8 pdrv, const void* buffer, u32 sector, u32 count);
+int FlushDiskCache(u8 pdrv);
+int InvalidateDiskCache(u8 pdrv);
+void DropDiskCache(u8 pdrv);
+bool GetDiskCacheStats(u8 pdrv, DiskCacheStats* stats);
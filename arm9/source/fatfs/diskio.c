@@ -9,6 +9,7 @@
 
 #include "ff.h"			/* Obtains integer types */
 #include "diskio.h"		/* Declarations of disk functions */
+#include "diskcache.h"
 #include "image.h"
 #include "ramdrive.h"
 #include "nand.h"
@@ -21,6 +22,7 @@
 #define FPDRV(pdrv) (((pdrv >= 7) && !imgnand_mode) ? pdrv + 3 : pdrv)
 #define PART_INFO(pdrv) (DriveInfo + FPDRV(pdrv))
 #define PART_TYPE(pdrv) (DriveInfo[FPDRV(pdrv)].type)
+#define CACHED(pdrv)    (PART_TYPE(pdrv) & (TYPE_SYSNAND|TYPE_EMUNAND|TYPE_IMGNAND|TYPE_IMAGE))
 
 #define TYPE_NONE       0
 #define TYPE_SYSNAND    NAND_SYSNAND
@@ -65,6 +67,8 @@ FATpartition DriveInfo[13] = {
 
 static BYTE imgnand_mode = 0x00; 
 
+static int disk_cache_dev_io (u8 pdrv, void *buff, u32 sector, u32 count, bool write);
+
 
 
 /*-----------------------------------------------------------------------*/
@@ -117,6 +121,10 @@ DSTATUS disk_initialize (
     fat_info->offset = fat_info->size = 0;
     fat_info->keyslot = 0xFF;
     
+    // cached sectors may belong to a previously mounted drive
+    InitDiskCache(disk_cache_dev_io);
+    DropDiskCache(pdrv);
+    
     if (type == TYPE_SDCARD) {
         if (sdmmc_sdcard_init() != 0) return STA_NOINIT|STA_NODISK;
         fat_info->size = getMMCDevice(1)->total_size;
@@ -156,16 +164,10 @@ DSTATUS disk_initialize (
 
 
 /*-----------------------------------------------------------------------*/
-/* Read Sector(s)                                                        */
+/* Device Read / Write Sector(s), uncached                               */
 /*-----------------------------------------------------------------------*/
 
-DRESULT disk_read (
-	__attribute__((unused))
-	BYTE pdrv,		/* Physical drive number to identify the drive */
-	BYTE *buff,		/* Data buffer to store read data */
-	DWORD sector,	/* Sector address in LBA */
-	UINT count		/* Number of sectors to read */
-)
+static DRESULT disk_read_dev (BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
 {   
     BYTE type = PART_TYPE(pdrv);
     
@@ -189,20 +191,7 @@ DRESULT disk_read (
 	return RES_OK;
 }
 
-
-
-/*-----------------------------------------------------------------------*/
-/* Write Sector(s)                                                       */
-/*-----------------------------------------------------------------------*/
-
-#if _USE_WRITE
-DRESULT disk_write (
-	__attribute__((unused))
-	BYTE pdrv,			/* Physical drive number to identify the drive */
-	const BYTE *buff,	/* Data to be written */
-	DWORD sector,		/* Sector address in LBA */
-	UINT count			/* Number of sectors to write */
-)
+static DRESULT disk_write_dev (BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
 {
     BYTE type = PART_TYPE(pdrv);
     
@@ -225,6 +214,48 @@ DRESULT disk_write (
 
 	return RES_OK;
 }
+
+static int disk_cache_dev_io (u8 pdrv, void *buff, u32 sector, u32 count, bool write)
+{
+    return write ? disk_write_dev(pdrv, buff, sector, count) : disk_read_dev(pdrv, buff, sector, count);
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Sector(s)                                                        */
+/*-----------------------------------------------------------------------*/
+
+DRESULT disk_read (
+	__attribute__((unused))
+	BYTE pdrv,		/* Physical drive number to identify the drive */
+	BYTE *buff,		/* Data buffer to store read data */
+	DWORD sector,	/* Sector address in LBA */
+	UINT count		/* Number of sectors to read */
+)
+{   
+    if (!CACHED(pdrv)) return disk_read_dev(pdrv, buff, sector, count);
+    return (ReadDiskCache(pdrv, buff, sector, count) == 0) ? RES_OK : RES_ERROR;
+}
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write Sector(s)                                                       */
+/*-----------------------------------------------------------------------*/
+
+#if _USE_WRITE
+DRESULT disk_write (
+	__attribute__((unused))
+	BYTE pdrv,			/* Physical drive number to identify the drive */
+	const BYTE *buff,	/* Data to be written */
+	DWORD sector,		/* Sector address in LBA */
+	UINT count			/* Number of sectors to write */
+)
+{
+    if (!CACHED(pdrv)) return disk_write_dev(pdrv, buff, sector, count);
+    return (WriteDiskCache(pdrv, buff, sector, count) == 0) ? RES_OK : RES_ERROR;
+}
 #endif
 
 
@@ -257,6 +288,8 @@ DRESULT disk_ioctl (
             *((DWORD*) buff) = ((type == TYPE_IMAGE) || (type == TYPE_RAMDRV)) ? 0x1 : 0x2000;
             return RES_OK;
         case CTRL_SYNC:
+            if (CACHED(pdrv) && (FlushDiskCache(pdrv) != 0))
+                return RES_ERROR;
             if ((type == TYPE_IMAGE) || (type == TYPE_IMGNAND))
                 SyncImage();
             // nothing else to do here - sdmmc.c handles the rest
@@ -8,6 +8,7 @@
 #include "ctrtransfer.h"
 #include "scripting.h"
 #include "png.h"
+#include "sparse.h"
 #include "ui.h" // only for font file detection
 
 u64 IdentifyFileType(const char* path) {
@@ -40,7 +41,14 @@ u64 IdentifyFileType(const char* path) {
     if (!fsize) return 0;
 
     if (fsize >= 0x200) {
-        if (ValidateNandNcsdHeader((NandNcsdHeader*) data) == 0) {
+        if ((fsize >= sizeof(SparseHeader)) && (ValidateSparseHeader((SparseHeader*) data) == 0)) {
+            NandNcsdHeader ncsd; // copy of the NAND header is stored after the sparse header
+            u64 image_size = ((SparseHeader*) data)->image_size;
+            if ((FileGetData(path, &ncsd, 0x200, 0x200) == 0x200) && (ValidateNandNcsdHeader(&ncsd) == 0) &&
+                (image_size >= GetNandNcsdMinSizeSectors(&ncsd) * 0x200))
+                return IMG_NAND | FLAG_SPARSE; // sparse NAND backup
+            return 0;
+        } else if (ValidateNandNcsdHeader((NandNcsdHeader*) data) == 0) {
             return (fsize >= GetNandNcsdMinSizeSectors((NandNcsdHeader*) data) * 0x200) ?
                 IMG_NAND : (fsize == sizeof(NandNcsdHeader)) ? HDR_NAND : 0; // NAND image or just header
         } else if ((strncasecmp(path, "S:/nand.bin", 16) == 0) || (strncasecmp(path, "E:/nand.bin", 16) == 0)) {
@@ -36,6 +36,7 @@
 #define HDR_NAND    (1ULL<<31)
 #define TYPE_BASE   0xFFFFFFFFULL // 32 bit reserved for base types
 
+#define FLAG_SPARSE (1ULL<<56)
 // #define FLAG_FIRM   (1ULL<<57) // <--- for CXIs containing FIRMs
 // #define FLAG_GBAVC  (1ULL<<58) // <--- for GBAVC CXIs
 #define FLAG_DSIW   (1ULL<<59)
@@ -57,13 +58,14 @@
 #define FTYPE_TITLEINFO(tp)     (tp&(GAME_SMDH|GAME_NCCH|GAME_NCSD|GAME_CIA|GAME_TMD|GAME_NDS|GAME_GBA|GAME_TAD|GAME_3DSX))
 #define FTYPE_CIACHECK(tp)      (tp&GAME_CIA)
 #define FTYPE_RENAMABLE(tp)     (tp&(GAME_NCCH|GAME_NCSD|GAME_CIA|GAME_NDS|GAME_GBA))
-#define FTYPE_TRIMABLE(tp)      (tp&(IMG_NAND|GAME_NCCH|GAME_NCSD|GAME_NDS|SYS_FIRM))
+#define FTYPE_TRIMABLE(tp)      ((tp&(IMG_NAND|GAME_NCCH|GAME_NCSD|GAME_NDS|SYS_FIRM)) && !(tp&FLAG_SPARSE))
 #define FTYPE_TRANSFERABLE(tp)  ((u64) (tp&(IMG_FAT|FLAG_CTR)) == (u64) (IMG_FAT|FLAG_CTR))
 #define FTYPE_NCSDFIXABLE(tp)   (tp&(HDR_NAND|NOIMG_NAND))
 #define FTYPE_HASCODE(tp)       (((u64) (tp&(GAME_NCCH|FLAG_CXI)) == (u64) (GAME_NCCH|FLAG_CXI))|(tp&GAME_NCSD))
 #define FTYPE_ISDISADIFF(tp)    (tp&(SYS_DIFF|SYS_DISA))
 #define FTYPE_RESTORABLE(tp)    (tp&(IMG_NAND))
-#define FTYPE_EBACKUP(tp)       (tp&(IMG_NAND))
+#define FTYPE_EBACKUP(tp)       ((tp&(IMG_NAND)) && !(tp&FLAG_SPARSE))
+#define FTYPE_SPARSEBUILD(tp)   ((tp&(IMG_NAND)) && !(tp&FLAG_SPARSE))
 // #define FTYPE_XORPAD(tp)        (tp&(BIN_NCCHNFO)) // deprecated
 #define FTYPE_XORPAD(tp)        0
 #define FTYPE_KEYINIT(tp)       (tp&(BIN_KEYDB))
@@ -1,8 +1,89 @@
 #include "fsdir.h"
 
-void DirEntryCpy(DirEntry* dest, const DirEntry* orig) {
-    memcpy(dest, orig, sizeof(DirEntry));
-    dest->name = dest->path + dest->p_name;
+DirStruct* AllocDirStruct(void) {
+    DirStruct* contents = (DirStruct*) malloc(sizeof(DirStruct));
+    if (contents) memset(contents, 0, sizeof(DirStruct));
+    return contents;
+}
+
+void FreeDirStruct(DirStruct* contents) {
+    if (!contents) return;
+    for (DirStrBlock* block = contents->strings; block;) {
+        DirStrBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(contents->entry);
+    free(contents);
+}
+
+static void ResetDirStrings(DirStruct* contents) {
+    // blocks are kept for reuse, so stale pointers into the arena stay valid memory
+    for (DirStrBlock* block = contents->strings; block; block = block->next)
+        block->used = 0;
+    contents->strings_curr = contents->strings;
+}
+
+char* AllocDirString(DirStruct* contents, u32 size) {
+    DirStrBlock* block = contents->strings_curr;
+    if (!size || (size > DIR_STRINGS_BLOCK)) return NULL;
+    
+    while (!block || (block->used + size > DIR_STRINGS_BLOCK)) {
+        if (block && block->next) { // reuse the next (empty) block
+            block = block->next;
+            continue;
+        }
+        DirStrBlock* block_new = (DirStrBlock*) malloc(sizeof(DirStrBlock));
+        if (!block_new) return NULL;
+        block_new->next = NULL;
+        block_new->used = 0;
+        if (block) block->next = block_new;
+        else contents->strings = block_new;
+        block = block_new;
+    }
+    
+    char* str = block->data + block->used;
+    block->used += size;
+    contents->strings_curr = block;
+    memset(str, 0x00, size);
+    return str;
+}
+
+DirEntry* AddDirEntry(DirStruct* contents, u32 path_size) {
+    // first entry -> new listing, recycle the string arena
+    if (!contents->n_entries) ResetDirStrings(contents);
+    
+    // grow the entry array by one page if required
+    if (contents->n_entries >= contents->max_entries) {
+        u32 max_entries = contents->max_entries + DIR_ENTRIES_PAGE;
+        DirEntry* entries = (DirEntry*) realloc(contents->entry, max_entries * sizeof(DirEntry));
+        if (!entries) return NULL;
+        contents->entry = entries;
+        contents->max_entries = max_entries;
+    }
+    
+    char* path = AllocDirString(contents, path_size);
+    if (!path) return NULL;
+    
+    DirEntry* entry = &(contents->entry[contents->n_entries++]);
+    memset(entry, 0x00, sizeof(DirEntry));
+    entry->path = path;
+    entry->name = path;
+    return entry;
+}
+
+DirEntry* DirEntryCpy(DirStruct* contents, const DirEntry* orig) {
+    // name may be stored behind the path (root entries, good names)
+    u32 path_size = max(strnlen(orig->path, 256), (u32) orig->p_name + strnlen(orig->name, 256)) + 1;
+    DirEntry* entry = AddDirEntry(contents, path_size);
+    if (!entry) return NULL;
+    
+    char* path = entry->path;
+    memcpy(entry, orig, sizeof(DirEntry));
+    memcpy(path, orig->path, path_size - 1);
+    entry->path = path;
+    entry->name = entry->path + entry->p_name;
+    return entry;
 }
 
 int compDirEntry(const void* e1, const void* e2) {
@@ -16,10 +97,6 @@ int compDirEntry(const void* e1, const void* e2) {
 }
 
 void SortDirStruct(DirStruct* contents) {
+    // entries only hold pointers to the arena, so this only moves a few bytes each
     qsort(contents->entry, contents->n_entries, sizeof(DirEntry), compDirEntry);
-    // fix entry->names after qsort
-    for (int i = 0; i < (int)contents->n_entries; i++) {
-        DirEntry* entry = &(contents->entry[i]);
-        entry->name = entry->path + entry->p_name;
-    }
 }
@@ -2,7 +2,8 @@
 
 #include "common.h"
 
-#define MAX_DIR_ENTRIES 2048
+#define DIR_ENTRIES_PAGE    256     // entry array grows by this many entries
+#define DIR_STRINGS_BLOCK   0x4000  // size of one block in the path string arena
 
 typedef enum {
     T_ROOT,
@@ -13,17 +14,31 @@ typedef enum {
 
 typedef struct {
     char* name; // should point to the correct portion of the path
-    char path[256];
+    char* path; // stored in the string arena of the DirStruct
     u64 size;
     EntryType type;
     u8 marked;
     u8 p_name;
 } DirEntry;
 
+typedef struct DirStrBlock DirStrBlock;
+struct DirStrBlock {
+    DirStrBlock* next;
+    u32 used;
+    char data[DIR_STRINGS_BLOCK];
+};
+
 typedef struct {
     u32 n_entries;
-    DirEntry entry[MAX_DIR_ENTRIES];
+    u32 max_entries; // allocated entries
+    DirEntry* entry;
+    DirStrBlock* strings; // first block of the string arena
+    DirStrBlock* strings_curr; // block currently being filled
 } DirStruct;
 
-void DirEntryCpy(DirEntry* dest, const DirEntry* orig);
+DirStruct* AllocDirStruct(void);
+void FreeDirStruct(DirStruct* contents);
+char* AllocDirString(DirStruct* contents, u32 size);
+DirEntry* AddDirEntry(DirStruct* contents, u32 path_size);
+DirEntry* DirEntryCpy(DirStruct* contents, const DirEntry* orig);
 void SortDirStruct(DirStruct* contents);
@@ -81,7 +81,6 @@ bool GetFATVolumeLabel(const char* drv, char* label) {
 bool GetRootDirContentsWorker(DirStruct* contents) {
     static const char* drvname[] = { FS_DRVNAME };
     static const char* drvnum[] = { FS_DRVNUM };
-    u32 n_entries = 0;
     
     char sdlabel[DRV_LABEL_LEN];
     if (!GetFATVolumeLabel("0:", sdlabel) || !(*sdlabel))
@@ -91,12 +90,12 @@ bool GetRootDirContentsWorker(DirStruct* contents) {
     GetVCartTypeString(carttype);
     
     // virtual root objects hacked in
-    for (u32 i = 0; (i < countof(drvnum)) && (n_entries < MAX_DIR_ENTRIES); i++) {
-        DirEntry* entry = &(contents->entry[n_entries]);
+    for (u32 i = 0; i < countof(drvnum); i++) {
         if (!DriveType(drvnum[i])) continue; // drive not available
+        DirEntry* entry = AddDirEntry(contents, 4 + 32);
+        if (!entry) break;
         entry->p_name = 4;
         entry->name = entry->path + entry->p_name;
-        memset(entry->path, 0x00, 64);
         snprintf(entry->path,  4, "%s", drvnum[i]);
         if ((*(drvnum[i]) >= '7') && (*(drvnum[i]) <= '9') && !(GetMountState() & IMG_NAND)) // Drive 7...9 handling
             snprintf(entry->name, 32, "[%s] %s", drvnum[i],
@@ -121,9 +120,7 @@ bool GetRootDirContentsWorker(DirStruct* contents) {
         entry->size = GetTotalSpace(entry->path);
         entry->type = T_ROOT;
         entry->marked = 0;
-        n_entries++;
     }
-    contents->n_entries = n_entries;
     
     return contents->n_entries;
 }
@@ -149,14 +146,14 @@ bool GetDirContentsWorker(DirStruct* contents, char* fpath, int fnsize, const ch
         if (fno.fname[0] == 0) {
             ret = true;
             break;
-        } else if (!pattern || (fvx_match_name(fname, pattern) == FR_OK)) {
-            DirEntry* entry = &(contents->entry[contents->n_entries]);
-            if (contents->n_entries >= MAX_DIR_ENTRIES) {
-                ret = true; // Too many entries, still okay if we stop here
+        } else if ((!recursive || !(fno.fattrib & AM_DIR)) &&
+            (!pattern || (fvx_match_name(fname, pattern) == FR_OK))) {
+            DirEntry* entry = AddDirEntry(contents, strnlen(fpath, fnsize - 1) + 1);
+            if (!entry) {
+                ret = true; // Out of memory, still okay if we stop here
                 break;
             }
-            strncpy(entry->path, fpath, 256);
-            entry->path[255] = '\0';
+            strcpy(entry->path, fpath);
             entry->p_name = fname - fpath;
             entry->name = entry->path + entry->p_name;
             if (fno.fattrib & AM_DIR) {
@@ -167,8 +164,6 @@ bool GetDirContentsWorker(DirStruct* contents, char* fpath, int fnsize, const ch
                 entry->size = fno.fsize;
             }
             entry->marked = 0;
-            if (!recursive || (entry->type != T_DIR))
-                ++(contents->n_entries);
         }
         if (recursive && (fno.fattrib & AM_DIR)) {
             if (!GetDirContentsWorker(contents, fpath, fnsize, pattern, recursive))
@@ -187,14 +182,14 @@ void SearchDirContents(DirStruct* contents, const char* path, const char* patter
             contents->n_entries = 0; // not required, but so what?
     } else {
         // create virtual '..' entry
-        DirEntry* entry = (DirEntry*) &(contents->entry);
+        DirEntry* entry = AddDirEntry(contents, 4 + 4);
+        if (!entry) return;
         entry->p_name = 4;
         entry->name = entry->path + entry->p_name;
         strncpy(entry->path, "*?*", 4);
         strncpy(entry->name, "..", 4);
         entry->type = T_DOTDOT;
         entry->size = 0;
-        contents->n_entries = 1;
         // search the path
         char fpath[256]; // 256 is the maximum length of a full path
         strncpy(fpath, path, 256);
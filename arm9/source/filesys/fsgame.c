@@ -2,6 +2,7 @@
 #include "fsperm.h"
 #include "gameutil.h"
 #include "ui.h"
+#include "vff.h"
 #include "ff.h"
 
 void SetDirGoodNames(DirStruct* contents) {
@@ -14,13 +15,18 @@ void SetDirGoodNames(DirStruct* contents) {
         if ((GetGoodName(goodname, entry->path, false) != 0) ||
             (plen + 1 + strnlen(goodname, 256) + 1 > 256))
             continue;
+        // good name is stored right behind the path
+        char* path = AllocDirString(contents, plen + 1 + strnlen(goodname, 256) + 1);
+        if (!path) break;
+        memcpy(path, entry->path, plen);
+        entry->path = path;
         entry->p_name = plen + 1;
         entry->name = entry->path + entry->p_name;
         snprintf(entry->name, 256 - entry->p_name, "%s", goodname);
     }
 }
 
-bool GoodRenamer(DirEntry* entry, bool ask) {
+bool GoodRenamer(DirStruct* contents, DirEntry* entry, bool ask) {
     char goodname[256]; // get goodname
     if ((GetGoodName(goodname, entry->path, false) != 0) ||
         (strncmp(goodname + strnlen(goodname, 256) - 4, ".tmd", 4) == 0)) // no TMD, please
@@ -44,8 +50,11 @@ bool GoodRenamer(DirEntry* entry, bool ask) {
     strncpy(nname, goodname, 256 - 1 - (nname - npath));
     // actual rename
     if (!CheckDirWritePermissions(entry->path)) return false;
-    if (f_rename(entry->path, npath) != FR_OK) return false;
-    strncpy(entry->path, npath, 256);
+    if (fvx_rename(entry->path, npath) != FR_OK) return false;
+    char* path = AllocDirString(contents, strnlen(npath, 256) + 1);
+    if (!path) return true; // renamed, but the entry can't be updated
+    strcpy(path, npath);
+    entry->path = path;
     entry->name = entry->path + (nname - npath);
     
     return true;
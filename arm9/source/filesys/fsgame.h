@@ -4,4 +4,4 @@
 #include "fsdir.h"
 
 void SetDirGoodNames(DirStruct* contents);
-bool GoodRenamer(DirEntry* entry, bool ask);
+bool GoodRenamer(DirStruct* contents, DirEntry* entry, bool ask);
@@ -3,7 +3,11 @@
 #include "virtual.h"
 #include "sddata.h"
 #include "image.h"
+#include "nand.h"
+#include "vff.h"
+#include "nandcmac.h"
 #include "ff.h"
+#include "diskcache.h"
 
 // FATFS filesystem objects (x10)
 static FATFS fs[NORM_FS];
@@ -11,7 +15,18 @@ static FATFS fs[NORM_FS];
 // currently open file systems
 static bool fs_mounted[NORM_FS] = { false };
 
+// bumped on every (un)mount, for anything caching info derived from drive contents
+static u32 mount_generation = 0;
+
+static void FlushFSCache(u32 fsnum) {
+    // remounting reinitializes the disk and drops its cached sectors, dirty ones included
+    char drv[2] = { '0' + fsnum, '\0' };
+    FlushDiskCache(VolToPart[fsnum].pd);
+    DropCmacJournal(drv);
+}
+
 bool InitSDCardFS() {
+    mount_generation++;
     fs_mounted[0] = (f_mount(fs, "0:", 1) == FR_OK);
     return fs_mounted[0];
 }
@@ -29,11 +44,15 @@ bool InitExtFS() {
             if (!buffer) bkpt; // whatever, this won't go wrong anyways
             f_mkfs(fsname, NULL, buffer, STD_BUFFER_SIZE); // format ramdrive if required
             free(buffer);
+            FlushFSCache(i);
             f_mount(NULL, fsname, 1);
             fs_mounted[i] = (f_mount(fs + i, fsname, 1) == FR_OK);
             ramdrv_ready = true;
         }
     }
+    fvx_qreset(); // alias drives may point elsewhere now
+    mount_generation++;
+    DropCmacJournal("AB");
     SetupNandSdDrive("A:", "0:", "1:/private/movable.sed", 0);
     SetupNandSdDrive("B:", "0:", "4:/private/movable.sed", 1);
     return true;
@@ -47,6 +66,8 @@ bool InitImgFS(const char* path) {
         snprintf(fsname, 7, "%lu:", drv_i);
         if (!(DriveType(fsname)&DRV_IMAGE)) break;
     }
+    // close kept open handles (the image file may be one of them)
+    fvx_qreset();
     // deinit virtual filesystem
     DeinitVirtualImageDrive();
     // deinit image filesystem
@@ -65,13 +86,16 @@ bool InitImgFS(const char* path) {
 }
 
 void DeinitExtFS() {
-    InitImgFS(NULL);
+    InitImgFS(NULL); // this also closes kept open handles
+    mount_generation++;
+    DropCmacJournal("AB");
     SetupNandSdDrive(NULL, NULL, NULL, 0);
     SetupNandSdDrive(NULL, NULL, NULL, 1);
     for (u32 i = NORM_FS - 1; i > 0; i--) {
         if (fs_mounted[i]) {
             char fsname[8];
             snprintf(fsname, 7, "%lu:", i);
+            FlushFSCache(i);
             f_mount(NULL, fsname, 1);
             fs_mounted[i] = false;
         }
@@ -80,12 +104,16 @@ void DeinitExtFS() {
 
 void DeinitSDCardFS() {
     DismountDriveType(DRV_SDCARD|DRV_EMUNAND|DRV_ALIAS);
+    InvalidateNandPartitionCache(NAND_EMUNAND); // SD card may be swapped
 }
 
 void DismountDriveType(u32 type) { // careful with this - no safety checks
+    fvx_qreset();
+    mount_generation++;
     if (type & DriveType(GetMountPath()))
         InitImgFS(NULL); // image is mounted from type -> unmount image drive, too
     if (type & DRV_SDCARD) {
+        DropCmacJournal("AB");
         SetupNandSdDrive(NULL, NULL, NULL, 0);
         SetupNandSdDrive(NULL, NULL, NULL, 1);
     }
@@ -94,11 +122,16 @@ void DismountDriveType(u32 type) { // careful with this - no safety checks
         snprintf(fsname, 7, "%lu:", i);
         if (!fs_mounted[i] || !(type & DriveType(fsname)))
             continue;
+        FlushFSCache(i);
         f_mount(NULL, fsname, 1);
         fs_mounted[i] = false;
     }
 }
 
+u32 GetMountGeneration(void) {
+    return mount_generation;
+}
+
 bool CheckSDMountState(void) {
     return fs_mounted[0] || fs_mounted[4] || fs_mounted[5] || fs_mounted[6];
 }
@@ -21,6 +21,9 @@ void DeinitSDCardFS();
 // dismount drives of a certain type
 void DismountDriveType(u32 type);
 
+// returns a counter that changes with every mount / dismount
+u32 GetMountGeneration(void);
+
 // returns the mount state of the SD card 
 bool CheckSDMountState(void);
 
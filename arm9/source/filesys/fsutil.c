@@ -7,7 +7,10 @@
 #include "virtual.h"
 #include "image.h"
 #include "sha.h"
+#include "sha1.h"
+#include "crc32.h"
 #include "sdmmc.h"
+#include "nand.h"
 #include "ff.h"
 #include "ui.h"
 #include "swkbd.h"
@@ -17,6 +20,19 @@
 
 #define _MAX_FS_OPT     8 // max file selector options
 
+#define COPY_BUFFER_SIZE    (4 * STD_BUFFER_SIZE) // preferred buffer size for copy / inject
+
+#define FIND_HORSPOOL_MIN   4 // min pattern size for Boyer-Moore-Horspool search
+
+typedef struct {
+    const u8* data;
+    const u8* mask; // NULL for exact search, 0x00 bits are wildcards
+    u32 size;
+    u32 anchor; // first exactly specified byte in pattern
+    bool horspool;
+    u32 skip[256];
+} FindPattern;
+
 // Volume2Partition resolution table
 PARTITION VolToPart[] = {
     {0, 0}, {1, 0}, {2, 0}, {3, 0}, {4, 0},
@@ -78,6 +94,7 @@ bool FormatSDCard(u64 hidden_mb, u32 cluster_size, const char* label) {
         ShowPrompt(false, "Error: SD card i/o failure");
         return false;
     }
+    InvalidateNandPartitionCache(NAND_EMUNAND);
     
     // format the SD card
     VolToPart[0].pt = 1; // workaround to prevent FatFS rebuilding the MBR
@@ -144,7 +161,7 @@ bool FileUnlock(const char* path) {
 bool FileSetData(const char* path, const void* data, size_t size, size_t foffset, bool create) {
     UINT bw;
     if (!CheckWritePermissions(path)) return false;
-    if ((DriveType(path) & DRV_FAT) && create) f_unlink(path);
+    if ((DriveType(path) & DRV_FAT) && create) fvx_unlink(path);
     return (fvx_qwrite(path, data, foffset, size, &bw) == FR_OK) && (bw == size);
 }
 
@@ -161,25 +178,34 @@ size_t FileGetSize(const char* path) {
     return fno.fsize;
 }
 
-bool FileGetSha256(const char* path, u8* sha256, u64 offset, u64 size) {
+bool FileGetDigests(const char* path, u8* sha256, u8* sha1, u32* crc32, u64 offset, u64 size) {
     bool ret = true;
     FIL file;
     u64 fsize;
+    Sha1Context sha1_ctx;
+    u32 crc = ~0;
     
     if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return false;
     
     fsize = fvx_size(&file);
-    if (offset + size > fsize) return false;
+    if (offset + size > fsize) {
+        fvx_close(&file);
+        return false;
+    }
     if (!size) size = fsize - offset;
     fvx_lseek(&file, offset);
     
     u32 bufsiz = min(STD_BUFFER_SIZE, fsize);
     u8* buffer = (u8*) malloc(bufsiz);
-    if (!buffer) return false;
+    if (!buffer) {
+        fvx_close(&file);
+        return false;
+    }
     
     ShowProgress(0, 0, path);
-    sha_init(SHA256_MODE);
+    if (sha256) sha_init(SHA256_MODE);
+    if (sha1) sha1_sw_init(&sha1_ctx);
     for (u64 pos = 0; (pos < size) && ret; pos += bufsiz) {
         UINT read_bytes = min(bufsiz, size - pos);
         UINT bytes_read = 0;
@@ -187,10 +213,23 @@ bool FileGetSha256(const char* path, u8* sha256, u64 offset, u64 size) {
             ret = false;
         if (!ShowProgress(pos + bytes_read, size, path))
             ret = false;
-        sha_update(buffer, bytes_read);
+        if (!sha1 && !crc32) { // SHA-256 only, nothing to overlap with
+            if (sha256) sha_update(buffer, bytes_read);
+            continue;
+        }
+        // the SHA engine works on one block while the CPU does SHA-1 / CRC32 for it
+        for (u32 i = 0; i < bytes_read; i += 0x40) {
+            u32 blksiz = min(0x40, bytes_read - i);
+            if (sha256 && (blksiz == 0x40)) sha_feed(buffer + i);
+            else if (sha256) sha_update(buffer + i, blksiz);
+            if (sha1) sha1_sw_update(&sha1_ctx, buffer + i, blksiz);
+            if (crc32) crc = crc32_calculate(crc, buffer + i, blksiz);
+        }
     }
     
-    sha_get(sha256);
+    if (sha256) sha_get(sha256);
+    if (sha1) sha1_sw_get(&sha1_ctx, sha1);
+    if (crc32) *crc32 = ~crc;
     fvx_close(&file);
     free(buffer);
     
@@ -199,50 +238,175 @@ bool FileGetSha256(const char* path, u8* sha256, u64 offset, u64 size) {
     return ret;
 }
 
+bool FileGetSha256(const char* path, u8* sha256, u64 offset, u64 size) {
+    return FileGetDigests(path, sha256, NULL, NULL, offset, size);
+}
+
+// word-at-a-time scan for a single byte value in [ptr, end)
+static const u8* FindByte(const u8* ptr, const u8* end, u8 c) {
+    for (; ((u32) ptr & 0x3) && (ptr < end); ptr++)
+        if (*ptr == c) return ptr;
+    u32 cccc = c * 0x01010101;
+    for (; ptr + 4 <= end; ptr += 4) {
+        u32 word = *(const u32*) (const void*) ptr ^ cccc;
+        if ((word - 0x01010101) & ~word & 0x80808080) break; // at least one zero byte
+    }
+    for (; ptr < end; ptr++)
+        if (*ptr == c) return ptr;
+    return NULL;
+}
+
+static inline bool MatchFindPattern(const FindPattern* pattern, const u8* ptr) {
+    const u8* data = pattern->data;
+    const u8* mask = pattern->mask;
+    if (!mask) return (memcmp(ptr, data, pattern->size) == 0);
+    for (u32 i = pattern->size; i > 0; i--) // compare from the end, like Horspool
+        if ((ptr[i-1] ^ data[i-1]) & mask[i-1]) return false;
+    return true;
+}
+
+static void InitFindPattern(FindPattern* pattern, const u8* data, const u8* mask, u32 size) {
+    pattern->data = data;
+    pattern->mask = mask;
+    pattern->size = size;
+    
+    // anchor: first byte that has to match exactly (used for the short pattern scan)
+    pattern->anchor = 0;
+    if (mask) for (; (pattern->anchor < size) && (mask[pattern->anchor] != 0xFF); pattern->anchor++);
+    
+    // Horspool shift table, built from all but the last pattern byte
+    // (masked bits match any value and so reduce the shift for all matching values)
+    pattern->horspool = (size >= FIND_HORSPOOL_MIN);
+    if (!pattern->horspool) return;
+    for (u32 c = 0; c < 256; c++) pattern->skip[c] = size;
+    for (u32 i = 0; i < size - 1; i++) {
+        u32 shift = size - 1 - i;
+        u8 m = mask ? mask[i] : 0xFF;
+        if (m == 0xFF) pattern->skip[data[i]] = shift;
+        else for (u32 c = 0; c < 256; c++)
+            if (!((c ^ data[i]) & m)) pattern->skip[c] = shift;
+    }
+}
+
+static const u8* FindPatternInBuffer(const FindPattern* pattern, const u8* buffer, u32 len) {
+    u32 size = pattern->size;
+    if (!size || (len < size)) return NULL;
+    
+    if (pattern->horspool) { // Boyer-Moore-Horspool for long patterns
+        for (u32 i = 0; i + size <= len; i += pattern->skip[buffer[i + size - 1]])
+            if (MatchFindPattern(pattern, buffer + i)) return buffer + i;
+    } else if (pattern->anchor < size) { // short patterns: scan for the anchor byte
+        u32 a = pattern->anchor;
+        const u8* end = buffer + len - size + a + 1;
+        for (const u8* ptr = buffer + a; (ptr = FindByte(ptr, end, pattern->data[a])); ptr++)
+            if (MatchFindPattern(pattern, ptr - a)) return ptr - a;
+    } else { // short patterns without any exact byte
+        for (u32 i = 0; i + size <= len; i++)
+            if (MatchFindPattern(pattern, buffer + i)) return buffer + i;
+    }
+    
+    return NULL;
+}
+
+static u32 FindPatternInFile(FIL* file, const char* path, const FindPattern* pattern, u8* buffer,
+    u64 pos, u64 search_end, u64* found, u32 max_found) {
+    u64 fsize = fvx_size(file);
+    u32 size_data = pattern->size;
+    u32 n_found = 0;
+    bool show_progress = false;
+    
+    search_end = (search_end > fsize) ? fsize : search_end;
+    for (; (pos < search_end) && (n_found < max_found); pos += STD_BUFFER_SIZE - (size_data - 1)) {
+        UINT read_bytes = min(STD_BUFFER_SIZE, search_end - pos);
+        UINT btr;
+        fvx_lseek(file, pos);
+        if ((fvx_read(file, buffer, read_bytes, &btr) != FR_OK) || (btr != read_bytes))
+            break;
+        for (u32 i = 0; n_found < max_found; i++) {
+            const u8* hit = FindPatternInBuffer(pattern, buffer + i, read_bytes - i);
+            if (!hit) break;
+            i = hit - buffer;
+            found[n_found++] = pos + i;
+        }
+        if (!show_progress && (n_found < max_found) && (pos + read_bytes < fsize)) {
+            ShowProgress(0, 0, path);
+            show_progress = true;
+        }
+        if (show_progress && (!ShowProgress(pos + read_bytes, fsize, path)))
+            break;
+    }
+    
+    return n_found;
+}
+
 u32 FileFindData(const char* path, u8* data, u32 size_data, u32 offset_file) {
+    return FileFindDataMasked(path, data, NULL, size_data, offset_file);
+}
+
+u32 FileFindDataMasked(const char* path, const u8* data, const u8* mask, u32 size_data, u32 offset_file) {
     FIL file; // used for FAT & virtual
+    FindPattern pattern;
     u64 found = (u64) -1;
-    u64 fsize = FileGetSize(path);
     
+    if (!size_data) return found;
     if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return found;
     
     u8* buffer = (u8*) malloc(STD_BUFFER_SIZE);
-    if (!buffer) return false;
-    
-    // main routine
-    for (u32 pass = 0; pass < 2; pass++) {
-        bool show_progress = false;
-        u64 pos = (pass == 0) ? offset_file : 0;
-        u64 search_end = (pass == 0) ? fsize : offset_file + size_data;
-        search_end = (search_end > fsize) ? fsize : search_end;
-        for (; (pos < search_end) && (found == (u64) -1); pos += STD_BUFFER_SIZE - (size_data - 1)) {
-            UINT read_bytes = min(STD_BUFFER_SIZE, search_end - pos);
-            UINT btr;
-            fvx_lseek(&file, pos);
-            if ((fvx_read(&file, buffer, read_bytes, &btr) != FR_OK) || (btr != read_bytes))
-                break;
-            for (u32 i = 0; i + size_data <= read_bytes; i++) {
-                if (memcmp(buffer + i, data, size_data) == 0) {
-                    found = pos + i;
-                    break;
-                }
-            }
-            if (!show_progress && (found == (u64) -1) && (pos + read_bytes < fsize)) {
-                ShowProgress(0, 0, path);
-                show_progress = true;
-            }
-            if (show_progress && (!ShowProgress(pos + read_bytes, fsize, path)))
-                break;
-        }
+    if (!buffer) {
+        fvx_close(&file);
+        return found;
     }
     
+    // main routine, search from offset to end first, then wrap around
+    InitFindPattern(&pattern, data, mask, size_data);
+    if (!FindPatternInFile(&file, path, &pattern, buffer, offset_file, (u64) -1, &found, 1))
+        FindPatternInFile(&file, path, &pattern, buffer, 0, (u64) offset_file + size_data - 1, &found, 1);
+    
     free(buffer);
     fvx_close(&file);
     
     return found;
 }
 
+u32 FileFindDataAll(const char* path, const u8* data, const u8* mask, u32 size_data, u64 offset_file, u64* found, u32 max_found) {
+    FIL file; // used for FAT & virtual
+    FindPattern pattern;
+    u32 n_found = 0;
+    
+    if (!size_data || !max_found) return 0;
+    if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+        return 0;
+    
+    u8* buffer = (u8*) malloc(STD_BUFFER_SIZE);
+    if (!buffer) {
+        fvx_close(&file);
+        return 0;
+    }
+    
+    InitFindPattern(&pattern, data, mask, size_data);
+    n_found = FindPatternInFile(&file, path, &pattern, buffer, offset_file, (u64) -1, found, max_found);
+    
+    free(buffer);
+    fvx_close(&file);
+    
+    return n_found;
+}
+
+// larger buffers mean fewer, longer transfers for the SD / NAND controllers
+// falls back to smaller buffers if memory is short, size (if known) limits the buffer
+static u8* AllocCopyBuffer(u32* bufsiz, u64 size) {
+    for (u32 bsize = COPY_BUFFER_SIZE; bsize >= STD_BUFFER_SIZE; bsize >>= 1) {
+        if (size && (bsize > STD_BUFFER_SIZE) && ((bsize >> 1) >= size)) continue;
+        u8* buffer = (u8*) malloc(bsize);
+        if (buffer) {
+            *bufsiz = bsize;
+            return buffer;
+        }
+    }
+    return NULL;
+}
+
 bool FileInjectFile(const char* dest, const char* orig, u64 off_dest, u64 off_orig, u64 size, u32* flags) {
     FIL ofile;
     FIL dfile;
@@ -280,13 +444,18 @@ bool FileInjectFile(const char* dest, const char* orig, u64 off_dest, u64 off_or
         return false;
     }
     
-    u8* buffer = (u8*) malloc(STD_BUFFER_SIZE);
-    if (!buffer) return false;
+    u32 bufsiz;
+    u8* buffer = AllocCopyBuffer(&bufsiz, size);
+    if (!buffer) {
+        fvx_close(&dfile);
+        fvx_close(&ofile);
+        return false;
+    }
     
     bool ret = true;
     ShowProgress(0, 0, orig);
-    for (u64 pos = 0; (pos < size) && ret; pos += STD_BUFFER_SIZE) {
-        UINT read_bytes = min(STD_BUFFER_SIZE, size - pos);
+    for (u64 pos = 0; (pos < size) && ret; pos += bufsiz) {
+        UINT read_bytes = min(bufsiz, size - pos);
         UINT bytes_read = read_bytes;
         UINT bytes_written = read_bytes;
         if ((fvx_read(&ofile, buffer, read_bytes, &bytes_read) != FR_OK) ||
@@ -367,12 +536,13 @@ bool FileCreateDummy(const char* cpath, const char* filename, u64 size) {
     
     // create dummy file (fail if already existing)
     // then, expand the file size via cluster preallocation
+    // (fvx_open() for the CMAC journal, virtual files can't be created anyways)
     FIL dfile;
-    if (fx_open(&dfile, npath, FA_WRITE | FA_CREATE_NEW) != FR_OK)
+    if (GetVirtualSource(npath) || (fvx_open(&dfile, npath, FA_WRITE | FA_CREATE_NEW) != FR_OK))
         return false;
     f_lseek(&dfile, size > 0xFFFFFFFF ? 0xFFFFFFFF : (FSIZE_t) size);
     f_sync(&dfile);
-    fx_close(&dfile);
+    fvx_close(&dfile);
     
     return (fa_stat(npath, NULL) == FR_OK);
 }
@@ -670,7 +840,8 @@ bool PathMoveCopy(const char* dest, const char* orig, u32* flags, bool move) {
         if (flags && (*flags & BUILD_PATH)) fvx_rmkpath(ldest);
         
         // setup buffer
-        u8* buffer = (u8*) malloc(STD_BUFFER_SIZE);
+        u32 bufsiz;
+        u8* buffer = AllocCopyBuffer(&bufsiz, 0);
         if (!buffer) {
             ShowPrompt(false, "Out of memory.");
             return false;
@@ -678,7 +849,7 @@ bool PathMoveCopy(const char* dest, const char* orig, u32* flags, bool move) {
         
         // actual move / copy operation
         bool same_drv = (strncasecmp(lorig, ldest, 2) == 0);
-        bool res = PathMoveCopyRec(ldest, lorig, flags, move && same_drv, buffer, STD_BUFFER_SIZE);
+        bool res = PathMoveCopyRec(ldest, lorig, flags, move && same_drv, buffer, bufsiz);
         if (move && res && (!flags || !(*flags&SKIP_CUR))) PathDelete(lorig);
         
         free(buffer);
@@ -709,7 +880,8 @@ bool PathMoveCopy(const char* dest, const char* orig, u32* flags, bool move) {
         }
         
         // setup buffer
-        u8* buffer = (u8*) malloc(STD_BUFFER_SIZE);
+        u32 bufsiz;
+        u8* buffer = AllocCopyBuffer(&bufsiz, 0);
         if (!buffer) {
             ShowPrompt(false, "Out of memory.");
             return false;
@@ -717,7 +889,7 @@ bool PathMoveCopy(const char* dest, const char* orig, u32* flags, bool move) {
         
         // actual virtual copy operation
         if (force_unmount) DismountDriveType(DriveType(ldest)&(DRV_SYSNAND|DRV_EMUNAND|DRV_IMAGE));
-        bool res = PathMoveCopyRec(ldest, lorig, flags, false, buffer, STD_BUFFER_SIZE);
+        bool res = PathMoveCopyRec(ldest, lorig, flags, false, buffer, bufsiz);
         if (force_unmount) InitExtFS();
         
         free(buffer);
@@ -820,10 +992,13 @@ bool FileSelectorWorker(char* result, const char* text, const char* path, const
         u32 pos = 0;
         GetDirContents(contents, path_local);
         
+        DirEntry** res_entry = (DirEntry**) malloc((contents->n_entries + 1) * sizeof(DirEntry*));
+        if (!res_entry) return false;
+        
         while (pos < contents->n_entries) {
             char opt_names[_MAX_FS_OPT+1][32+1];
-            DirEntry* res_entry[MAX_DIR_ENTRIES+1] = { NULL };
             u32 n_opt = 0;
+            memset(res_entry, 0x00, (contents->n_entries + 1) * sizeof(DirEntry*));
             for (; pos < contents->n_entries; pos++) {
                 DirEntry* entry = &(contents->entry[pos]);
                 if (((entry->type == T_DIR) && no_dirs) ||
@@ -855,21 +1030,32 @@ bool FileSelectorWorker(char* result, const char* text, const char* path, const
             for (u32 i = 0; i <= _MAX_FS_OPT; i++) optionstr[i] = opt_names[i];
             u32 user_select = new_style ? ShowFileScrollPrompt(n_opt, (const DirEntry**)res_entry, hide_ext, "%s", text)
                                         : ShowSelectPrompt(n_opt, optionstr, "%s", text);
-            if (!user_select) return false;
+            if (!user_select) {
+                free(res_entry);
+                return false;
+            }
             DirEntry* res_local = res_entry[user_select-1];
             if (res_local && (res_local->type == T_DIR)) { // selected dir
                 if (select_dirs) {
                     strncpy(result, res_local->path, 256);
-                    return true;
-                } else if (FileSelectorWorker(result, text, res_local->path, pattern, flags, buffer, new_style)) {
+                    free(res_entry);
                     return true;
                 }
+                char path_sub[256];
+                strncpy(path_sub, res_local->path, 256);
+                path_sub[255] = '\0';
+                free(res_entry);
+                res_entry = NULL;
+                if (FileSelectorWorker(result, text, path_sub, pattern, flags, buffer, new_style))
+                    return true;
                 break;
             } else if (res_local && (res_local->type == T_FILE)) { // selected file
                 strncpy(result, res_local->path, 256);
+                free(res_entry);
                 return true;
             }
         }
+        free(res_entry);
         if (!n_found) { // not a single matching entry found
             char pathstr[32+1];
             TruncateString(pathstr, path_local, 32, 8);
@@ -880,10 +1066,10 @@ bool FileSelectorWorker(char* result, const char* text, const char* path, const
 }
 
 bool FileSelector(char* result, const char* text, const char* path, const char* pattern, u32 flags, bool new_style) {
-    void* buffer = (void*) malloc(sizeof(DirStruct));
-    if (!buffer) return false;
+    DirStruct* contents = AllocDirStruct();
+    if (!contents) return false;
     
-    bool ret = FileSelectorWorker(result, text, path, pattern, flags, buffer, new_style);
-    free(buffer);
+    bool ret = FileSelectorWorker(result, text, path, pattern, flags, (void*) contents, new_style);
+    FreeDirStruct(contents);
     return ret;
 }
@@ -45,9 +45,18 @@ size_t FileGetSize(const char* path);
 /** Get SHA-256 of file **/
 bool FileGetSha256(const char* path, u8* sha256, u64 offset, u64 size);
 
+/** Get SHA-256, SHA-1 and CRC32 of file in a single pass (NULL to skip any) **/
+bool FileGetDigests(const char* path, u8* sha256, u8* sha1, u32* crc32, u64 offset, u64 size);
+
 /** Find data in file **/
 u32 FileFindData(const char* path, u8* data, u32 size_data, u32 offset_file);
 
+/** Find data in file, mask bits set to zero are wildcards (mask may be NULL) **/
+u32 FileFindDataMasked(const char* path, const u8* data, const u8* mask, u32 size_data, u32 offset_file);
+
+/** Find all occurrences of data in file @offset, returns number of hits **/
+u32 FileFindDataAll(const char* path, const u8* data, const u8* mask, u32 size_data, u64 offset_file, u64* found, u32 max_found);
+
 /** Inject file into file @offset **/
 bool FileInjectFile(const char* dest, const char* orig, u64 off_dest, u64 off_orig, u64 size, u32* flags);
 
@@ -1,20 +1,55 @@
 #include "image.h"
 #include "vff.h"
+#include "sparse.h"
 #include "nandcmac.h"
+#include "nand.h"
 
 static FIL mount_file;
 static u64 mount_state = 0;
 
 static char mount_path[256] = { 0 };
 
+#define CLMT_MIN_SIZE   64 // initial size of the cluster link map (in DWORDs)
+static DWORD* mount_clmt = NULL; // cluster link map for fast seek
+
+static SparseImage mount_sparse = { 0 }; // only used for sparse NAND backups
+
 static bool fix_cmac = false;
 
 
+static void FreeMountLinkMap(void) {
+    mount_file.cltbl = NULL;
+    free(mount_clmt);
+    mount_clmt = NULL;
+}
+
+static void BuildMountLinkMap(void) {
+    u32 clmt_size = CLMT_MIN_SIZE;
+    FreeMountLinkMap();
+    if (!mount_file.obj.fs) return; // not a FAT file
+    
+    // try with the minimum size first, retry with the size FatFs tells us
+    while (true) {
+        mount_clmt = (DWORD*) malloc(clmt_size * sizeof(DWORD));
+        if (!mount_clmt) return;
+        mount_clmt[0] = clmt_size;
+        mount_file.cltbl = mount_clmt;
+        FRESULT res = f_lseek(&mount_file, CREATE_LINKMAP);
+        if (res == FR_OK) break;
+        u32 clmt_req = mount_clmt[0];
+        FreeMountLinkMap();
+        if ((res != FR_NOT_ENOUGH_CORE) || (clmt_req <= clmt_size)) return;
+        clmt_size = clmt_req;
+    }
+}
+
 int ReadImageBytes(void* buffer, u64 offset, u64 count) {
     UINT bytes_read;
     UINT ret;
     if (!count) return -1;
     if (!mount_state) return FR_INVALID_OBJECT;
+    if (mount_sparse.index)
+        return (ReadSparseImage(&mount_sparse, buffer, offset, count) == 0) ? 0 : -1;
     if (fvx_tell(&mount_file) != offset) {
         if (fvx_size(&mount_file) < offset) return -1;
         fvx_lseek(&mount_file, offset); 
@@ -26,11 +61,19 @@ int ReadImageBytes(void* buffer, u64 offset, u64 count) {
 int WriteImageBytes(const void* buffer, u64 offset, u64 count) {
     UINT bytes_written;
     UINT ret;
+    bool expand = false;
     if (!count) return -1;
     if (!mount_state) return FR_INVALID_OBJECT;
+    if (mount_sparse.index) return FR_WRITE_PROTECTED; // sparse images are read-only
+    if (offset + count > fvx_size(&mount_file)) {
+        // cluster link map can't be used to expand a file
+        FreeMountLinkMap();
+        expand = true;
+    }
     if (fvx_tell(&mount_file) != offset)
         fvx_lseek(&mount_file, offset);
     ret = fvx_write(&mount_file, buffer, count, &bytes_written);
+    if (expand) BuildMountLinkMap();
     if (ret == 0) fix_cmac = true;
     return (ret != 0) ? (int) ret : (bytes_written != count) ? -1 : 0;
 }
@@ -48,6 +91,7 @@ int SyncImage(void) {
 }
 
 u64 GetMountSize(void) {
+    if (mount_sparse.index) return mount_sparse.image_size;
     return mount_state ? fvx_size(&mount_file) : 0;
 }
 
@@ -61,7 +105,10 @@ const char* GetMountPath(void) {
 
 u64 MountImage(const char* path) {
     u64 type = (path) ? IdentifyFileType(path) : 0;
+    InvalidateNandPartitionCache(NAND_IMGNAND);
     if (mount_state) {
+        if (mount_sparse.index) CloseSparseImage(&mount_sparse);
+        FreeMountLinkMap();
         fvx_close(&mount_file);
         if (fix_cmac) FixFileCmac(mount_path, false);
         fix_cmac = false;
@@ -74,6 +121,12 @@ u64 MountImage(const char* path) {
         return 0;
     fvx_lseek(&mount_file, 0);
     fvx_sync(&mount_file);
+    BuildMountLinkMap();
+    if ((type & FLAG_SPARSE) && (OpenSparseImage(&mount_sparse, &mount_file) != 0)) {
+        FreeMountLinkMap();
+        fvx_close(&mount_file);
+        return 0;
+    }
     strncpy(mount_path, path, 255);
     return (mount_state = type);
 }
@@ -14,6 +14,15 @@ typedef struct {
 } PACKED_STRUCT FilCryptInfo;
 
 static FilCryptInfo filcrypt[NUM_FILCRYPTINFO] = { 0 };
+static FilCryptInfo* filcrypt_last = NULL; // last used crypto info, for quick lookup
+static u32 filcrypt_count = 0; // number of open files with crypto
+
+static u8 filcrypt_keyy[16] __attribute__((aligned(4))); // key Y currently set up in keyslot 0x34
+static u32 filcrypt_keygen = 0; // keyslot 0x34 generation belonging to the above
+static bool filcrypt_keyset = false;
+
+static u8* filcrypt_buffer = NULL; // reusable buffer for encrypted writes
+static u32 filcrypt_bufsize = 0;
 
 static char alias_drv[NUM_ALIAS_DRV]; // 1 char ASCII drive number of the alias drive / 0x00 if unused
 static char alias_path[NUM_ALIAS_DRV][128]; // full path to resolve the alias into
@@ -43,6 +52,9 @@ void dealias_path (TCHAR* alias, const TCHAR* path) {
 FilCryptInfo* fx_find_cryptinfo(FIL* fptr) {
     FilCryptInfo* info = NULL;
     
+    if (filcrypt_last && (filcrypt_last->fptr == fptr))
+        return filcrypt_last;
+    
     for (u32 i = 0; i < NUM_FILCRYPTINFO; i++) {
         if (!info && !filcrypt[i].fptr) // use first free
             info = &filcrypt[i];
@@ -52,9 +64,22 @@ FilCryptInfo* fx_find_cryptinfo(FIL* fptr) {
         }
     }
     
+    if (info && info->fptr) filcrypt_last = info;
     return info;
 }
 
+void fx_setup_cryptkey(FilCryptInfo* info) {
+    // only redo the key setup if the key Y changed or someone else used keyslot 0x34
+    if (!filcrypt_keyset || (filcrypt_keygen != get_aeskey_generation(0x34)) ||
+        (memcmp(filcrypt_keyy, info->keyy, 16) != 0)) {
+        setup_aeskeyY(0x34, info->keyy);
+        memcpy(filcrypt_keyy, info->keyy, 16);
+        filcrypt_keygen = get_aeskey_generation(0x34);
+        filcrypt_keyset = true;
+    }
+    use_aeskey(0x34);
+}
+
 FRESULT fx_decrypt_dsiware (FIL* fp, void* buff, FSIZE_t ofs, UINT len) {
     const u32 mode = AES_CNT_TITLEKEY_DECRYPT_MODE;
     const u32 num_tbl = sizeof(TadContentTable) / sizeof(u32);
@@ -144,7 +169,11 @@ FRESULT fx_decrypt_dsiware (FIL* fp, void* buff, FSIZE_t ofs, UINT len) {
 FRESULT fx_open (FIL* fp, const TCHAR* path, BYTE mode) {
     int num = alias_num(path);
     FilCryptInfo* info = fx_find_cryptinfo(fp);
-    if (info) info->fptr = NULL;
+    FRESULT res;
+    if (info && info->fptr) {
+        info->fptr = NULL;
+        filcrypt_count--;
+    }
     
     if (info && (num >= 0)) {
         // DSIWare Export, mark with the magic number
@@ -171,18 +200,23 @@ FRESULT fx_open (FIL* fp, const TCHAR* path, BYTE mode) {
         // copy over key, FIL pointer
         memcpy(info->keyy, sd_keyy[num], 16);
         info->fptr = fp;
+        filcrypt_count++;
     }
     
-    return fa_open(fp, path, mode);
+    res = fa_open(fp, path, mode);
+    if ((res != FR_OK) && info && info->fptr) {
+        info->fptr = NULL;
+        filcrypt_count--;
+    }
+    return res;
 }
 
 FRESULT fx_read (FIL* fp, void* buff, UINT btr, UINT* br) {
-    FilCryptInfo* info = fx_find_cryptinfo(fp);
+    FilCryptInfo* info = (filcrypt_count) ? fx_find_cryptinfo(fp) : NULL;
     FSIZE_t off = f_tell(fp);
     FRESULT res = f_read(fp, buff, btr, br);
     if (info && info->fptr) {
-        setup_aeskeyY(0x34, info->keyy);
-        use_aeskey(0x34);
+        fx_setup_cryptkey(info);
         if (memcmp(info->ctr, DSIWARE_MAGIC, 16) == 0) fx_decrypt_dsiware(fp, buff, off, btr);
         else ctr_decrypt_byte(buff, buff, btr, off, AES_CNT_CTRNAND_MODE, info->ctr);
     }
@@ -190,17 +224,25 @@ FRESULT fx_read (FIL* fp, void* buff, UINT btr, UINT* br) {
 }
 
 FRESULT fx_write (FIL* fp, const void* buff, UINT btw, UINT* bw) {
-    FilCryptInfo* info = fx_find_cryptinfo(fp);
+    FilCryptInfo* info = (filcrypt_count) ? fx_find_cryptinfo(fp) : NULL;
     FSIZE_t off = f_tell(fp);
     FRESULT res = FR_OK;
     
-    if (info && info->fptr) {
+    // zero length writes go straight to f_write(), no crypto buffer required
+    if (info && info->fptr && btw) {
         if (memcmp(info->ctr, DSIWARE_MAGIC, 16) == 0) return FR_DENIED;
-        void* crypt_buff = (void*) malloc(min(btw, STD_BUFFER_SIZE));
-        if (!crypt_buff) return FR_DENIED;
-    
-        setup_aeskeyY(0x34, info->keyy);
-        use_aeskey(0x34);
+        
+        // crypto buffer is kept until the last crypto file is closed
+        u32 bufsize = min(btw, STD_BUFFER_SIZE);
+        if (filcrypt_bufsize < bufsize) {
+            free(filcrypt_buffer);
+            filcrypt_buffer = (u8*) malloc(bufsize);
+            filcrypt_bufsize = (filcrypt_buffer) ? bufsize : 0;
+        }
+        if (!filcrypt_buffer) return FR_DENIED;
+        u8* crypt_buff = filcrypt_buffer;
+        
+        fx_setup_cryptkey(info);
         *bw = 0;
         for (UINT p = 0; (p < btw) && (res == FR_OK); p += STD_BUFFER_SIZE) {
             UINT pcount = min(STD_BUFFER_SIZE, (btw - p));
@@ -210,15 +252,20 @@ FRESULT fx_write (FIL* fp, const void* buff, UINT btw, UINT* bw) {
             res = f_write(fp, (const void*) crypt_buff, pcount, &bwl);
             *bw += bwl;
         }
-        
-        free(crypt_buff);
     } else res = f_write(fp, buff, btw, bw);
     return res;
 }
 
 FRESULT fx_close (FIL* fp) {
-    FilCryptInfo* info = fx_find_cryptinfo(fp);
-    if (info) memset(info, 0, sizeof(FilCryptInfo));
+    FilCryptInfo* info = (filcrypt_count) ? fx_find_cryptinfo(fp) : NULL;
+    if (info && info->fptr) {
+        memset(info, 0, sizeof(FilCryptInfo));
+        if (!(--filcrypt_count)) {
+            free(filcrypt_buffer);
+            filcrypt_buffer = NULL;
+            filcrypt_bufsize = 0;
+        }
+    }
     return f_close(fp);
 }
 
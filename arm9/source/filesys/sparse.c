@@ -0,0 +1,232 @@
+#include "sparse.h"
+#include "vff.h"
+#include "sha.h"
+#include "ui.h"
+
+
+static bool IsFillChunk(const u8* data, u32 size) {
+    // only 0x00 and 0xFF (erased / unused eMMC) are considered fill bytes
+    if ((*data != 0x00) && (*data != 0xFF)) return false;
+    return (size <= 1) || (memcmp(data, data + 1, size - 1) == 0);
+}
+
+u32 ValidateSparseHeader(const SparseHeader* header) {
+    static const u8 magic[] = { SPARSE_MAGIC };
+    if ((memcmp(header->magic, magic, sizeof(magic)) != 0) ||
+        (header->version != SPARSE_VERSION) ||
+        !header->chunk_size || (header->chunk_size % 0x200) ||
+        !header->image_size || (header->image_size % 0x200) ||
+        (header->n_chunks != (header->image_size + header->chunk_size - 1) / header->chunk_size) ||
+        (header->n_stored > header->n_chunks) ||
+        (header->offset_index < sizeof(SparseHeader)) ||
+        (header->offset_hashes < header->offset_index + (header->n_chunks * sizeof(u32))) ||
+        (header->offset_data < header->offset_hashes + (header->n_chunks * 0x20)))
+        return 1;
+    return 0;
+}
+
+u32 OpenSparseImage(SparseImage* sparse, FIL* file) {
+    SparseHeader header;
+    UINT btr;
+
+    memset(sparse, 0, sizeof(SparseImage));
+    if ((fvx_lseek(file, 0) != FR_OK) ||
+        (fvx_read(file, &header, sizeof(SparseHeader), &btr) != FR_OK) ||
+        (btr != sizeof(SparseHeader)) || (ValidateSparseHeader(&header) != 0))
+        return 1;
+
+    // load the chunk index
+    u32 index_size = header.n_chunks * sizeof(u32);
+    u32* index = (u32*) malloc(index_size);
+    if (!index) return 1;
+    if ((fvx_lseek(file, header.offset_index) != FR_OK) ||
+        (fvx_read(file, index, index_size, &btr) != FR_OK) ||
+        (btr != index_size)) {
+        free(index);
+        return 1;
+    }
+
+    // sanity check for the chunk index
+    for (u32 i = 0; i < header.n_chunks; i++) {
+        if (!(index[i] & SPARSE_CHUNK_FILL) && (index[i] >= header.n_stored)) {
+            free(index);
+            return 1;
+        }
+    }
+
+    sparse->file = file;
+    sparse->image_size = header.image_size;
+    sparse->offset_data = header.offset_data;
+    sparse->offset_hashes = header.offset_hashes;
+    sparse->chunk_size = header.chunk_size;
+    sparse->n_chunks = header.n_chunks;
+    sparse->index = index;
+    return 0;
+}
+
+void CloseSparseImage(SparseImage* sparse) {
+    free(sparse->index);
+    memset(sparse, 0, sizeof(SparseImage));
+}
+
+u32 ReadSparseImage(SparseImage* sparse, void* buffer, u64 offset, u64 count) {
+    u8* buffer8 = (u8*) buffer;
+
+    if (!sparse->index || (offset + count > sparse->image_size))
+        return 1;
+
+    while (count) {
+        u32 chunk = offset / sparse->chunk_size;
+        u32 offset_chunk = offset % sparse->chunk_size;
+        u32 entry = sparse->index[chunk];
+        u64 len = min(count, (u64) sparse->chunk_size - offset_chunk);
+
+        if (entry & SPARSE_CHUNK_FILL) {
+            memset(buffer8, entry & 0xFF, len);
+        } else {
+            // stored chunks are in image order, so consecutive ones can be read in one go
+            for (u32 c = chunk + 1; (len < count) && (c < sparse->n_chunks) &&
+                (sparse->index[c] == entry + (c - chunk)); c++)
+                len = min(count, len + sparse->chunk_size);
+            u64 offset_file = sparse->offset_data + ((u64) entry * sparse->chunk_size) + offset_chunk;
+            UINT btr;
+            if ((fvx_tell(sparse->file) != offset_file) &&
+                (fvx_lseek(sparse->file, offset_file) != FR_OK))
+                return 1;
+            if ((fvx_read(sparse->file, buffer8, len, &btr) != FR_OK) || (btr != len))
+                return 1;
+        }
+
+        buffer8 += len;
+        offset += len;
+        count -= len;
+    }
+
+    return 0;
+}
+
+u32 VerifySparseImage(SparseImage* sparse, const char* path) {
+    u32 hashes_size = sparse->n_chunks * 0x20;
+    u8* hashes = (u8*) malloc(hashes_size);
+    u8* buffer = (u8*) malloc(sparse->chunk_size);
+    UINT btr;
+    u32 ret = 0;
+
+    if (!hashes || !buffer ||
+        (fvx_lseek(sparse->file, sparse->offset_hashes) != FR_OK) ||
+        (fvx_read(sparse->file, hashes, hashes_size, &btr) != FR_OK) ||
+        (btr != hashes_size)) ret = 1;
+
+    // check each stored chunk against its hash
+    if (!ShowProgress(0, 0, path)) ret = 1;
+    for (u32 c = 0; (c < sparse->n_chunks) && (ret == 0); c++) {
+        u64 offset = (u64) c * sparse->chunk_size;
+        u32 len = min((u64) sparse->chunk_size, sparse->image_size - offset);
+        if (!(sparse->index[c] & SPARSE_CHUNK_FILL)) {
+            u8 sha256[0x20];
+            if (ReadSparseImage(sparse, buffer, offset, len) != 0) ret = 1;
+            sha_quick(sha256, buffer, len, SHA256_MODE);
+            if (memcmp(sha256, hashes + (c * 0x20), 0x20) != 0) ret = 1;
+        }
+        if (!ShowProgress(offset + len, sparse->image_size, path)) ret = 1;
+    }
+
+    free(hashes);
+    free(buffer);
+    return ret;
+}
+
+u32 BuildSparseImage(const char* path_out, const char* path_in) {
+    static const u8 magic[] = { SPARSE_MAGIC };
+    u64 image_size = fvx_qsize(path_in);
+    if (!image_size || (image_size % 0x200)) return 1;
+
+    // setup header
+    SparseHeader* header = (SparseHeader*) malloc(sizeof(SparseHeader));
+    if (!header) return 1;
+    memset(header, 0, sizeof(SparseHeader));
+    memcpy(header->magic, magic, sizeof(magic));
+    header->version = SPARSE_VERSION;
+    header->chunk_size = SPARSE_CHUNK_SIZE;
+    header->image_size = image_size;
+    header->n_chunks = (image_size + SPARSE_CHUNK_SIZE - 1) / SPARSE_CHUNK_SIZE;
+    header->offset_index = sizeof(SparseHeader);
+    header->offset_hashes = header->offset_index + align(header->n_chunks * sizeof(u32), 0x200);
+    header->offset_data = header->offset_hashes + align(header->n_chunks * 0x20, 0x200);
+
+    // index and hashes are kept in memory and written when done
+    u32 tables_size = header->offset_data - header->offset_index;
+    u8* tables = (u8*) malloc(tables_size);
+    u8* buffer = (u8*) malloc(STD_BUFFER_SIZE);
+    if (!tables || !buffer) {
+        free(header);
+        free(tables);
+        free(buffer);
+        return 1;
+    }
+    memset(tables, 0, tables_size);
+    u32* index = (u32*) (void*) tables;
+    u8* hashes = tables + (header->offset_hashes - header->offset_index);
+
+    FIL file_in, file_out;
+    if (fvx_open(&file_in, path_in, FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+        free(header);
+        free(tables);
+        free(buffer);
+        return 1;
+    }
+    if (fvx_open(&file_out, path_out, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+        fvx_close(&file_in);
+        free(header);
+        free(tables);
+        free(buffer);
+        return 1;
+    }
+
+    // placeholders for header and tables, stored chunks go after that
+    u32 ret = 0;
+    UINT bt;
+    if ((fvx_write(&file_out, header, sizeof(SparseHeader), &bt) != FR_OK) || (bt != sizeof(SparseHeader)) ||
+        (fvx_write(&file_out, tables, tables_size, &bt) != FR_OK) || (bt != tables_size))
+        ret = 1;
+
+    // main processing loop
+    if (!ShowProgress(0, 0, path_in)) ret = 1;
+    for (u64 pos = 0; (pos < image_size) && (ret == 0); pos += STD_BUFFER_SIZE) {
+        u32 read_bytes = min((u64) STD_BUFFER_SIZE, image_size - pos);
+        if ((fvx_read(&file_in, buffer, read_bytes, &bt) != FR_OK) || (bt != read_bytes)) {
+            ret = 1;
+            break;
+        }
+        if (pos == 0) memcpy(header->sector0, buffer, 0x200);
+        for (u32 i = 0; (i < read_bytes) && (ret == 0); i += SPARSE_CHUNK_SIZE) {
+            u32 c = (pos + i) / SPARSE_CHUNK_SIZE;
+            u32 len = min((u32) SPARSE_CHUNK_SIZE, read_bytes - i);
+            u8* chunk = buffer + i;
+            if (IsFillChunk(chunk, len)) {
+                index[c] = SPARSE_CHUNK_FILL | *chunk;
+                continue;
+            }
+            index[c] = header->n_stored++;
+            sha_quick(hashes + (c * 0x20), chunk, len, SHA256_MODE);
+            if ((fvx_write(&file_out, chunk, len, &bt) != FR_OK) || (bt != len))
+                ret = 1;
+        }
+        if (!ShowProgress(pos + read_bytes, image_size, path_in)) ret = 1;
+    }
+
+    // write final header and tables
+    if ((ret == 0) && ((fvx_lseek(&file_out, 0) != FR_OK) ||
+        (fvx_write(&file_out, header, sizeof(SparseHeader), &bt) != FR_OK) || (bt != sizeof(SparseHeader)) ||
+        (fvx_write(&file_out, tables, tables_size, &bt) != FR_OK) || (bt != tables_size)))
+        ret = 1;
+
+    fvx_close(&file_in);
+    fvx_close(&file_out);
+    if (ret != 0) fvx_unlink(path_out);
+
+    free(header);
+    free(tables);
+    free(buffer);
+    return ret;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "common.h"
+#include "ff.h"
+
+#define SPARSE_MAGIC        'G', 'M', '9', 'S', 'P', 'A', 'R', 'S'
+#define SPARSE_VERSION      1
+#define SPARSE_CHUNK_SIZE   0x20000 // 128kB
+#define SPARSE_CHUNK_FILL   0x80000000 // index flag: chunk not stored, (entry & 0xFF) is the fill byte
+
+// sparse image container:
+// header (0x400 byte) / chunk index (u32 each) / SHA-256 for each chunk / stored chunks
+// chunks consisting of only 0x00 or only 0xFF are not stored
+typedef struct {
+    u8  magic[8];
+    u32 version;
+    u32 chunk_size;
+    u64 image_size;
+    u32 n_chunks;
+    u32 n_stored;
+    u32 offset_index;
+    u32 offset_hashes;
+    u64 offset_data;
+    u8  reserved[0x200 - 0x30];
+    u8  sector0[0x200]; // copy of the first image sector (for filetype detection)
+} PACKED_STRUCT SparseHeader;
+
+typedef struct {
+    FIL* file;
+    u64  image_size;
+    u64  offset_data;
+    u32  offset_hashes;
+    u32  chunk_size;
+    u32  n_chunks;
+    u32* index;
+} SparseImage;
+
+u32 ValidateSparseHeader(const SparseHeader* header);
+u32 OpenSparseImage(SparseImage* sparse, FIL* file);
+void CloseSparseImage(SparseImage* sparse);
+u32 ReadSparseImage(SparseImage* sparse, void* buffer, u64 offset, u64 count);
+u32 VerifySparseImage(SparseImage* sparse, const char* path);
+u32 BuildSparseImage(const char* path_out, const char* path_in);
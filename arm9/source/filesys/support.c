@@ -3,7 +3,8 @@
 #include "vram0.h"
 #include "vff.h"
 
-#define SUPPORT_FILE_PATHS  "0:/gm9/support", "1:/gm9/support" // we also check the VRAM TAR first
+#define SUPPORT_FILE_PATH_SD "0:/gm9/support"
+#define SUPPORT_FILE_PATHS  SUPPORT_FILE_PATH_SD, "1:/gm9/support" // we also check the VRAM TAR first
 #define SUPPORT_DIR_PATHS   "V:", "0:/gm9", "1:/gm9"
 
 
@@ -93,6 +94,12 @@ bool SetAsSupportFile(const char* fname, const char* source)
     return res;
 }
 
+void GetSupportFilePathSD(char* path, const char* fname)
+{
+    if (fname) snprintf(path, 256, "%s/%s", SUPPORT_FILE_PATH_SD, fname);
+    else snprintf(path, 256, "%s", SUPPORT_FILE_PATH_SD);
+}
+
 bool GetSupportDir(char* path, const char* dname)
 {
     const char* base_paths[] = { SUPPORT_DIR_PATHS };
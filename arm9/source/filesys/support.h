@@ -10,6 +10,7 @@ bool CheckSupportFile(const char* fname);
 size_t LoadSupportFile(const char* fname, void* buffer, size_t max_len);
 bool SaveSupportFile(const char* fname, void* buffer, size_t len);
 bool SetAsSupportFile(const char* fname, const char* source);
+void GetSupportFilePathSD(char* path, const char* fname); // SD card only, fname may be NULL for the dir
 
 bool CheckSupportDir(const char* fpath);
 bool FileSelectorSupport(char* result, const char* text, const char* dname, const char* pattern);
@@ -1,6 +1,7 @@
 #include "virtual.h"
 #include "ffconf.h"
 #include "vff.h"
+#include "nandcmac.h" // for the CMAC journal
 
 #if FF_USE_LFN != 0
 #define _MAX_FN_LEN (FF_MAX_LFN)
@@ -14,7 +15,46 @@
 #define VFIL(fp) ((VirtualFile*) (void*) fp->buf)
 #define VDIR(dp) ((VirtualDir*) (void*) &(dp->dptr))
 
+#define QHANDLES 4 // kept open for fvx_qread(), each takes one of the FF_FS_LOCK slots
+
+typedef struct {
+    char path[256]; // empty -> unused
+    u32 last_use;
+    FIL fp;
+} QuickHandle;
+
+// files that info is cached for elsewhere (f.e. script env vars), writes are counted per file
+static const struct { u32 id; const char* path; } wcount_paths[] = {
+    { WCOUNT_SECINFO, "1:/rw/sys/SecureInfo_" }, { WCOUNT_SECINFO, "4:/rw/sys/SecureInfo_" },
+    { WCOUNT_SYS_MOVABLE, "1:/private/movable.sed" }, { WCOUNT_EMU_MOVABLE, "4:/private/movable.sed" }
+};
+static u32 write_count[WCOUNT_N] = { 0 };
+
+static QuickHandle qhandles[QHANDLES];
+static u32 qhandles_tick = 0;
+
+static void CountWrite(const TCHAR* path) {
+    // raw writes to the virtual NAND drives may change any of the watched files
+    if (GetVirtualSource(path) & (VRT_SYSNAND|VRT_EMUNAND)) {
+        for (u32 i = 0; i < WCOUNT_N; i++) write_count[i]++;
+        return;
+    }
+    
+    u32 plen = strnlen(path, 256);
+    while (plen && (path[plen-1] == '/')) plen--;
+    for (u32 i = 0; i < countof(wcount_paths); i++) {
+        // the watched file (SecureInfo_ covers all variants) or one of its parent dirs
+        const char* wpath = wcount_paths[i].path;
+        u32 wlen = strnlen(wpath, 256);
+        if ((plen >= wlen) ? (strncasecmp(path, wpath, wlen) == 0) :
+            ((strncasecmp(path, wpath, plen) == 0) && (wpath[plen] == '/')))
+            write_count[wcount_paths[i].id]++;
+    }
+}
+
 FRESULT fvx_open (FIL* fp, const TCHAR* path, BYTE mode) {
+    FRESULT res;
+    if (mode & FA_WRITE) fvx_qreset(); // kept open read handles would lock this
     #if _VFIL_ENABLED
     VirtualFile* vfile = VFIL(fp);
     memset(fp, 0, sizeof(FIL));
@@ -22,10 +62,19 @@ FRESULT fvx_open (FIL* fp, const TCHAR* path, BYTE mode) {
         fp->obj.fs = NULL;
         fp->obj.objsize = vfile->size;
         fp->fptr = 0;
+        if (mode & FA_WRITE) {
+            JournalCmacWrite(path);
+            CountWrite(path);
+        }
         return FR_OK;
     }
     #endif
-    return fx_open ( fp, path, mode );
+    res = fx_open ( fp, path, mode );
+    if ((res == FR_OK) && (mode & FA_WRITE)) {
+        JournalCmacWrite(path);
+        CountWrite(path);
+    }
+    return res;
 }
 
 FRESULT fvx_read (FIL* fp, void* buff, UINT btr, UINT* br) {
@@ -96,10 +145,17 @@ FRESULT fvx_stat (const TCHAR* path, FILINFO* fno) {
 
 FRESULT fvx_rename (const TCHAR* path_old, const TCHAR* path_new) {
     if ((GetVirtualSource(path_old)) || CheckAliasDrive(path_old)) return FR_DENIED;
-    return f_rename( path_old, path_new );
+    fvx_qreset();
+    CountWrite(path_old);
+    CountWrite(path_new);
+    FRESULT res = f_rename( path_old, path_new );
+    if (res == FR_OK) JournalCmacWrite(path_new);
+    return res;
 }
 
 FRESULT fvx_unlink (const TCHAR* path) {
+    fvx_qreset();
+    CountWrite(path);
     if (GetVirtualSource(path)) {
         VirtualFile vfile;
         if (!GetVirtualFile(&vfile, path, FA_READ)) return FR_NO_PATH;
@@ -147,22 +203,69 @@ FRESULT fvx_readdir (DIR* dp, FILINFO* fno) {
     return f_readdir( dp, fno );
 }
 
+static FRESULT fvx_qopen (QuickHandle** qhp, const TCHAR* path) {
+    QuickHandle* qh = NULL;
+    FRESULT res;
+    
+    // virtual files are cheap to open and may change size, long paths won't fit
+    // alias drive files are crypted, a pooled handle would keep their crypto setup alive
+    *qhp = NULL;
+    if (GetVirtualSource(path) || CheckAliasDrive(path) || (strnlen(path, 256) >= 256)) return FR_OK;
+    
+    // already open?
+    for (u32 i = 0; i < QHANDLES; i++) {
+        if (*(qhandles[i].path) && (strncmp(qhandles[i].path, path, 256) == 0)) {
+            qh = &(qhandles[i]);
+            qh->last_use = ++qhandles_tick;
+            *qhp = qh;
+            return FR_OK;
+        }
+    }
+    
+    // use a free or the least recently used handle
+    for (u32 i = 0; i < QHANDLES; i++) {
+        if (!qh || !*(qhandles[i].path) || (*(qh->path) && (qhandles[i].last_use < qh->last_use)))
+            qh = &(qhandles[i]);
+    }
+    if (*(qh->path)) fx_close(&(qh->fp));
+    *(qh->path) = '\0';
+    
+    res = fx_open(&(qh->fp), path, FA_READ | FA_OPEN_EXISTING);
+    if (res != FR_OK) return res;
+    strncpy(qh->path, path, 256);
+    qh->last_use = ++qhandles_tick;
+    *qhp = qh;
+    return FR_OK;
+}
+
+void fvx_qreset (void) {
+    for (u32 i = 0; i < QHANDLES; i++) {
+        if (!*(qhandles[i].path)) continue;
+        fx_close(&(qhandles[i].fp));
+        *(qhandles[i].path) = '\0';
+    }
+}
+
 FRESULT fvx_qread (const TCHAR* path, void* buff, FSIZE_t ofs, UINT btr, UINT* br) {
     FIL fp;
     FRESULT res;
     UINT brt = 0;
     
-    res = fvx_open(&fp, path, FA_READ | FA_OPEN_EXISTING);
+    // repeated reads from the same file only need a seek and a read
+    QuickHandle* qh;
+    res = fvx_qopen(&qh, path);
+    if ((res == FR_OK) && !qh) res = fvx_open(&fp, path, FA_READ | FA_OPEN_EXISTING);
     if (res != FR_OK) return res;
     
-    res = fvx_lseek(&fp, ofs);
-    if (res != FR_OK) {
-        fvx_close(&fp);
-        return res;
-    }
+    FIL* fpr = (qh) ? &(qh->fp) : &fp;
+    res = fvx_lseek(fpr, ofs);
+    if (res == FR_OK) res = fvx_read(fpr, buff, btr, &brt);
     
-    res = fvx_read(&fp, buff, btr, &brt);
-    fvx_close(&fp);
+    if (!qh) fvx_close(&fp);
+    else if (res != FR_OK) { // don't keep broken handles around
+        fx_close(&(qh->fp));
+        *(qh->path) = '\0';
+    }
     
     if (br) *br = brt;
     else if ((res == FR_OK) && (brt != btr)) res = FR_DENIED;
@@ -381,3 +484,7 @@ FRESULT fvx_findnopath (TCHAR* path, const TCHAR* pattern) {
 bool fvx_opened(const FIL* fp) {
     return (fp->obj.fs != NULL);
 }
+
+u32 fvx_wcount(u32 id) {
+    return (id < WCOUNT_N) ? write_count[id] : 0;
+}
@@ -13,6 +13,11 @@
 #define FN_HIGHEST  0x01
 #define FN_LOWEST   0x02
 
+#define WCOUNT_SECINFO      0 // 1:/4: rw/sys/SecureInfo_*
+#define WCOUNT_SYS_MOVABLE  1 // 1:/private/movable.sed
+#define WCOUNT_EMU_MOVABLE  2 // 4:/private/movable.sed
+#define WCOUNT_N            3
+
 // wrapper functions for ff.h + sddata.h
 // incomplete(!) extension to FatFS to support a common interface for virtual and FAT
 FRESULT fvx_open (FIL* fp, const TCHAR* path, BYTE mode);
@@ -32,6 +37,7 @@ FRESULT fvx_readdir (DIR* dp, FILINFO* fno);
 // additional quick read / write functions
 FRESULT fvx_qread (const TCHAR* path, void* buff, FSIZE_t ofs, UINT btr, UINT* br);
 FRESULT fvx_qwrite (const TCHAR* path, const void* buff, FSIZE_t ofs, UINT btw, UINT* bw);
+void fvx_qreset (void); // close all handles kept open by fvx_qread(), required before unmounting
 
 // additional quick file info functions
 FSIZE_t fvx_qsize (const TCHAR* path);
@@ -47,5 +53,6 @@ FRESULT fvx_preaddir (DIR* dp, FILINFO* fno, const TCHAR* pattern);
 FRESULT fvx_findpath (TCHAR* path, const TCHAR* pattern, BYTE mode);
 FRESULT fvx_findnopath (TCHAR* path, const TCHAR* pattern);
 
-// additional state function
+// additional state functions
 bool fvx_opened(const FIL* fp);
+u32 fvx_wcount(u32 id); // # of write opens / renames / deletes of a WCOUNT_ file, for cache invalidation
@@ -76,9 +76,146 @@ typedef struct {
     Ticket ticket;
 } __attribute__((packed, aligned(4))) TicketEntry;
 
+typedef struct {
+    u32 offset;
+    u32 size;
+    u8* data;
+    bool dirty;
+} BDRITable;
+
+typedef struct {
+    u32 offset;
+    u32 size;
+    u8* data;
+} BDRIPendingWrite;
+
+// open DB with FHT, FAT, DET and FET kept in memory until commit
+// entry data writes are held back as well, so nothing hits the file before commit
+// new entry data only goes to blocks that are free in the on-disk FAT (disk_free)
+typedef struct {
+    FIL file;
+    char path[256];
+    BDRITable tables[4];
+    BDRIPendingWrite* pending;
+    u32 n_pending;
+    u8* disk_free; // bitmap of FAT indices free at transaction start
+    u32 n_fat;
+} BDRITransaction;
+
 static FIL* bdrifp;
+static BDRITransaction* bdri_trans = NULL;
+
+static BDRITable* GetBDRITable(UINT ofs, UINT size) {
+    if (!bdri_trans || (bdrifp != &(bdri_trans->file)))
+        return NULL;
+    for (u32 i = 0; i < countof(bdri_trans->tables); i++) {
+        BDRITable* table = &(bdri_trans->tables[i]);
+        if (table->data && (ofs >= table->offset) && (ofs + size <= table->offset + table->size))
+            return table;
+    }
+    return NULL;
+}
+
+static bool InBDRITransaction(void) {
+    return bdri_trans && (bdrifp == &(bdri_trans->file));
+}
+
+static void ApplyBDRIPendingWrites(UINT ofs, UINT btr, u8* buf) {
+    // later writes go on top of earlier ones
+    for (u32 i = 0; i < bdri_trans->n_pending; i++) {
+        BDRIPendingWrite* pw = &(bdri_trans->pending[i]);
+        if ((pw->offset >= ofs + btr) || (pw->offset + pw->size <= ofs))
+            continue;
+        u32 start = max(pw->offset, ofs);
+        u32 end = min(pw->offset + pw->size, ofs + btr);
+        memcpy(buf + (start - ofs), pw->data + (start - pw->offset), end - start);
+    }
+}
+
+static FRESULT AddBDRIPendingWrite(UINT ofs, UINT btw, const void* buf) {
+    // rewriting the exact same range as the last overlapping write (f.e. replacing an entry twice) reuses its buffer
+    for (u32 i = bdri_trans->n_pending; i > 0; i--) {
+        BDRIPendingWrite* pw = &(bdri_trans->pending[i-1]);
+        if ((pw->offset >= ofs + btw) || (pw->offset + pw->size <= ofs))
+            continue;
+        if ((pw->offset == ofs) && (pw->size == btw)) {
+            memcpy(pw->data, buf, btw);
+            return FR_OK;
+        }
+        break;
+    }
+    
+    BDRIPendingWrite* pending = (BDRIPendingWrite*) realloc(bdri_trans->pending,
+        (bdri_trans->n_pending + 1) * sizeof(BDRIPendingWrite));
+    if (!pending) return FR_NOT_ENOUGH_CORE;
+    bdri_trans->pending = pending;
+    
+    u8* data = (u8*) malloc(btw);
+    if (!data) return FR_NOT_ENOUGH_CORE;
+    memcpy(data, buf, btw);
+    
+    BDRIPendingWrite* pw = &(pending[bdri_trans->n_pending++]);
+    pw->offset = ofs;
+    pw->size = btw;
+    pw->data = data;
+    return FR_OK;
+}
+
+static bool BuildBDRIDiskFreeMap(const u32* fat, u32 n_fat) {
+    u8* disk_free = (u8*) malloc((n_fat + 7) / 8);
+    if (!disk_free) return false;
+    memset(disk_free, 0, (n_fat + 7) / 8);
+    
+    // walk the free node chain, starting at the dummy entry
+    u32 fat_index = getfatindex(fat[1]);
+    for (u32 n = 0; fat_index && (n < n_fat); n++) {
+        if (fat_index >= n_fat) break;
+        u32 last_index = fat_index;
+        if (getfatflag(fat[fat_index*2+1]) && (fat_index + 1 < n_fat))
+            last_index = getfatindex(fat[(fat_index+1)*2+1]);
+        for (u32 i = fat_index; (i <= last_index) && (i < n_fat); i++)
+            disk_free[i >> 3] |= (1 << (i & 7));
+        fat_index = getfatindex(fat[fat_index*2+1]);
+    }
+    
+    bdri_trans->disk_free = disk_free;
+    bdri_trans->n_fat = n_fat;
+    return true;
+}
+
+static bool IsBDRIDiskFree(u32 fat_index, u32 count) {
+    // outside of transactions everything gets written directly anyways
+    if (!InBDRITransaction() || !bdri_trans->disk_free)
+        return true;
+    for (u32 i = fat_index; i < fat_index + count; i++)
+        if ((i >= bdri_trans->n_fat) || !(bdri_trans->disk_free[i >> 3] & (1 << (i & 7))))
+            return false;
+    return true;
+}
+
+static FRESULT OpenBDRIFile(FIL* file, const char* path, BYTE mode) {
+    // reuse the open transaction for the same DB
+    if (bdri_trans && (strncmp(path, bdri_trans->path, 256) == 0)) {
+        bdrifp = &(bdri_trans->file);
+        return FR_OK;
+    }
+    FRESULT res = fvx_open(file, path, mode);
+    bdrifp = (res == FR_OK) ? file : NULL;
+    return res;
+}
+
+static void CloseBDRIFile(void) {
+    if (bdrifp && (!bdri_trans || (bdrifp != &(bdri_trans->file))))
+        fvx_close(bdrifp);
+    bdrifp = NULL;
+}
 
 static FRESULT BDRIRead(UINT ofs, UINT btr, void* buf) {
+    BDRITable* table = GetBDRITable(ofs, btr);
+    if (table) {
+        memcpy(buf, table->data + (ofs - table->offset), btr);
+        return FR_OK;
+    }
     if (bdrifp) {
         FRESULT res;
         UINT br;
@@ -86,11 +223,21 @@ static FRESULT BDRIRead(UINT ofs, UINT btr, void* buf) {
             (fvx_lseek(bdrifp, ofs) != FR_OK)) return FR_DENIED;
         res = fvx_read(bdrifp, buf, btr, &br);
         if ((res == FR_OK) && (br != btr)) res = FR_DENIED;
+        if ((res == FR_OK) && InBDRITransaction())
+            ApplyBDRIPendingWrites(ofs, btr, (u8*) buf);
         return res;
     } else return FR_DENIED;
 }
 
 static FRESULT BDRIWrite(UINT ofs, UINT btw, const void* buf) {
+    BDRITable* table = GetBDRITable(ofs, btw);
+    if (table) {
+        memcpy(table->data + (ofs - table->offset), buf, btw);
+        table->dirty = true;
+        return FR_OK;
+    }
+    if (InBDRITransaction())
+        return AddBDRIPendingWrite(ofs, btw, buf);
     if (bdrifp) {
         FRESULT res;
         UINT bw;
@@ -377,6 +524,13 @@ static u32 AddBDRIEntry(const BDRIFsHeader* fs_header, const u32 fs_header_offse
         }
     }
     
+    // in a transaction, a replacement goes to new blocks as well, the old ones stay intact until commit
+    if (do_replace && InBDRITransaction()) {
+        if (RemoveBDRIEntry(fs_header, fs_header_offset, title_id) != 0)
+            return 1;
+        return AddBDRIEntry(fs_header, fs_header_offset, title_id, entry, size, false);
+    }
+    
     u32 fat_entry[2];
     u32 fat_index = 0;
     
@@ -412,7 +566,7 @@ static u32 AddBDRIEntry(const BDRIFsHeader* fs_header, const u32 fs_header_offse
             } else { // Single-entry node
                 node_size = 1;
             }
-        } while (node_size < size_blocks);
+        } while ((node_size < size_blocks) || !IsBDRIDiskFree(fat_index, size_blocks)); // blocks freed in the open transaction are still in use on disk
 
         const bool shrink_free_node = node_size > size_blocks;
 
@@ -622,22 +776,18 @@ u32 GetNumTitleInfoEntries(const char* path) {
     FIL file;
     TitleDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 0;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TitleDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, false)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 0;
     }
     
     u32 num = GetNumBDRIEntries(&(pre_header.fs_header), sizeof(TitleDBPreHeader) - sizeof(BDRIFsHeader));
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return num;
 }
 
@@ -645,22 +795,18 @@ u32 GetNumTickets(const char* path) {
     FIL file;
     TickDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 0;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TickDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, true)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 0;
     }
 
     u32 num = GetNumBDRIEntries(&(pre_header.fs_header), sizeof(TickDBPreHeader) - sizeof(BDRIFsHeader));
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return num;
 }
 
@@ -668,21 +814,17 @@ u32 ListTitleInfoEntryTitleIDs(const char* path, u8* title_ids, u32 max_title_id
     FIL file;
     TitleDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TitleDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, false) ||
         (ListBDRIEntryTitleIDs(&(pre_header.fs_header), sizeof(TitleDBPreHeader) - sizeof(BDRIFsHeader), title_ids, max_title_ids) != 0)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return 0;
 }
 
@@ -690,21 +832,17 @@ u32 ListTicketTitleIDs(const char* path, u8* title_ids, u32 max_title_ids) {
     FIL file;
     TickDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TickDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, true) ||
         (ListBDRIEntryTitleIDs(&(pre_header.fs_header), sizeof(TickDBPreHeader) - sizeof(BDRIFsHeader), title_ids, max_title_ids) != 0)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return 0;
 }
 
@@ -712,22 +850,18 @@ u32 ReadTitleInfoEntryFromDB(const char* path, const u8* title_id, TitleInfoEntr
     FIL file;
     TitleDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TitleDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, false) ||
         (ReadBDRIEntry(&(pre_header.fs_header), sizeof(TitleDBPreHeader) - sizeof(BDRIFsHeader), title_id, (u8*) tie,
             sizeof(TitleInfoEntry)) != 0)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return 0;
 }
 
@@ -737,11 +871,9 @@ u32 ReadTicketFromDB(const char* path, const u8* title_id, Ticket** ticket) {
     TicketEntry* te = NULL;
     u32 entry_size;
 
-    if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TickDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, true) ||
         (GetBDRIEntrySize(&(pre_header.fs_header), sizeof(TickDBPreHeader) - sizeof(BDRIFsHeader), title_id, &entry_size) != 0) ||
@@ -750,13 +882,11 @@ u32 ReadTicketFromDB(const char* path, const u8* title_id, Ticket** ticket) {
         (ReadBDRIEntry(&(pre_header.fs_header), sizeof(TickDBPreHeader) - sizeof(BDRIFsHeader), title_id, (u8*) te,
             entry_size) != 0)) {
         free(te); // if allocated
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     
     if (te->ticket_size != GetTicketSize(&te->ticket)) {
         free(te);
@@ -780,21 +910,17 @@ u32 RemoveTitleInfoEntryFromDB(const char* path, const u8* title_id) {
     FIL file;
     TitleDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TitleDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, false) ||
         (RemoveBDRIEntry(&(pre_header.fs_header), sizeof(TitleDBPreHeader) - sizeof(BDRIFsHeader), title_id) != 0)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return 0;
 }
 
@@ -802,21 +928,17 @@ u32 RemoveTicketFromDB(const char* path, const u8* title_id) {
     FIL file;
     TickDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TickDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, true) ||
         (RemoveBDRIEntry(&(pre_header.fs_header), sizeof(TickDBPreHeader) - sizeof(BDRIFsHeader), title_id) != 0)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
     
-    fvx_close(&file);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return 0;
 }
 
@@ -824,22 +946,18 @@ u32 AddTitleInfoEntryToDB(const char* path, const u8* title_id, const TitleInfoE
     FIL file;
     TitleDBPreHeader pre_header;
     
-    if (fvx_open(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
+    if (OpenBDRIFile(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TitleDBPreHeader), &pre_header) != FR_OK) || 
         !CheckDBMagic((u8*) &pre_header, false) ||
         (AddBDRIEntry(&(pre_header.fs_header), sizeof(TitleDBPreHeader) - sizeof(BDRIFsHeader), title_id,
             (const u8*) tie, sizeof(TitleInfoEntry), replace) != 0)) {
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
     
-    fvx_close(bdrifp);
-    bdrifp = NULL;
+    CloseBDRIFile();
     return 0;
 }
 
@@ -856,25 +974,151 @@ u32 AddTicketToDB(const char* path, const u8* title_id, const Ticket* ticket, bo
     te->unknown = 1;
     te->ticket_size = GetTicketSize(ticket);
     memcpy(&te->ticket, ticket, te->ticket_size);
-    if (fvx_open(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK) {
+    if (OpenBDRIFile(&file, path, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK) {
         free(te);
         return 1;
     }
     
-    bdrifp = &file;
-    
     if ((BDRIRead(0, sizeof(TickDBPreHeader), &pre_header) != FR_OK) ||
         !CheckDBMagic((u8*) &pre_header, true) ||
         (AddBDRIEntry(&(pre_header.fs_header), sizeof(TickDBPreHeader) - sizeof(BDRIFsHeader), title_id,
             (const u8*) te, entry_size, replace) != 0)) {
         free(te);
-        fvx_close(bdrifp);
-        bdrifp = NULL;
+        CloseBDRIFile();
         return 1;
     }
 
     free(te);
-    fvx_close(bdrifp);
+    CloseBDRIFile();
+    return 0;
+}
+
+u32 BeginBDRITransaction(const char* path, bool write) {
+    u8 pre_header[max(sizeof(TitleDBPreHeader), sizeof(TickDBPreHeader))];
+    const BDRIFsHeader* fs_header;
+    u32 fs_header_offset;
+    
+    if (bdri_trans || (strnlen(path, 256) >= 256))
+        return 1;
+    
+    bdri_trans = (BDRITransaction*) malloc(sizeof(BDRITransaction));
+    if (!bdri_trans)
+        return 1;
+    memset(bdri_trans, 0, sizeof(BDRITransaction));
+    
+    if (fvx_open(&(bdri_trans->file), path, FA_READ | (write ? FA_WRITE : 0) | FA_OPEN_EXISTING) != FR_OK) {
+        free(bdri_trans);
+        bdri_trans = NULL;
+        return 1;
+    }
+    
+    bdrifp = &(bdri_trans->file);
+    
+    if (BDRIRead(0, sizeof(pre_header), pre_header) != FR_OK) {
+        AbortBDRITransaction();
+        return 1;
+    } else if (CheckDBMagic(pre_header, true)) {
+        fs_header = &(((TickDBPreHeader*)(void*) pre_header)->fs_header);
+        fs_header_offset = sizeof(TickDBPreHeader) - sizeof(BDRIFsHeader);
+    } else if (CheckDBMagic(pre_header, false)) {
+        fs_header = &(((TitleDBPreHeader*)(void*) pre_header)->fs_header);
+        fs_header_offset = sizeof(TitleDBPreHeader) - sizeof(BDRIFsHeader);
+    } else {
+        AbortBDRITransaction();
+        return 1;
+    }
+    
+    if ((fs_header->info_offset != 0x20) || (fs_header->fat_entry_count != fs_header->data_block_count)) {
+        AbortBDRITransaction();
+        return 1;
+    }
+    
+    // load FHT, FAT, DET and FET, everything that gets touched by each add / remove
+    const u32 data_offset = fs_header_offset + fs_header->data_offset;
+    const u32 table_offsets[4] = {
+        fs_header_offset + fs_header->fht_offset,
+        fs_header_offset + fs_header->fat_offset,
+        data_offset + fs_header->det_start_block * fs_header->data_block_size,
+        data_offset + fs_header->fet_start_block * fs_header->data_block_size
+    };
+    const u32 table_sizes[4] = {
+        fs_header->fht_bucket_count * sizeof(u32),
+        (fs_header->fat_entry_count + 1) * FAT_ENTRY_SIZE,
+        fs_header->det_block_count * fs_header->data_block_size,
+        fs_header->fet_block_count * fs_header->data_block_size
+    };
+    
+    for (u32 i = 0; i < countof(bdri_trans->tables); i++) {
+        BDRITable* table = &(bdri_trans->tables[i]);
+        u8* data = (u8*) malloc(table_sizes[i]);
+        if (!data || (BDRIRead(table_offsets[i], table_sizes[i], data) != FR_OK)) {
+            free(data);
+            AbortBDRITransaction();
+            return 1;
+        }
+        table->offset = table_offsets[i];
+        table->size = table_sizes[i];
+        table->data = data;
+    }
+    
+    if (!BuildBDRIDiskFreeMap((u32*)(void*) bdri_trans->tables[1].data, fs_header->fat_entry_count + 1)) {
+        AbortBDRITransaction();
+        return 1;
+    }
+    
     bdrifp = NULL;
+    strncpy(bdri_trans->path, path, 256);
+    
     return 0;
 }
+
+u32 CommitBDRITransaction(void) {
+    u32 ret = 0;
+    
+    if (!bdri_trans)
+        return 1;
+    
+    // entry data first, so the tables never point to blocks that aren't written yet
+    // (all of these blocks are free in the on-disk FAT, so a failure here leaves the DB as it was)
+    for (u32 i = 0; i < bdri_trans->n_pending; i++) {
+        BDRIPendingWrite* pw = &(bdri_trans->pending[i]);
+        UINT bw;
+        if ((fvx_lseek(&(bdri_trans->file), pw->offset) != FR_OK) ||
+            (fvx_write(&(bdri_trans->file), pw->data, pw->size, &bw) != FR_OK) ||
+            (bw != pw->size)) {
+            AbortBDRITransaction();
+            return 1;
+        }
+    }
+    
+    // write back all modified tables in one go
+    for (u32 i = 0; i < countof(bdri_trans->tables); i++) {
+        BDRITable* table = &(bdri_trans->tables[i]);
+        UINT bw;
+        if (table->dirty && ((fvx_lseek(&(bdri_trans->file), table->offset) != FR_OK) ||
+            (fvx_write(&(bdri_trans->file), table->data, table->size, &bw) != FR_OK) ||
+            (bw != table->size)))
+            ret = 1;
+        table->dirty = false;
+    }
+    
+    AbortBDRITransaction();
+    return ret;
+}
+
+void AbortBDRITransaction(void) {
+    if (!bdri_trans)
+        return;
+    
+    for (u32 i = 0; i < countof(bdri_trans->tables); i++)
+        free(bdri_trans->tables[i].data);
+    for (u32 i = 0; i < bdri_trans->n_pending; i++)
+        free(bdri_trans->pending[i].data);
+    free(bdri_trans->pending);
+    free(bdri_trans->disk_free);
+    
+    fvx_close(&(bdri_trans->file));
+    free(bdri_trans);
+    bdri_trans = NULL;
+    bdrifp = NULL;
+}
@@ -16,3 +16,13 @@ u32 RemoveTitleInfoEntryFromDB(const char* path, const u8* title_id);
 u32 RemoveTicketFromDB(const char* path, const u8* title_id);
 u32 AddTitleInfoEntryToDB(const char* path, const u8* title_id, const TitleInfoEntry* tie, bool replace);
 u32 AddTicketToDB(const char* path, const u8* title_id, const Ticket* ticket, bool replace);
+
+// batch mode: while a transaction is open, all the above functions operating on the same
+// path reuse the open DB, with FHT / FAT / DET / FET and entry data kept in memory until commit
+// nothing is written to the DB before commit, so abort leaves it untouched
+// on commit, entry data is written first, and only to blocks that are free in the on-disk FAT
+// (replacing an entry allocates new blocks, adding may fail if only just freed blocks would fit)
+// the tables are written last, a failure while writing them back can still corrupt the DB
+u32 BeginBDRITransaction(const char* path, bool write);
+u32 CommitBDRITransaction(void);
+void AbortBDRITransaction(void);
@@ -99,205 +99,215 @@ u32 DecompressCodeLzss(u8* code, u32* code_size, u32 max_size) {
     return 0;
 }
 
-// see https://github.com/dnasdw/3dstool/blob/master/src/backwardlz77.cpp (GPLv3)
+// match finder: hash chains over the 3 bytes in front of each position
+// backward LZ, so a match at p copies from p + offset, going down
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    (0xF + 3)
+#define LZ_WINDOW       (0xFFF + 3)
+#define LZ_HASH_BITS    14
+#define LZ_HASH_SIZE    (1 << LZ_HASH_BITS)
+#define LZ_CHAIN_SIZE   0x2000 // ring buffer, must be a power of two > LZ_WINDOW + LZ_MIN_MATCH
+#define LZ_CHAIN_DEPTH  128 // max number of candidates checked per position
+#define LZ_BLOCK_SIZE   0x8000 // block size for the optimal parser
+
+#define LZ_HASH(p)      (((((u32) (p)[-1] << 16) | ((u32) (p)[-2] << 8) | (p)[-3]) * 0x9E3779B1) >> (32 - LZ_HASH_BITS))
+
 typedef struct {
-    u16 WindowPos;
-    u16 WindowLen;
-    s16* OffsetTable;
-    s16* ReversedOffsetTable;
-    s16* ByteTable;
-    s16* EndTable;
-} sCompressInfo;
+    const u8* data;
+    u32 next_insert; // all positions >= this are in the hash chains
+    u32* head; // LZ_HASH_SIZE entries, 0 means empty
+    u32* prev; // LZ_CHAIN_SIZE entries, next (farther) position with the same hash
+} LzMatchFinder;
 
-void initTable(sCompressInfo* a_pInfo, void* a_pWork) {
-    a_pInfo->WindowPos = 0;
-    a_pInfo->WindowLen = 0;
-    a_pInfo->OffsetTable = (s16*)(a_pWork);
-    a_pInfo->ReversedOffsetTable = (s16*)(a_pWork) + 4098;
-    a_pInfo->ByteTable = (s16*)(a_pWork) + 4098 + 4098;
-    a_pInfo->EndTable = (s16*)(a_pWork) + 4098 + 4098 + 256;
-    
-    for (int i = 0; i < 256; i++) {
-        a_pInfo->ByteTable[i] = -1;
-        a_pInfo->EndTable[i] = -1;
-    }
+typedef struct {
+    u8* dest; // current position in output, grows down
+    u8* dest_start; // output must not go below this
+    u8* flag; // current flag byte
+    u32 n_tokens; // tokens in the current flag byte
+} LzWriter;
+
+static bool InitMatchFinder(LzMatchFinder* mf, const u8* data, u32 size) {
+    mf->data = data;
+    mf->next_insert = size + 1;
+    mf->head = (u32*) malloc((LZ_HASH_SIZE + LZ_CHAIN_SIZE) * sizeof(u32));
+    if (!mf->head) return false;
+    mf->prev = mf->head + LZ_HASH_SIZE;
+    memset(mf->head, 0x00, LZ_HASH_SIZE * sizeof(u32));
+    return true;
 }
 
-int search(sCompressInfo* a_pInfo, const u8* a_pSrc, int* a_nOffset, int a_nMaxSize) {
-    if (a_nMaxSize < 3) {
-        return 0;
+static u32 FindMatch(LzMatchFinder* mf, u32 pos, u32 max_len, u32* offset) {
+    const u8* data = mf->data;
+    
+    // candidates need to be at least LZ_MIN_MATCH bytes ahead
+    for (u32 q = mf->next_insert - 1; (q >= pos + LZ_MIN_MATCH) && (q >= LZ_MIN_MATCH); q--) {
+        u32 h = LZ_HASH(data + q);
+        mf->prev[q & (LZ_CHAIN_SIZE - 1)] = mf->head[h];
+        mf->head[h] = q;
+        mf->next_insert = q;
     }
     
-    const u8* pSearch = NULL;
-    int nSize = 2;
-    const u16 uWindowPos = a_pInfo->WindowPos;
-    const u16 uWindowLen = a_pInfo->WindowLen;
-    s16* pReversedOffsetTable = a_pInfo->ReversedOffsetTable;
+    if ((max_len < LZ_MIN_MATCH) || (pos < LZ_MIN_MATCH))
+        return 0;
     
-    for (s16 nOffset = a_pInfo->EndTable[*(a_pSrc - 1)]; nOffset != -1; nOffset = pReversedOffsetTable[nOffset]) {
-        if (nOffset < uWindowPos) {
-            pSearch = a_pSrc + uWindowPos - nOffset;
-        } else {
-            pSearch = a_pSrc + uWindowLen + uWindowPos - nOffset;
-        }
+    u32 best = LZ_MIN_MATCH - 1;
+    u32 depth = LZ_CHAIN_DEPTH;
+    for (u32 q = mf->head[LZ_HASH(data + pos)]; q && depth; q = mf->prev[q & (LZ_CHAIN_SIZE - 1)], depth--) {
+        u32 off = q - pos;
+        if (off > LZ_WINDOW) break; // everything after this is even farther away
         
-        if (pSearch - a_pSrc < 3) {
+        // source and destination may not overlap
+        u32 lim = min(max_len, off);
+        if ((lim <= best) || (data[q - 1 - best] != data[pos - 1 - best]))
             continue;
-        }
-        
-        if (*(pSearch - 2) != *(a_pSrc - 2) || *(pSearch - 3) != *(a_pSrc - 3)) {
-            continue;
-        }
         
-        int nMaxSize = (int)((s64)min(a_nMaxSize, pSearch - a_pSrc));
-        int nCurrentSize = 3;
+        u32 len = 0;
+        while ((len < lim) && (data[q - 1 - len] == data[pos - 1 - len]))
+            len++;
         
-        while (nCurrentSize < nMaxSize && *(pSearch - nCurrentSize - 1) == *(a_pSrc - nCurrentSize - 1)) {
-            nCurrentSize++;
-        }
-        
-        if (nCurrentSize > nSize) {
-            nSize = nCurrentSize;
-            *a_nOffset = (int)(pSearch - a_pSrc);
-            if (nSize == a_nMaxSize) {
-                break;
-            }
+        if (len > best) {
+            best = len;
+            *offset = off;
+            if (best == max_len) break;
         }
     }
     
-    if (nSize < 3) {
-        return 0;
-    }
-    
-    return nSize;
+    return (best >= LZ_MIN_MATCH) ? best : 0;
 }
 
-void slideByte(sCompressInfo* a_pInfo, const u8* a_pSrc) {
-    u8 uInData = *(a_pSrc - 1);
-    u16 uInsertOffset = 0;
-    const u16 uWindowPos = a_pInfo->WindowPos;
-    const u16 uWindowLen = a_pInfo->WindowLen;
-    s16* pOffsetTable = a_pInfo->OffsetTable;
-    s16* pReversedOffsetTable = a_pInfo->ReversedOffsetTable;
-    s16* pByteTable = a_pInfo->ByteTable;
-    s16* pEndTable = a_pInfo->EndTable;
-    
-    if (uWindowLen == 4098) {
-        u8 uOutData = *(a_pSrc + 4097);
-        
-        if ((pByteTable[uOutData] = pOffsetTable[pByteTable[uOutData]]) == -1) {
-            pEndTable[uOutData] = -1;
-        } else {
-            pReversedOffsetTable[pByteTable[uOutData]] = -1;
-        }
-        
-        uInsertOffset = uWindowPos;
-    } else {
-        uInsertOffset = uWindowLen;
+static bool PutToken(LzWriter* w, const u8* src, u32 len, u32 offset) {
+    if (!w->flag || (w->n_tokens == 8)) {
+        if (w->dest - w->dest_start < 1) return false;
+        w->flag = --(w->dest);
+        *(w->flag) = 0;
+        w->n_tokens = 0;
     }
     
-    s16 nOffset = pEndTable[uInData];
-    
-    if (nOffset == -1) {
-        pByteTable[uInData] = uInsertOffset;
-    } else {
-        pOffsetTable[nOffset] = uInsertOffset;
+    if (len < LZ_MIN_MATCH) { // literal byte
+        if (w->dest - w->dest_start < 1) return false;
+        *--(w->dest) = *(src - 1);
+    } else { // segment, see CODE_SEG_OFFSET() / CODE_SEG_SIZE()
+        if (w->dest - w->dest_start < 2) return false;
+        *(w->flag) |= 0x80 >> w->n_tokens;
+        *--(w->dest) = ((len - 3) << 4 & 0xF0) | ((offset - 3) >> 8 & 0x0F);
+        *--(w->dest) = (offset - 3) & 0xFF;
     }
     
-    pEndTable[uInData] = uInsertOffset;
-    pOffsetTable[uInsertOffset] = -1;
-    pReversedOffsetTable[uInsertOffset] = nOffset;
+    w->n_tokens++;
+    return true;
+}
+
+static bool CompressProgress(u32 done, u32 total) {
+    if (!ShowProgress(done, total, "Compressing .code...")) {
+        if (ShowPrompt(true, "Compressing .code...\nB button detected. Cancel?"))
+            return false;
+        ShowProgress(0, total, "Compressing .code...");
+        ShowProgress(done, total, "Compressing .code...");
+    }
+    return true;
+}
+
+// greedy parse, always take the longest match
+static bool CompressGreedy(LzMatchFinder* mf, LzWriter* w, u32 size) {
+    u32 pos = size;
     
-    if (uWindowLen == 4098) {
-        a_pInfo->WindowPos = (uWindowPos + 1) % 4098;
-    } else {
-        a_pInfo->WindowLen++;
+    while (pos > 0) {
+        if ((w->n_tokens == 8 || !w->flag) && !CompressProgress(size - pos, size))
+            return false;
+        
+        u32 offset = 0;
+        u32 len = FindMatch(mf, pos, min(LZ_MAX_MATCH, pos), &offset);
+        if (!len) len = 1;
+        if (!PutToken(w, mf->data + pos, len, offset))
+            return false;
+        pos -= len;
     }
+    
+    return true;
 }
 
-static inline void slide(sCompressInfo* a_pInfo, const u8* a_pSrc, int a_nSize) {
-    for (int i = 0; i < a_nSize; i++) {
-        slideByte(a_pInfo, a_pSrc--);
+// optimal parse (least output bits) inside blocks of LZ_BLOCK_SIZE byte
+// literals cost 9 bit, segments cost 17 bit, matches may not cross the block start
+static bool CompressOptimal(LzMatchFinder* mf, LzWriter* w, u32 size) {
+    u8* match_len = (u8*) malloc(LZ_BLOCK_SIZE + 1);
+    u16* match_off = (u16*) malloc((LZ_BLOCK_SIZE + 1) * sizeof(u16));
+    u32* cost = (u32*) malloc((LZ_BLOCK_SIZE + 1) * sizeof(u32));
+    u8* choice = (u8*) malloc(LZ_BLOCK_SIZE + 1);
+    bool ret = (match_len && match_off && cost && choice);
+    
+    for (u32 pos_hi = size; ret && (pos_hi > 0);) {
+        u32 pos_lo = (pos_hi > LZ_BLOCK_SIZE) ? pos_hi - LZ_BLOCK_SIZE : 0;
+        u32 n = pos_hi - pos_lo;
+        
+        // find the longest match for each position (shorter ones are valid, too)
+        for (u32 i = n; i > 0; i--) {
+            if (!(i & 0xFFF) && !CompressProgress(size - (pos_lo + i), size)) {
+                ret = false;
+                break;
+            }
+            // shortcut for long runs: extend the previous max length match by one byte
+            u32 offset = (i < n) ? match_off[i+1] : 0;
+            const u8* ptr = mf->data + pos_lo + i;
+            if ((i < n) && (i >= LZ_MAX_MATCH) && (match_len[i+1] == LZ_MAX_MATCH) &&
+                (offset >= LZ_MAX_MATCH) && (*(ptr - LZ_MAX_MATCH) == *(ptr + offset - LZ_MAX_MATCH))) {
+                match_len[i] = LZ_MAX_MATCH;
+                match_off[i] = offset;
+                continue;
+            }
+            match_len[i] = FindMatch(mf, pos_lo + i, min(LZ_MAX_MATCH, i), &offset);
+            match_off[i] = offset;
+        }
+        if (!ret) break;
+        
+        // cheapest encoding for each prefix of the block
+        cost[0] = 0;
+        for (u32 i = 1; i <= n; i++) {
+            cost[i] = cost[i-1] + 9;
+            choice[i] = 1;
+            for (u32 len = LZ_MIN_MATCH; len <= match_len[i]; len++) {
+                if (cost[i-len] + 17 < cost[i]) {
+                    cost[i] = cost[i-len] + 17;
+                    choice[i] = len;
+                }
+            }
+        }
+        
+        // write tokens, back to front
+        for (u32 i = n; i > 0; i -= choice[i]) {
+            if (!PutToken(w, mf->data + pos_lo + i, choice[i], match_off[i])) {
+                ret = false;
+                break;
+            }
+        }
+        
+        pos_hi = pos_lo;
     }
+    
+    free(match_len);
+    free(match_off);
+    free(cost);
+    free(choice);
+    return ret;
 }
 
 s64 alignBytes(s64 a_nData, s64 a_nAlignment) {
     return (a_nData + a_nAlignment - 1) / a_nAlignment * a_nAlignment;
 }
 
-bool CompressCodeLzss(const u8* a_pUncompressed, u32 a_uUncompressedSize, u8* a_pCompressed, u32* a_uCompressedSize) {
-    const int s_nCompressWorkSize = (4098 + 4098 + 256 + 256) * sizeof(s16);
+bool CompressCodeLzss(const u8* a_pUncompressed, u32 a_uUncompressedSize, u8* a_pCompressed, u32* a_uCompressedSize, bool optimal) {
     bool bResult = true;
     
     if (a_uUncompressedSize > sizeof(CodeLzssFooter) && *a_uCompressedSize >= a_uUncompressedSize) {
-        u8* pWork = malloc(s_nCompressWorkSize * sizeof(u8));
-        if (!pWork) return false;
+        LzMatchFinder mf;
+        LzWriter w = { a_pCompressed + a_uUncompressedSize, a_pCompressed, NULL, 0 };
         
-        do {
-            sCompressInfo info;
-            initTable(&info, pWork);
-            
-            const int nMaxSize = 0xF + 3;
-            const u8* pSrc = a_pUncompressed + a_uUncompressedSize;
-            u8* pDest = a_pCompressed + a_uUncompressedSize;
-            
-            while (pSrc - a_pUncompressed > 0 && pDest - a_pCompressed > 0) {
-                if (!ShowProgress((u32)(a_pUncompressed + a_uUncompressedSize - pSrc), a_uUncompressedSize, "Compressing .code...")) {
-                    if (ShowPrompt(true, "Compressing .code...\nB button detected. Cancel?")) {
-                        bResult = false;
-                        break;
-                    }
-                    ShowProgress(0, a_uUncompressedSize, "Compressing .code...");
-                    ShowProgress((u32)(a_pUncompressed + a_uUncompressedSize - pSrc), a_uUncompressedSize, "Compressing .code...");
-                }
-                
-                u8* pFlag = --pDest;
-                *pFlag = 0;
-                
-                for (int i = 0; i < 8; i++) {
-                    int nOffset = 0;
-                    int nSize = search(&info, pSrc, &nOffset, (int)((s64)min((s64)min(nMaxSize, pSrc - a_pUncompressed), a_pUncompressed + a_uUncompressedSize - pSrc)));
-                    
-                    if (nSize < 3) {
-                        if (pDest - a_pCompressed < 1) {
-                            bResult = false;
-                            break;
-                        }
-                        
-                        slide(&info, pSrc, 1);
-                        *--pDest = *--pSrc;
-                    } else {
-                        if (pDest - a_pCompressed < 2) {
-                            bResult = false;
-                            break;
-                        }
-                        
-                        *pFlag |= 0x80 >> i;
-                        slide(&info, pSrc, nSize);
-                        pSrc -= nSize;
-                        nSize -= 3;
-                        *--pDest = (nSize << 4 & 0xF0) | ((nOffset - 3) >> 8 & 0x0F);
-                        *--pDest = (nOffset - 3) & 0xFF;
-                    }
-                    
-                    if (pSrc - a_pUncompressed <= 0) {
-                        break;
-                    }
-                }
-                
-                if (!bResult) {
-                    break;
-                }
-            }
-            
-            if (!bResult) {
-                break;
-            }
-            
-            *a_uCompressedSize = (u32)(a_pCompressed + a_uUncompressedSize - pDest);
-        } while (false);
+        if (!InitMatchFinder(&mf, a_pUncompressed, a_uUncompressedSize)) return false;
+        CompressProgress(0, a_uUncompressedSize);
+        bResult = optimal ? CompressOptimal(&mf, &w, a_uUncompressedSize) :
+            CompressGreedy(&mf, &w, a_uUncompressedSize);
+        if (bResult) *a_uCompressedSize = (u32)(a_pCompressed + a_uUncompressedSize - w.dest);
         
-        free(pWork);
+        free(mf.head);
     } else {
         bResult = false;
     }
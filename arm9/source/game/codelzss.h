@@ -6,4 +6,4 @@
 
 u32 GetCodeLzssUncompressedSize(void* footer, u32 comp_size);
 u32 DecompressCodeLzss(u8* code, u32* code_size, u32 max_size);
-bool CompressCodeLzss(const u8* a_pUncompressed, u32 a_uUncompressedSize, u8* a_pCompressed, u32* a_uCompressedSize);
+bool CompressCodeLzss(const u8* a_pUncompressed, u32 a_uUncompressedSize, u8* a_pCompressed, u32* a_uCompressedSize, bool optimal);
@@ -1,17 +1,12 @@
 #include "ticketdb.h"
 #include "vbdri.h"
+#include "bdri.h"
+#include "image.h"
 #include "support.h"
 #include "aes.h"
 #include "vff.h"
 #include "fsinit.h"
 
-const char* virtual_tickdb_dirs[] = {
-    "homebrew",
-    "eshop",
-    "system",
-    "unknown",
-};
-
 u32 CryptTitleKey(TitleKeyEntry* tik, bool encrypt, bool devkit) {
     // From https://github.com/profi200/Project_CTR/blob/master/makerom/pki/prod.h#L19
     static const u8 common_keyy[6][16] __attribute__((aligned(16))) = {
@@ -59,56 +54,63 @@ u32 GetTitleKey(u8* titlekey, Ticket* ticket) {
     return 0;
 }
 
-u32 FindTicket(Ticket** ticket, u8* title_id, bool force_legit, bool emunand) {
+static bool tickdb_session = false;
+
+static u32 MountTicketDB(bool emunand) {
     const char* path_db = TICKDB_PATH(emunand); // EmuNAND / SysNAND
     
-    if (!InitImgFS(path_db))
+    // already mounted (within a session)? nothing to do
+    if ((strncmp(GetMountPath(), path_db, 256) == 0) && (GetMountState() & SYS_TICKDB))
+        return 0;
+    
+    if (!InitImgFS(path_db) || !(GetMountState() & SYS_TICKDB)) {
+        InitImgFS(NULL);
         return 1;
+    }
+    
+    return 0;
+}
 
-    char tid_string[17];
-    u64 tid = getbe64(title_id);
-    snprintf(tid_string, 17, "%016llX", tid);
+static void UnmountTicketDB(void) {
+    if (!tickdb_session) InitImgFS(NULL);
+}
 
-    DIR dir;
-    FILINFO fno;
-    char dir_path[12];
-    char tik_path[64];
+void BeginTicketDBSession(void) {
+    tickdb_session = true;
+}
 
-    for (u32 i = force_legit ? 1 : 0; i < 4; i++) {
-        snprintf(dir_path, 12, "T:/%s", virtual_tickdb_dirs[i]);
-        
-        if (fvx_opendir(&dir, dir_path) != FR_OK) {
-            InitImgFS(NULL);
-            return 1;
-        }
-        
-        while ((fvx_readdir(&dir, &fno) == FR_OK) && *(fno.fname)) {
-            if (strncmp(tid_string, fno.fname, 16) == 0) {
-                snprintf(tik_path, 64, "%s/%s", dir_path, fno.fname);
-                
-                u32 size = fvx_qsize(tik_path);
-                if (!(*ticket = malloc(size))) {
-                    InitImgFS(NULL);
-                    return 1;
-                }
-                
-                if ((fvx_qread(tik_path, *ticket, 0, size, NULL) != FR_OK) ||
-                    (force_legit && (ValidateTicketSignature(*ticket) != 0))) {
-                    free(*ticket);
-                    InitImgFS(NULL);
-                    return 1;
-                }
-                
-                InitImgFS(NULL);
-                return 0;
-            }
-        }
-        
-        fvx_closedir(&dir);
+void EndTicketDBSession(void) {
+    if (!tickdb_session) return;
+    tickdb_session = false;
+    if (GetMountState() & SYS_TICKDB) InitImgFS(NULL);
+}
+
+u32 FindTicketInDB(Ticket** ticket, u8* title_id, bool force_legit) {
+    Ticket* tik = NULL;
+    
+    // direct lookup via the BDRI hash buckets, no need to walk the virtual dirs
+    if (ReadTicketFromDB(TICKDB_PART_PATH, title_id, &tik) != 0)
+        return 1;
+    
+    // legit tickets only: this also excludes everything that would be sorted to 'homebrew'
+    if (force_legit && (ValidateTicketSignature(tik) != 0)) {
+        free(tik);
+        return 1;
     }
     
-    InitImgFS(NULL);
-    return 1;
+    if (ticket) *ticket = tik;
+    else free(tik);
+    return 0;
+}
+
+u32 FindTicket(Ticket** ticket, u8* title_id, bool force_legit, bool emunand) {
+    if (MountTicketDB(emunand) != 0)
+        return 1;
+    
+    u32 ret = FindTicketInDB(ticket, title_id, force_legit);
+    
+    UnmountTicketDB();
+    return ret;
 }
 
 u32 FindTitleKey(Ticket* ticket, u8* title_id) {
@@ -8,6 +8,7 @@
 #define TIKDB_SIZE(tdb)     (16 + ((tdb)->n_entries * sizeof(TitleKeyEntry)))
 
 #define TICKDB_PATH(emu)    ((emu) ? "4:/dbs/ticket.db" : "1:/dbs/ticket.db") // EmuNAND / SysNAND
+#define TICKDB_PART_PATH    "D:/partitionA.bin" // decoded DIFF partition, with ticket.db mounted
 #define TICKDB_AREA_OFFSET  0xA1C00 // offset inside the decoded DIFF partition
 #define TICKDB_AREA_RAW     0x0137F000, 0x001C0C00 // raw offsets inside the file
 #define TICKDB_AREA_SIZE    0x00500000 // 5MB, arbitrary (around 1MB is realistic)
@@ -35,7 +36,10 @@ typedef struct {
 
 
 u32 GetTitleKey(u8* titlekey, Ticket* ticket);
+u32 FindTicketInDB(Ticket** ticket, u8* title_id, bool force_legit);
 u32 FindTicket(Ticket** ticket, u8* title_id, bool force_legit, bool emunand);
+void BeginTicketDBSession(void);
+void EndTicketDBSession(void);
 u32 FindTitleKey(Ticket* ticket, u8* title_id);
 u32 AddTitleKeyToInfo(TitleKeysInfo* tik_info, TitleKeyEntry* tik_entry, bool decrypted_in, bool decrypted_out, bool devkit);
 u32 AddTicketToInfo(TitleKeysInfo* tik_info, Ticket* ticket, bool decrypt);
@@ -37,6 +37,8 @@
 #define BOOTFIRM_PATHS  "0:/bootonce.firm", "0:/boot.firm", "1:/boot.firm"
 #define BOOTFIRM_TEMPS  0x1 // bits mark paths as temporary
 
+#define HEXVIEW_MAX_HITS 12 // max hits listed for a hexviewer search
+
 #ifdef SALTMODE // ShadowHand's own bootmenu key override
 #undef  BOOTMENU_KEY
 #define BOOTMENU_KEY    BUTTON_START
@@ -551,6 +553,8 @@ u32 FileHexViewer(const char* path) {
     u32 offset = 0;
     
     u8  found_data[64 + 1] = { 0 };
+    u8  found_mask[64] = { 0 }; // only used for masked searches, zero bits are wildcards
+    bool found_masked = false;
     u32 found_offset = (u32) -1;
     u32 found_size = 0;
     
@@ -739,7 +743,7 @@ u32 FileHexViewer(const char* path) {
             else if ((pad_state & BUTTON_A) && total_data) edit_mode = true;
             else if (pad_state & (BUTTON_B|BUTTON_START)) break;
             else if (found_size && (pad_state & BUTTON_R1) && (pad_state & BUTTON_X)) {
-                found_offset = FileFindData(path, found_data, found_size, found_offset + 1);
+                found_offset = FileFindDataMasked(path, found_data, found_masked ? found_mask : NULL, found_size, found_offset + 1);
                 if (found_offset == (u32) -1) {
                     ShowPrompt(false, "Not found!");
                     found_size = 0;
@@ -748,8 +752,9 @@ u32 FileHexViewer(const char* path) {
                 else if (dual_screen) ClearScreen(BOT_SCREEN, COLOR_STD_BG);
                 else memcpy(BOT_SCREEN, bottom_cpy, SCREEN_SIZE_BOT);
             } else if (pad_state & BUTTON_X) {
-                static const char* optionstr[3] = { "Go to offset", "Search for string", "Search for data" };
-                u32 user_select = ShowSelectPrompt(3, optionstr, "Current offset: %08X\nSelect action:", 
+                static const char* optionstr[5] = { "Go to offset", "Search for string", "Search for data",
+                    "Search for masked data", "List all search hits" };
+                u32 user_select = ShowSelectPrompt(5, optionstr, "Current offset: %08X\nSelect action:", 
                     (unsigned int) offset);
                 if (user_select == 1) { // -> goto offset
                     u64 new_offset = ShowHexPrompt(offset, 8, "Current offset: %08X\nEnter new offset below.",
@@ -759,21 +764,53 @@ u32 FileHexViewer(const char* path) {
                     if (!found_size) *found_data = 0;
                     if (ShowKeyboardOrPrompt((char*) found_data, 64 + 1, "Enter search string below.\n(R+X to repeat search)")) {
                         found_size = strnlen((char*) found_data, 64);
+                        found_masked = false;
                         found_offset = FileFindData(path, found_data, found_size, offset);
                         if (found_offset == (u32) -1) {
                             ShowPrompt(false, "Not found!");
                             found_size = 0;
                         } else offset = found_offset;
                     }
-                } else if (user_select == 3) {
+                } else if ((user_select == 3) || (user_select == 4)) {
                     u32 size = found_size;
-                    if (ShowDataPrompt(found_data, &size, "Enter search data below.\n(R+X to repeat search)")) {
-                        found_size = size;
-                        found_offset = FileFindData(path, found_data, size, offset);
-                        if (found_offset == (u32) -1) {
-                            ShowPrompt(false, "Not found!");
-                            found_size = 0;
-                        } else offset = found_offset;
+                    bool masked = (user_select == 4);
+                    if (ShowDataPrompt(found_data, &size, "Enter search data below.\n(R+X to repeat search)") && size) {
+                        u32 size_mask = size;
+                        if (masked && !found_masked) memset(found_mask, 0xFF, sizeof(found_mask));
+                        if (masked && !ShowDataPrompt(found_mask, &size_mask, "Enter search mask below.\n(zero bits match anything)")) {
+                            size = 0;
+                        } else if (masked && (size_mask < size)) { // missing mask bytes match exactly
+                            memset(found_mask + size_mask, 0xFF, size - size_mask);
+                        }
+                        if (size) {
+                            found_size = size;
+                            found_masked = masked;
+                            found_offset = FileFindDataMasked(path, found_data, found_masked ? found_mask : NULL, size, offset);
+                            if (found_offset == (u32) -1) {
+                                ShowPrompt(false, "Not found!");
+                                found_size = 0;
+                            } else offset = found_offset;
+                        }
+                    }
+                } else if (user_select == 5) { // -> list all hits of the current search
+                    u64 hits[HEXVIEW_MAX_HITS + 1];
+                    u32 n_hits = 0;
+                    if (!found_size) ShowPrompt(false, "Search for something first.");
+                    else n_hits = FileFindDataAll(path, found_data, found_masked ? found_mask : NULL, found_size, 0, hits, HEXVIEW_MAX_HITS + 1);
+                    if (found_size && !n_hits) {
+                        ShowPrompt(false, "Not found!");
+                        found_size = 0;
+                    } else if (n_hits) {
+                        char hitstr[HEXVIEW_MAX_HITS][16];
+                        const char* hitopt[HEXVIEW_MAX_HITS];
+                        for (u32 i = 0; (i < n_hits) && (i < HEXVIEW_MAX_HITS); i++) {
+                            snprintf(hitstr[i], 16, "%08llX", hits[i]);
+                            hitopt[i] = hitstr[i];
+                        }
+                        u32 hit_select = ShowSelectPrompt(min(n_hits, (u32) HEXVIEW_MAX_HITS), hitopt, (n_hits > HEXVIEW_MAX_HITS) ?
+                            "Found more than %lu hits, first %lu:\nSelect offset to go to." : "Found %lu hit(s).\nSelect offset to go to.",
+                            min(n_hits, (u32) HEXVIEW_MAX_HITS), (u32) HEXVIEW_MAX_HITS);
+                        if (hit_select) offset = found_offset = (u32) hits[hit_select - 1];
                     }
                 }
                 if (MAIN_SCREEN == TOP_SCREEN) ClearScreen(TOP_SCREEN, COLOR_STD_BG);
@@ -1108,6 +1145,7 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
     bool extrcodeable = (FTYPE_HASCODE(filetype));
     bool restorable = (FTYPE_RESTORABLE(filetype) && IS_UNLOCKED && !(drvtype & DRV_SYSNAND));
     bool ebackupable = (FTYPE_EBACKUP(filetype));
+    bool sparsebuildable = (FTYPE_SPARSEBUILD(filetype));
     bool ncsdfixable = (FTYPE_NCSDFIXABLE(filetype));
     bool xorpadable = (FTYPE_XORPAD(filetype));
     bool keyinitable = (FTYPE_KEYINIT(filetype)) && !((drvtype & DRV_VIRTUAL) && (drvtype & DRV_SYSNAND));
@@ -1130,7 +1168,7 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
         extrcodeable = (FTYPE_HASCODE(filetype_cxi));
     }
     
-    bool special_opt = mountable || verificable || decryptable || encryptable || cia_buildable || cia_buildable_legit || cxi_dumpable || tik_buildable || key_buildable || titleinfo || renamable || trimable || transferable || hsinjectable || restorable || xorpadable || ebackupable || ncsdfixable || extrcodeable || keyinitable || keyinstallable || bootable || scriptable || fontable || viewable || installable || agbexportable || agbimportable;
+    bool special_opt = mountable || verificable || decryptable || encryptable || cia_buildable || cia_buildable_legit || cxi_dumpable || tik_buildable || key_buildable || titleinfo || renamable || trimable || transferable || hsinjectable || restorable || xorpadable || ebackupable || sparsebuildable || ncsdfixable || extrcodeable || keyinitable || keyinstallable || bootable || scriptable || fontable || viewable || installable || agbexportable || agbimportable;
     
     char pathstr[32+1];
     TruncateString(pathstr, file_path, 32, 8);
@@ -1275,6 +1313,10 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
         return 0;
     }
     else if (user_select == searchdrv) { // -> search drive, open containing path
+        char found_path[256]; // file_path gets overwritten by the new dir listing
+        strncpy(found_path, file_path, 256);
+        found_path[255] = '\0';
+        file_path = found_path;
         char* last_slash = strrchr(file_path, '/');
         if (last_slash) {
             if (N_PANES) { // switch to next pane
@@ -1306,6 +1348,7 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
     int mount = (mountable) ? ++n_opt : -1;
     int restore = (restorable) ? ++n_opt : -1;
     int ebackup = (ebackupable) ? ++n_opt : -1;
+    int sparsebuild = (sparsebuildable) ? ++n_opt : -1;
     int ncsdfix = (ncsdfixable) ? ++n_opt : -1;
     int decrypt = (decryptable) ? ++n_opt : -1;
     int encrypt = (encryptable) ? ++n_opt : -1;
@@ -1337,6 +1380,7 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
     if (mount > 0) optionstr[mount-1] = (filetype & GAME_TMD) ? "Mount CXI/NDS to drive" : "Mount image to drive";
     if (restore > 0) optionstr[restore-1] = "Restore SysNAND (safe)";
     if (ebackup > 0) optionstr[ebackup-1] = "Update embedded backup";
+    if (sparsebuild > 0) optionstr[sparsebuild-1] = "Build sparse NAND backup";
     if (ncsdfix > 0) optionstr[ncsdfix-1] = "Rebuild NCSD header";
     if (show_info > 0) optionstr[show_info-1] = "Show title info";
     if (ciacheck > 0) optionstr[ciacheck-1] = "CIA checker tool";
@@ -1508,6 +1552,7 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
         if ((n_marked > 1) && ShowPrompt(true, "Try to process all %lu selected files?", n_marked)) {
             u32 n_success = 0;
             u32 n_other = 0; 
+            BeginTicketDBSession(); // keep ticket.db mounted for all lookups
             for (u32 i = 0; i < current_dir->n_entries; i++) {
                 const char* path = current_dir->entry[i].path;
                 if (!current_dir->entry[i].marked) 
@@ -1527,6 +1572,7 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
                 }
                 current_dir->entry[i].marked = false;
             }
+            EndTicketDBSession();
             if (n_other) ShowPrompt(false, "%lu/%lu %ss built ok\n%lu/%lu not of same type",
                 n_success, n_marked, type, n_other, n_marked);
             else ShowPrompt(false, "%lu/%lu %ss built ok", n_success, n_marked, type);
@@ -1765,12 +1811,12 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
                 DirEntry* entry = &(current_dir->entry[i]);
                 if (!current_dir->entry[i].marked) continue;
                 ShowProgress(i+1, current_dir->n_entries, entry->name);
-                if (!GoodRenamer(entry, false)) continue;
+                if (!GoodRenamer(current_dir, entry, false)) continue;
                 n_success++;
                 current_dir->entry[i].marked = false;
             }
             ShowPrompt(false, "%lu/%lu renamed ok", n_success, n_marked);
-        } else if (!GoodRenamer(&(current_dir->entry[*cursor]), true)) {
+        } else if (!GoodRenamer(current_dir, &(current_dir->entry[*cursor]), true)) {
             ShowPrompt(false, "%s\nCould not rename to good name", pathstr);
         }
         return 0;
@@ -1862,8 +1908,18 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
         return 0;
     }
     else if (user_select == restore) { // -> restore SysNAND (A9LH preserving)
-        ShowPrompt(false, "%s\nNAND restore %s", pathstr,
-            (SafeRestoreNandDump(file_path) == 0) ? "success" : "failed");
+        const char* restore_opts[2] = { "Changed sectors only (fast)", "Full restore" };
+        user_select = ShowSelectPrompt(2, restore_opts, "%s\nSelect NAND restore mode:", pathstr);
+        if (!user_select) return 0;
+        bool changed_only = (user_select == 1);
+        u64 skipped = 0;
+        if (SafeRestoreNandDump(file_path, changed_only, &skipped) == 0) {
+            if (changed_only) {
+                char skipstr[32];
+                FormatBytes(skipstr, skipped);
+                ShowPrompt(false, "%s\nNAND restore success\n(%s unchanged, skipped)", pathstr, skipstr);
+            } else ShowPrompt(false, "%s\nNAND restore success", pathstr);
+        } else ShowPrompt(false, "%s\nNAND restore failed", pathstr);
         return 0;
     }
     else if (user_select == ncsdfix) { // -> inject sighaxed NCSD
@@ -1899,6 +1955,18 @@ u32 FileHandlerMenu(char* current_path, u32* cursor, u32* scroll, PaneData** pan
         GetDirContents(current_dir, current_path);
         return 0;
     }
+    else if (user_select == sparsebuild) { // -> build sparse NAND backup
+        char dest[256];
+        char* name = strrchr(file_path, '/') + 1;
+        char* ext = strrchr(name, '.');
+        int name_len = (ext) ? (int) (ext - name) : (int) strlen(name);
+        snprintf(dest, 256, OUTPUT_PATH "/%.*s_sparse.bin", name_len, name);
+        bool success = CheckWritePermissions(dest) && (fvx_rmkdir(OUTPUT_PATH) == FR_OK) &&
+            (BuildSparseImage(dest, file_path) == 0);
+        ShowPrompt(false, "%s\nSparse backup %s", pathstr, (success) ? "written to " OUTPUT_PATH : "failed");
+        GetDirContents(current_dir, current_path);
+        return 0;
+    }
     else if (user_select == keyinit) { // -> initialise keys from aeskeydb.bin
         if (ShowPrompt(true, "Warning: Keys are not verified.\nContinue on your own risk?"))
             ShowPrompt(false, "%s\nAESkeydb init %s", pathstr, (InitKeyDb(file_path) == 0) ? "success" : "failed");
@@ -2281,8 +2349,8 @@ u32 GodMode(int entrypoint) {
     }
     
     if (godmode9) {
-        current_dir = (DirStruct*) malloc(sizeof(DirStruct));
-        clipboard = (DirStruct*) malloc(sizeof(DirStruct));
+        current_dir = AllocDirStruct();
+        clipboard = AllocDirStruct();
         panedata = (PaneData*) malloc(N_PANES * sizeof(PaneData));
         if (!current_dir || !clipboard || !panedata) {
             ShowPrompt(false, "Out of memory."); // just to be safe
@@ -2345,11 +2413,13 @@ u32 GodMode(int entrypoint) {
                     (*tpath && PathExist(tpath))) ? ++n_opt : -1;
                 int srch_f = ++n_opt;
                 int fixcmac = (!*current_path && (strspn(curr_entry->path, "14AB") == 1)) ? ++n_opt : -1;
+                int fixdirty = ((fixcmac > 0) && GetNumDirtyFileCmacs(curr_entry->path)) ? ++n_opt : -1;
                 int dirnfo = ++n_opt;
                 int stdcpy = (*current_path && strncmp(current_path, OUTPUT_PATH, 256) != 0) ? ++n_opt : -1;
                 if (srch_t > 0) optionstr[srch_t-1] = "Search for titles";
                 if (srch_f > 0) optionstr[srch_f-1] = "Search for files...";
                 if (fixcmac > 0) optionstr[fixcmac-1] = "Fix CMACs for drive";
+                if (fixdirty > 0) optionstr[fixdirty-1] = "Fix CMACs for changed files";
                 if (dirnfo > 0) optionstr[dirnfo-1] = (*current_path) ? "Show directory info" : "Show drive info";
                 if (stdcpy > 0) optionstr[stdcpy-1] = "Copy to " OUTPUT_PATH;
                 char namestr[32+1];
@@ -2370,6 +2440,10 @@ u32 GodMode(int entrypoint) {
                 } else if (user_select == fixcmac) {
                     RecursiveFixFileCmac(curr_entry->path);
                     ShowPrompt(false, "Fix CMACs for drive finished.");
+                } else if (user_select == fixdirty) {
+                    ShowString("Fixing CMACs, please wait...");
+                    ShowPrompt(false, "Fix CMACs for changed files %s.",
+                        (FixDirtyFileCmacs(curr_entry->path) == 0) ? "finished" : "failed");
                 } else if (user_select == dirnfo) {
                     if (DirFileAttrMenu(curr_entry->path, curr_entry->name)) {
                         ShowPrompt(false, "Failed to analyze %s\n",
@@ -2503,9 +2577,11 @@ u32 GodMode(int entrypoint) {
                     if (ShowPrompt(true, "Delete %u path(s)?", n_marked)) {
                         u32 n_errors = 0;
                         ShowString("Deleting files, please wait...");
+                        bool batch = BeginVirtualBatch(current_path);
                         for (u32 c = 0; c < current_dir->n_entries; c++)
                             if (current_dir->entry[c].marked && !PathDelete(current_dir->entry[c].path))
                                 n_errors++;
+                        if (batch && !EndVirtualBatch()) n_errors = n_marked;
                         ClearScreenF(true, false, COLOR_STD_BG);
                         if (n_errors) ShowPrompt(false, "Failed deleting %u/%u path(s)", n_errors, n_marked);
                     }
@@ -2524,14 +2600,11 @@ u32 GodMode(int entrypoint) {
                 for (u32 c = 0; c < current_dir->n_entries; c++) {
                     if (current_dir->entry[c].marked) {
                         current_dir->entry[c].marked = 0;
-                        DirEntryCpy(&(clipboard->entry[clipboard->n_entries]), &(current_dir->entry[c]));
-                        clipboard->n_entries++;
+                        DirEntryCpy(clipboard, &(current_dir->entry[c]));
                     }
                 }
-                if ((clipboard->n_entries == 0) && (curr_entry->type != T_DOTDOT)) {
-                    DirEntryCpy(&(clipboard->entry[0]), curr_entry);
-                    clipboard->n_entries = 1;
-                }
+                if ((clipboard->n_entries == 0) && (curr_entry->type != T_DOTDOT))
+                    DirEntryCpy(clipboard, curr_entry);
                 if (clipboard->n_entries)
                     last_clipboard_size = clipboard->n_entries;
             } else if ((curr_drvtype & DRV_SEARCH) && (pad_state & BUTTON_Y)) {
@@ -2555,6 +2628,7 @@ u32 GodMode(int entrypoint) {
                 user_select = ((DriveType(clipboard->entry[0].path) & curr_drvtype & DRV_STDFAT)) ?
                     ShowSelectPrompt(2, optionstr, "%s", promptstr) : (ShowPrompt(true, "%s", promptstr) ? 1 : 0);
                 if (user_select) {
+                    bool batch = BeginVirtualBatch(current_path);
                     for (u32 c = 0; c < clipboard->n_entries; c++) {
                         char namestr[36+1];
                         TruncateString(namestr, clipboard->entry[c].name, 36, 12);
@@ -2570,6 +2644,8 @@ u32 GodMode(int entrypoint) {
                             } else ShowPrompt(false, "Failed moving path:\n%s", namestr);
                         }
                     }                        
+                    if (batch && !EndVirtualBatch())
+                        ShowPrompt(false, "Failed writing changes to\n%s", current_path);
                     clipboard->n_entries = 0;
                     GetDirContents(current_dir, current_path);
                 }
@@ -2699,8 +2775,8 @@ u32 GodMode(int entrypoint) {
     DeinitExtFS();
     DeinitSDCardFS();
     
-    if (current_dir) free(current_dir);
-    if (clipboard) free(clipboard);
+    FreeDirStruct(current_dir);
+    FreeDirStruct(clipboard);
     if (panedata) free(panedata);
     
     return exit_mode;
@@ -42,6 +42,7 @@ allow implementing a custom lodepng_crc32.
 
 #define LODEPNG_NO_COMPILE_CRC
 #define LODEPNG_NO_COMPILE_DISK
+#define LODEPNG_NO_COMPILE_ENCODER
 #define LODEPNG_NO_COMPILE_ANCILLARY_CHUNKS
 #define LODEPNG_NO_COMPILE_ERROR_TEXT
 
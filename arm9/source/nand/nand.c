@@ -6,6 +6,7 @@
 #include "fatmbr.h"
 #include "sdmmc.h"
 #include "image.h"
+#include "diskcache.h"
 #include "memmap.h"
 
 
@@ -61,6 +62,26 @@ static bool Crypto0x96 = false;
 
 static u32 emunand_base_sector = 0x000000;
 
+// cached NCSD header and MBRs for SysNAND / EmuNAND / ImgNAND
+typedef struct {
+    u8 ALIGN(8) header[0x200]; // decrypted
+    u32 sector;
+    u32 keyslot;
+    bool cached;
+} NandMbrCache;
+
+typedef struct {
+    u8 ALIGN(8) header[0x200];
+    u32 emunand_base; // EmuNAND base sector at time of caching
+    bool cached;
+    bool valid;
+    NandMbrCache mbr[4]; // index is NP_SUBTYPE
+} NandPartitionCache;
+
+static NandPartitionCache nand_ptcache[3];
+
+static void InvalidateNandPartitionCacheRange(u32 nand_dst, u32 sector, u32 count);
+
 
 bool GetOtp0x90(void* otp0x90, u32 len)
 {
@@ -349,6 +370,10 @@ int ReadNandSectors(void* buffer, u32 sector, u32 count, u32 keyslot, u32 nand_s
 
 int WriteNandSectors(const void* buffer, u32 sector, u32 count, u32 keyslot, u32 nand_dst)
 {
+    // raw writes outdate the FAT sector cache (no effect if coming from the cache)
+    InvalidateDiskCache(DISKCACHE_ALL);
+    InvalidateNandPartitionCacheRange(nand_dst, sector, count);
+    
     // buffer must not be changed, so this is a little complicated
     void* nand_buffer = (void*) malloc(min(STD_BUFFER_SIZE, count * 0x200));
     if (!nand_buffer) return -1;
@@ -421,11 +446,85 @@ u32 GetNandNcsdMinSizeSectors(NandNcsdHeader* ncsd)
     return nand_minsize;
 }
 
+static NandPartitionCache* GetNandPartitionCache(u32 nand_src)
+{
+    NandPartitionCache* cache =
+        (nand_src == NAND_SYSNAND) ? nand_ptcache :
+        (nand_src == NAND_EMUNAND) ? nand_ptcache + 1 :
+        (nand_src == NAND_IMGNAND) ? nand_ptcache + 2 : NULL;
+    if (cache && (nand_src == NAND_EMUNAND) && (cache->emunand_base != emunand_base_sector))
+        memset(cache, 0, sizeof(NandPartitionCache)); // EmuNAND base changed
+    return cache;
+}
+
+static u32 ReadNandNcsdHeader(NandNcsdHeader* ncsd, u32 nand_src)
+{
+    NandPartitionCache* cache = GetNandPartitionCache(nand_src);
+    if (!cache) { // uncached NAND source
+        return ((ReadNandSectors((u8*) ncsd, SECTOR_NCSD, 1, 0xFF, nand_src) == 0) &&
+            (ValidateNandNcsdHeader(ncsd) == 0)) ? 0 : 1;
+    }
+    
+    if (!cache->cached) { // read errors are not cached
+        if (ReadNandSectors(cache->header, SECTOR_NCSD, 1, 0xFF, nand_src) != 0) return 1;
+        cache->valid = (ValidateNandNcsdHeader((NandNcsdHeader*) (void*) cache->header) == 0);
+        cache->emunand_base = emunand_base_sector;
+        cache->cached = true;
+    }
+    
+    if (!cache->valid) return 1;
+    memcpy(ncsd, cache->header, sizeof(NandNcsdHeader));
+    return 0;
+}
+
+static u32 ReadNandMbrHeader(MbrHeader* mbr, NandPartitionInfo* info, u32 subtype, u32 nand_src)
+{
+    NandPartitionCache* cache = GetNandPartitionCache(nand_src);
+    NandMbrCache* mbr_cache = (cache && (subtype < 4)) ? cache->mbr + subtype : NULL;
+    if (mbr_cache && mbr_cache->cached && (mbr_cache->sector == info->sector) && (mbr_cache->keyslot == info->keyslot)) {
+        memcpy(mbr, mbr_cache->header, sizeof(MbrHeader));
+        return 0;
+    }
+    
+    if ((ReadNandSectors((u8*) mbr, info->sector, 1, info->keyslot, nand_src) != 0) ||
+        (ValidateMbrHeader(mbr) != 0))
+        return 1;
+    
+    // only valid MBRs are cached, invalid ones may be due to missing keys
+    if (mbr_cache) {
+        memcpy(mbr_cache->header, mbr, sizeof(MbrHeader));
+        mbr_cache->sector = info->sector;
+        mbr_cache->keyslot = info->keyslot;
+        mbr_cache->cached = true;
+    }
+    
+    return 0;
+}
+
+static void InvalidateNandPartitionCacheRange(u32 nand_dst, u32 sector, u32 count)
+{
+    NandPartitionCache* cache = GetNandPartitionCache(nand_dst);
+    if (!cache) return;
+    if (sector < 2) { // write to sector 0 (NCSD header) or sector 1
+        memset(cache, 0, sizeof(NandPartitionCache));
+        return;
+    }
+    for (u32 i = 0; i < 4; i++)
+        if (cache->mbr[i].cached && (cache->mbr[i].sector - sector < count))
+            cache->mbr[i].cached = false;
+}
+
+void InvalidateNandPartitionCache(u32 nand_src)
+{
+    for (u32 i = 0; i < 3; i++)
+        if (nand_src & (NAND_SYSNAND << i))
+            memset(nand_ptcache + i, 0, sizeof(NandPartitionCache));
+}
+
 u32 GetNandMinSizeSectors(u32 nand_src)
 {
     NandNcsdHeader ncsd;
-    if ((ReadNandSectors((u8*) &ncsd, 0, 1, 0xFF, nand_src) != 0) ||
-        (ValidateNandNcsdHeader(&ncsd) != 0)) return 0;
+    if (ReadNandNcsdHeader(&ncsd, nand_src) != 0) return 0;
     
     return GetNandNcsdMinSizeSectors(&ncsd);
 }
@@ -509,11 +608,10 @@ u32 GetNandPartitionInfo(NandPartitionInfo* info, u32 type, u32 subtype, u32 ind
     // workaround for ZERONAND
     if (nand_src == NAND_ZERONAND) nand_src = NAND_SYSNAND;
 
-    // find type & subtype in NCSD header
+    // find type & subtype in NCSD header (cached)
     u8 ALIGN(8) header[0x200];
-    ReadNandSectors(header, 0x00, 1, 0xFF, nand_src);
     NandNcsdHeader* ncsd = (void*)header;
-    if ((ValidateNandNcsdHeader(ncsd) != 0) ||
+    if ((ReadNandNcsdHeader(ncsd, nand_src) != 0) ||
         ((type == NP_TYPE_FAT) && (GetNandNcsdPartitionInfo(info, NP_TYPE_STD, subtype, 0, ncsd) != 0)) ||
         ((type != NP_TYPE_FAT) && (GetNandNcsdPartitionInfo(info, type, subtype, index, ncsd) != 0)))
         return 1; // not found
@@ -521,9 +619,8 @@ u32 GetNandPartitionInfo(NandPartitionInfo* info, u32 type, u32 subtype, u32 ind
     if (type == NP_TYPE_BONUS) { // size of bonus partition
         info->count = GetNandSizeSectors(nand_src) - info->sector;
     } else if (type == NP_TYPE_FAT) { // FAT type specific stuff
-        ReadNandSectors(header, info->sector, 1, info->keyslot, nand_src);
         MbrHeader* mbr = (void*)header;
-        if ((ValidateMbrHeader(mbr) != 0) || (index >= 4) ||
+        if ((ReadNandMbrHeader(mbr, info, subtype, nand_src) != 0) || (index >= 4) ||
             (mbr->partitions[index].sector == 0) || (mbr->partitions[index].count == 0) ||
             (mbr->partitions[index].sector + mbr->partitions[index].count > info->count))
             return 1;
@@ -584,5 +681,6 @@ u32 GetEmuNandBase(void)
 
 u32 SetEmuNandBase(u32 base_sector)
 {
+    InvalidateNandPartitionCache(NAND_EMUNAND);
     return (emunand_base_sector = base_sector);
 }
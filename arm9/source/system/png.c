@@ -3,6 +3,56 @@
 
 #include "lodepng.h"
 #include "png.h"
+#include "crc32.h"
+#include "vff.h"
+
+#define PNG_IDAT_SIZE	0x2000 // max payload of a single IDAT chunk
+#define PNG_WSIZE	0x2000 // deflate window, power of two, max 0x8000
+#define PNG_HSIZE	0x1000 // hash chain heads, power of two
+#define PNG_CHUNK	(PNG_WSIZE / 4) // max input processed at once, lookahead stays in the window
+#define PNG_MIN_MATCH	3
+#define PNG_MAX_MATCH	258
+
+struct PngWriter {
+	FIL file;
+	char path[256];
+	u32 w, h, y;
+	u32 level;
+	u32 stride; // bytes per filtered row, w * 3 + 1
+	u8 *row_prev, *row_cur; // RGB24
+	u8 *row_best, *row_try; // filter type + filtered RGB24
+	u32 adler_a, adler_b;
+	u32 bitbuf, bitcnt;
+	u32 pos; // # of bytes fed to deflate so far
+	bool error;
+	u16 head[PNG_HSIZE]; // positions are stored mod 0x10000
+	u16 prev[PNG_WSIZE];
+	u8 window[PNG_WSIZE];
+	u32 idat_len;
+	u8 idat[8 + PNG_IDAT_SIZE + 4]; // length, type, payload, CRC
+	u32 n_tokens;
+	u32 tokens[PNG_CHUNK]; // LZ77 output of one chunk, literal or (len << 16) | dist
+};
+
+static const u16 deflate_len_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const u8 deflate_len_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const u16 deflate_dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const u8 deflate_dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// max hash chain length to follow per compression level
+static const u16 deflate_max_chain[10] = { 0, 4, 8, 16, 32, 64, 128, 256, 1024, 4096 };
 
 // dest and src can be the same
 static inline void _rgb24_to_rgb565(u16 *dest, const u8 *src, size_t dim)
@@ -51,28 +101,386 @@ u16 *PNG_Decompress(const u8 *png, size_t png_len, u32 *w, u32 *h)
 	return (u16*)img;
 }
 
-u8 *PNG_Compress(const u16 *fb, u32 w, u32 h, size_t *png_sz)
+static inline void _put_be32(u8 *dest, u32 val)
 {
-	u8 *img, *buf;
-	unsigned res;
-	size_t png_size;
+	dest[0] = val >> 24;
+	dest[1] = val >> 16;
+	dest[2] = val >> 8;
+	dest[3] = val;
+}
 
-	img = NULL;
+static void _png_write(PngWriter *png, const void *data, u32 len)
+{
+	UINT bw;
+	if (png->error) return;
+	if ((fvx_write(&png->file, data, len, &bw) != FR_OK) || (bw != len))
+		png->error = true;
+}
 
-	buf = malloc(w * h * 3);
-	if (!buf) return NULL;
+static void _png_write_chunk(PngWriter *png, const char *type, const u8 *data, u32 len)
+{
+	u8 hdr[8], crc[4];
 
-	_rgb565_to_rgb24(buf, fb, w * h);
-	res = lodepng_encode24(&img, &png_size, buf, w, h);
-	free(buf);
+	_put_be32(hdr, len);
+	memcpy(hdr + 4, type, 4);
+	_put_be32(crc, ~crc32_calculate(crc32_calculate(0xFFFFFFFF, hdr + 4, 4), data, len));
 
-	if (res) {
-		free(img);
+	_png_write(png, hdr, 8);
+	if (len) _png_write(png, data, len);
+	_png_write(png, crc, 4);
+}
+
+static void _png_flush_idat(PngWriter *png)
+{
+	u8 *chunk = png->idat;
+	u32 len = png->idat_len;
+
+	if (!len) return;
+	_put_be32(chunk, len);
+	memcpy(chunk + 4, "IDAT", 4);
+	_put_be32(chunk + 8 + len, ~crc32_calculate(0xFFFFFFFF, chunk + 4, 4 + len));
+	_png_write(png, chunk, 8 + len + 4);
+	png->idat_len = 0;
+}
+
+static inline void _png_put_byte(PngWriter *png, u8 byte)
+{
+	png->idat[8 + png->idat_len++] = byte;
+	if (png->idat_len >= PNG_IDAT_SIZE)
+		_png_flush_idat(png);
+}
+
+// deflate bit output, LSB first, nbits <= 16
+static inline void _deflate_put_bits(PngWriter *png, u32 val, u32 nbits)
+{
+	png->bitbuf |= val << png->bitcnt;
+	png->bitcnt += nbits;
+	while (png->bitcnt >= 8) {
+		_png_put_byte(png, png->bitbuf & 0xFF);
+		png->bitbuf >>= 8;
+		png->bitcnt -= 8;
+	}
+}
+
+static void _deflate_align(PngWriter *png)
+{
+	if (png->bitcnt) _deflate_put_bits(png, 0, 8 - png->bitcnt);
+}
+
+// huffman codes are stored MSB first
+static inline void _deflate_put_code(PngWriter *png, u32 code, u32 nbits)
+{
+	u32 rev = 0;
+	for (u32 i = 0; i < nbits; i++, code >>= 1)
+		rev = (rev << 1) | (code & 1);
+	_deflate_put_bits(png, rev, nbits);
+}
+
+// symbol from the fixed literal / length alphabet
+static inline void _deflate_put_sym(PngWriter *png, u32 sym)
+{
+	if (sym < 144) _deflate_put_code(png, 0x30 + sym, 8);
+	else if (sym < 256) _deflate_put_code(png, 0x190 + sym - 144, 9);
+	else if (sym < 280) _deflate_put_code(png, sym - 256, 7);
+	else _deflate_put_code(png, 0xC0 + sym - 280, 8);
+}
+
+// # of bits for a symbol from the fixed literal / length alphabet
+static inline u32 _deflate_sym_bits(u32 sym)
+{
+	return (sym < 144) ? 8 : (sym < 256) ? 9 : (sym < 280) ? 7 : 8;
+}
+
+static inline void _deflate_match_codes(u32 len, u32 dist, u32 *l, u32 *d)
+{
+	*l = 28;
+	*d = 29;
+	while (deflate_len_base[*l] > len) (*l)--;
+	while (deflate_dist_base[*d] > dist) (*d)--;
+}
+
+static u32 _deflate_match_bits(u32 len, u32 dist)
+{
+	u32 l, d;
+	_deflate_match_codes(len, dist, &l, &d);
+	return _deflate_sym_bits(257 + l) + deflate_len_extra[l] + 5 + deflate_dist_extra[d];
+}
+
+static void _deflate_put_match(PngWriter *png, u32 len, u32 dist)
+{
+	u32 l, d;
+	_deflate_match_codes(len, dist, &l, &d);
+
+	_deflate_put_sym(png, 257 + l);
+	if (deflate_len_extra[l]) _deflate_put_bits(png, len - deflate_len_base[l], deflate_len_extra[l]);
+	_deflate_put_code(png, d, 5);
+	if (deflate_dist_extra[d]) _deflate_put_bits(png, dist - deflate_dist_base[d], deflate_dist_extra[d]);
+}
+
+static inline u32 _deflate_hash(const PngWriter *png, u32 p)
+{
+	const u8 *win = png->window;
+	u32 v = (win[p & (PNG_WSIZE-1)] << 16) | (win[(p+1) & (PNG_WSIZE-1)] << 8) | win[(p+2) & (PNG_WSIZE-1)];
+	return (v * 2654435761U) >> 20; // PNG_HSIZE == 0x1000
+}
+
+static inline void _deflate_insert(PngWriter *png, u32 p)
+{
+	u32 hash = _deflate_hash(png, p);
+	png->prev[p & (PNG_WSIZE-1)] = png->head[hash];
+	png->head[hash] = p & 0xFFFF;
+}
+
+// greedy LZ77 over window positions [p, end) into the token buffer
+// returns the # of bits these tokens take with the fixed huffman codes
+static u32 _deflate_lz77(PngWriter *png, u32 p, u32 end)
+{
+	const u8 *win = png->window;
+	const u32 max_dist = PNG_WSIZE - PNG_CHUNK; // older data may be overwritten by the lookahead
+	const u32 max_chain = deflate_max_chain[png->level];
+	u32 bits = 0;
+
+	png->n_tokens = 0;
+	while (p < end) {
+		u32 best_len = 0, best_dist = 0;
+
+		if (end - p >= PNG_MIN_MATCH) {
+			u32 max_len = min(end - p, PNG_MAX_MATCH);
+			u32 hash = _deflate_hash(png, p);
+			u32 dist = (p - png->head[hash]) & 0xFFFF;
+
+			// stale entries just point somewhere else in the window, matches are verified anyways
+			for (u32 chain = 0; dist && (dist <= p) && (dist <= max_dist) && (chain < max_chain); chain++) {
+				u32 c = p - dist, len = 0;
+				while ((len < max_len) && (win[(c+len) & (PNG_WSIZE-1)] == win[(p+len) & (PNG_WSIZE-1)]))
+					len++;
+				if (len > best_len) {
+					best_len = len;
+					best_dist = dist;
+					if (len == max_len) break;
+				}
+				u32 next = (p - png->prev[c & (PNG_WSIZE-1)]) & 0xFFFF;
+				if (next <= dist) break; // chain has to go back in time
+				dist = next;
+			}
+
+			png->prev[p & (PNG_WSIZE-1)] = png->head[hash];
+			png->head[hash] = p & 0xFFFF;
+		}
+
+		if (best_len >= PNG_MIN_MATCH) {
+			png->tokens[png->n_tokens++] = (best_len << 16) | best_dist;
+			bits += _deflate_match_bits(best_len, best_dist);
+			for (u32 i = 1; i < best_len; i++)
+				if (end - (p + i) >= PNG_MIN_MATCH) _deflate_insert(png, p + i);
+			p += best_len;
+		} else {
+			u8 lit = win[p & (PNG_WSIZE-1)];
+			png->tokens[png->n_tokens++] = lit;
+			bits += _deflate_sym_bits(lit);
+			p++;
+		}
+	}
+
+	return bits;
+}
+
+// non final stored block
+static void _deflate_put_stored(PngWriter *png, const u8 *data, u32 len)
+{
+	_deflate_put_bits(png, 0, 3);
+	_deflate_align(png);
+	_deflate_put_bits(png, len, 16);
+	_deflate_put_bits(png, len ^ 0xFFFF, 16);
+	for (u32 i = 0; i < len; i++)
+		_png_put_byte(png, data[i]);
+}
+
+// non final fixed huffman block from the token buffer
+static void _deflate_put_fixed(PngWriter *png)
+{
+	_deflate_put_bits(png, 1 << 1, 3);
+	for (u32 i = 0; i < png->n_tokens; i++) {
+		u32 token = png->tokens[i];
+		if (token >> 16) _deflate_put_match(png, token >> 16, token & 0xFFFF);
+		else _deflate_put_sym(png, token);
+	}
+	_deflate_put_sym(png, 256);
+}
+
+static void _deflate_data(PngWriter *png, const u8 *data, u32 len)
+{
+	while (len) {
+		u32 n = min(len, PNG_CHUNK);
+
+		// adler32 and window update
+		u32 a = png->adler_a, b = png->adler_b;
+		for (u32 i = 0; i < n; i++) {
+			a += data[i];
+			b += a;
+			png->window[(png->pos + i) & (PNG_WSIZE-1)] = data[i];
+		}
+		png->adler_a = a % 65521;
+		png->adler_b = b % 65521;
+
+		// one block per chunk, stored if fixed huffman codes don't make it any smaller
+		if (png->level) {
+			u32 fixed_bits = 3 + _deflate_lz77(png, png->pos, png->pos + n) + 7;
+			u32 stored_bits = 3 + ((8 - ((png->bitcnt + 3) & 7)) & 7) + 32 + (n * 8);
+			if (fixed_bits < stored_bits) _deflate_put_fixed(png);
+			else _deflate_put_stored(png, data, n);
+		} else _deflate_put_stored(png, data, n);
+
+		png->pos += n;
+		data += n;
+		len -= n;
+	}
+}
+
+// PNG filter type 0...4 for a RGB24 row, returns sum of absolute values
+static u32 _png_filter_row(u8 *dest, const u8 *cur, const u8 *prev, u32 len, u32 type)
+{
+	u32 sum = 0;
+
+	*(dest++) = type;
+	for (u32 i = 0; i < len; i++) {
+		u8 a = (i >= 3) ? cur[i-3] : 0;
+		u8 b = prev ? prev[i] : 0;
+		u8 c = (prev && (i >= 3)) ? prev[i-3] : 0;
+		u8 pred = 0;
+
+		if (type == 1) pred = a;
+		else if (type == 2) pred = b;
+		else if (type == 3) pred = (a + b) >> 1;
+		else if (type == 4) {
+			int p = a + b - c;
+			int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+			pred = ((pa <= pb) && (pa <= pc)) ? a : (pb <= pc) ? b : c;
+		}
+
+		dest[i] = cur[i] - pred;
+		sum += (dest[i] < 0x80) ? dest[i] : 0x100 - dest[i];
+	}
+
+	return sum;
+}
+
+PngWriter *PNG_WriteStart(const char *path, u32 w, u32 h, u32 level)
+{
+	static const u8 png_magic[] = { PNG_MAGIC };
+	PngWriter *png;
+	u8 ihdr[13];
+	u32 stride;
+
+	if (!w || !h || (w > 0x1000000) || (level > 9))
+		return NULL;
+
+	stride = (w * 3) + 1;
+	png = malloc(sizeof(PngWriter) + (stride * 4));
+	if (!png) return NULL;
+
+	memset(png, 0, sizeof(PngWriter));
+	png->row_prev = (u8*)(png + 1);
+	png->row_cur = png->row_prev + stride;
+	png->row_best = png->row_cur + stride;
+	png->row_try = png->row_best + stride;
+	png->w = w;
+	png->h = h;
+	png->level = level;
+	png->stride = stride;
+	png->adler_a = 1;
+	strncpy(png->path, path, 255);
+
+	if (fvx_open(&png->file, path, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+		free(png);
+		return NULL;
+	}
+
+	// signature and header, 8 bit RGB, no interlace
+	_put_be32(ihdr, w);
+	_put_be32(ihdr + 4, h);
+	ihdr[8] = 8;
+	ihdr[9] = 2;
+	ihdr[10] = ihdr[11] = ihdr[12] = 0;
+	_png_write(png, png_magic, sizeof(png_magic));
+	_png_write_chunk(png, "IHDR", ihdr, 13);
+
+	// zlib header, blocks follow per chunk
+	_png_put_byte(png, 0x78);
+	_png_put_byte(png, (level == 0) ? 0x01 : (level < 6) ? 0x5E : (level == 6) ? 0x9C : 0xDA);
+
+	if (png->error) {
+		fvx_close(&png->file);
+		fvx_unlink(png->path);
+		free(png);
 		return NULL;
 	}
 
-	if (png_sz)
-		*png_sz = png_size;
+	return png;
+}
+
+bool PNG_WriteRow(PngWriter *png, const u16 *row)
+{
+	u32 len = png->w * 3;
+
+	if (png->error || (png->y >= png->h))
+		return false;
+
+	_rgb565_to_rgb24(png->row_cur, row, png->w);
+
+	// pick the filter with the lowest sum of absolute differences (stored: no filter)
+	const u8 *prev = png->y ? png->row_prev : NULL;
+	u32 best_sum = _png_filter_row(png->row_best, png->row_cur, prev, len, 0);
+	for (u32 type = 1; png->level && (type <= 4); type++) {
+		u32 sum = _png_filter_row(png->row_try, png->row_cur, prev, len, type);
+		if (sum < best_sum) {
+			u8 *swp = png->row_best;
+			png->row_best = png->row_try;
+			png->row_try = swp;
+			best_sum = sum;
+		}
+	}
+
+	_deflate_data(png, png->row_best, png->stride);
+
+	u8 *swp = png->row_prev;
+	png->row_prev = png->row_cur;
+	png->row_cur = swp;
+	png->y++;
+
+	return !png->error;
+}
+
+bool PNG_WriteEnd(PngWriter *png)
+{
+	bool ok;
+	u8 adler[4];
+
+	if (!png->error && (png->y == png->h)) {
+		// empty final block
+		if (png->level) {
+			_deflate_put_bits(png, 1 | (1 << 1), 3);
+			_deflate_put_sym(png, 256);
+			_deflate_align(png);
+		} else {
+			_deflate_put_bits(png, 1, 3);
+			_deflate_align(png);
+			_deflate_put_bits(png, 0x0000, 16);
+			_deflate_put_bits(png, 0xFFFF, 16);
+		}
+
+		_put_be32(adler, (png->adler_b << 16) | png->adler_a);
+		for (u32 i = 0; i < 4; i++)
+			_png_put_byte(png, adler[i]);
+
+		_png_flush_idat(png);
+		_png_write_chunk(png, "IEND", NULL, 0);
+	}
+
+	ok = !png->error && (png->y == png->h);
+	fvx_close(&png->file);
+	if (!ok) fvx_unlink(png->path);
+	free(png);
 
-	return img;
+	return ok;
 }
@@ -7,4 +7,11 @@
 #define PNG_MAGIC   0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
 
 u16 *PNG_Decompress(const u8 *png, size_t png_len, u32 *w, u32 *h);
-u8 *PNG_Compress(const u16 *fb, u32 w, u32 h, size_t *png_sz);
+
+// row streaming PNG writer, RGB565 rows in, RGB24 PNG out
+// level 0 (stored) ... 9 (slowest), only a few dozen kB of memory are used
+typedef struct PngWriter PngWriter;
+
+PngWriter *PNG_WriteStart(const char *path, u32 w, u32 h, u32 level);
+bool PNG_WriteRow(PngWriter *png, const u16 *row);
+bool PNG_WriteEnd(PngWriter *png);
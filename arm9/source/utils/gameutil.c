@@ -9,6 +9,7 @@
 #include "unittype.h"
 #include "aes.h"
 #include "sha.h"
+#include "timer.h"
 
 // use NCCH crypto defines for everything 
 #define CRYPTO_DECRYPT  NCCH_NOCRYPTO
@@ -46,6 +47,9 @@ u32 GetNcchHeaders(NcchHeader* ncch, NcchExtHeader* exthdr, ExeFsHeader* exefs,
     return 0;
 }
 
+// bytes hashed by the Verify*() functions, see VerifyGameFileHashed()
+static u64 verify_hashed = 0;
+
 u32 CheckNcchHash(u8* expected, FIL* file, u32 size_data, u32 offset_ncch, NcchHeader* ncch, ExeFsHeader* exefs) {
     u32 offset_data = fvx_tell(file) - offset_ncch;
     u8 hash[32];
@@ -60,6 +64,7 @@ u32 CheckNcchHash(u8* expected, FIL* file, u32 size_data, u32 offset_ncch, NcchH
         fvx_read(file, buffer, read_bytes, &bytes_read);
         DecryptNcch(buffer, offset_data + i, read_bytes, ncch, exefs);
         sha_update(buffer, read_bytes);
+        verify_hashed += read_bytes;
     }
     sha_get(hash);
     
@@ -280,6 +285,10 @@ u32 WriteCiaStub(CiaStub* stub, const char* path) {
     return 0;
 }
 
+// batch verification: no prompts from the verify functions
+static bool batch_verify = false;
+#define VerifyPrompt(...) (batch_verify ? false : ShowPrompt(__VA_ARGS__))
+
 u32 VerifyTmdContent(const char* path, u64 offset, TmdContentChunk* chunk, const u8* titlekey) {
     u8 hash[32];
     u8 ctr[16];
@@ -312,6 +321,7 @@ u32 VerifyTmdContent(const char* path, u64 offset, TmdContentChunk* chunk, const
         fvx_read(&file, buffer, read_bytes, &bytes_read);
         if (encrypted) DecryptCiaContentSequential(buffer, read_bytes, ctr, titlekey);
         sha_update(buffer, read_bytes);
+        verify_hashed += read_bytes;
         if (!ShowProgress(i + read_bytes, size, path)) break;
     }
     sha_get(hash);
@@ -339,7 +349,7 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
     // fetch and check NCCH header
     fvx_lseek(&file, offset);
     if (GetNcchHeaders(&ncch, NULL, NULL, &file, cryptofix) != 0) {
-        if (!offset) ShowPrompt(false, "%s\nError: Not a NCCH file", pathstr);
+        if (!offset) VerifyPrompt(false, "%s\nError: Not a NCCH file", pathstr);
         fvx_close(&file);
         return 1;
     }
@@ -347,7 +357,7 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
     // check NCCH size
     if (!size) size = fvx_size(&file) - offset;
     if ((fvx_size(&file) < offset) || (size < ncch.size * NCCH_MEDIA_UNIT)) {
-        if (!offset) ShowPrompt(false, "%s\nError: File is too small", pathstr);
+        if (!offset) VerifyPrompt(false, "%s\nError: File is too small", pathstr);
         fvx_close(&file);
         return 1;
     }
@@ -361,7 +371,7 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
             cryptofix = true;
             fvx_lseek(&file, offset);
             if (GetNcchHeaders(&ncch, NULL, &exefs, &file, cryptofix) == 0) {
-                if (cryptofix_always) borkedflags = true;
+                if (cryptofix_always || batch_verify) borkedflags = true;
                 else {
                     const char* optionstr[3] = { "Attempt fix this time", "Attempt fix always", "Abort verification" };
                     u32 user_select = ShowSelectPrompt(3, optionstr, "%s\nError: Bad crypto flags", pathstr);
@@ -371,7 +381,7 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
             }
         }
         if (!borkedflags) {
-            if (!offset) ShowPrompt(false, "%s\nError: Bad ExeFS header", pathstr);
+            if (!offset) VerifyPrompt(false, "%s\nError: Bad ExeFS header", pathstr);
             fvx_close(&file);
             return 1;
         }
@@ -380,14 +390,14 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
     // fetch and check ExtHeader
     fvx_lseek(&file, offset);
     if (ncch.size_exthdr && (GetNcchHeaders(&ncch, &exthdr, NULL, &file, cryptofix) != 0)) {
-        if (!offset) ShowPrompt(false, "%s\nError: Missing ExtHeader", pathstr);
+        if (!offset) VerifyPrompt(false, "%s\nError: Missing ExtHeader", pathstr);
         fvx_close(&file);
         return 1;
     }
 
     // check / setup crypto
     if (SetupNcchCrypto(&ncch, NCCH_NOCRYPTO) != 0) {
-        if (!offset) ShowPrompt(false, "%s\nError: Crypto not set up", pathstr);
+        if (!offset) VerifyPrompt(false, "%s\nError: Crypto not set up", pathstr);
         fvx_close(&file);
         return 1;
     }
@@ -486,13 +496,13 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
             // verify lvl1
             u32 n_blocks = lvl1_size >> ivfc.log_lvl1;
             u32 block_log = ivfc.log_lvl1;
-            for (u32 i = 0; !ver_romfs && (i < n_blocks); i++) 
+            for (u32 i = 0; !ver_romfs && (i < n_blocks); i++, verify_hashed += 1<<block_log) 
                 ver_romfs = (u32) sha_cmp(masterhash + (i*0x20), lvl1_data + (i<<block_log), 1<<block_log, SHA256_MODE);
             
             // verify lvl2
             n_blocks = lvl2_size >> ivfc.log_lvl2;
             block_log = ivfc.log_lvl2;
-            for (u32 i = 0; !ver_romfs && (i < n_blocks); i++) {
+            for (u32 i = 0; !ver_romfs && (i < n_blocks); i++, verify_hashed += 1<<block_log) {
                 ver_romfs = sha_cmp(lvl1_data + (i*0x20), lvl2_data + (i<<block_log), 1<<block_log, SHA256_MODE);
             }
             
@@ -500,12 +510,27 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
             u64 offset_add = (ncch.offset_romfs * NCCH_MEDIA_UNIT) + GetRomFsLvOffset(&ivfc, 3);
             n_blocks = align(ivfc.size_lvl3, 1 << ivfc.log_lvl3) >> ivfc.log_lvl3;
             block_log = ivfc.log_lvl3;
+            // read, decrypt and hash as many blocks as fit in the buffer at once
+            u32 bufsiz = max(STD_BUFFER_SIZE >> block_log, 1) << block_log;
+            u8* buffer = (!ver_romfs && n_blocks) ? (u8*) malloc(bufsiz) : NULL;
+            if (n_blocks && !buffer) ver_romfs = 1;
             fvx_lseek(&file, offset + offset_add);
-            for (u32 i = 0; !ver_romfs && (i < n_blocks); i++) {
-                ver_romfs = CheckNcchHash(lvl2_data + (i*0x20), &file, 1 << block_log, offset, &ncch, NULL);
-                offset_add += 1 << block_log;
-                if (!(i % 16) && !ShowProgress(i+1, n_blocks, path)) ver_romfs = 1;
+            for (u32 i = 0; !ver_romfs && (i < n_blocks);) {
+                u32 n_read = min(bufsiz >> block_log, n_blocks - i);
+                UINT read_bytes = n_read << block_log;
+                UINT bytes_read;
+                if (fvx_read(&file, buffer, read_bytes, &bytes_read) != FR_OK) {
+                    ver_romfs = 1;
+                    break;
+                }
+                if (bytes_read < read_bytes) memset(buffer + bytes_read, 0, read_bytes - bytes_read);
+                DecryptNcch(buffer, offset_add, read_bytes, &ncch, NULL);
+                for (u32 b = 0; !ver_romfs && (b < n_read); b++, i++, verify_hashed += 1<<block_log)
+                    ver_romfs = sha_cmp(lvl2_data + (i*0x20), buffer + (b<<block_log), 1<<block_log, SHA256_MODE);
+                offset_add += read_bytes;
+                if (!ShowProgress(i, n_blocks, path)) ver_romfs = 1;
             }
+            if (buffer) free(buffer);
         }
 
         if (masterhash) free(masterhash);
@@ -514,7 +539,7 @@ u32 VerifyNcchFile(const char* path, u32 offset, u32 size) {
     }
     
     if (!offset && (ver_exthdr|ver_exefs|ver_romfs)) { // verification summary
-        ShowPrompt(false, "%s\nNCCH verification failed:\nExtHdr/ExeFS/RomFS: %s/%s/%s", pathstr,
+        VerifyPrompt(false, "%s\nNCCH verification failed:\nExtHdr/ExeFS/RomFS: %s/%s/%s", pathstr,
             (!ncch.size_exthdr) ? "-" : (ver_exthdr == 0) ? "ok" : "fail",
             (!ncch.size_exefs) ? "-" : (ver_exefs == 0) ? "ok" : "fail",
             (!ncch.size_romfs) ? "-" : (ver_romfs == 0) ? "ok" : "fail");
@@ -534,7 +559,7 @@ u32 VerifyNcsdFile(const char* path) {
     
     // load NCSD header
     if (LoadNcsdHeader(&ncsd, path) != 0) {
-        ShowPrompt(false, "%s\nError: Not a NCSD file", pathstr);
+        VerifyPrompt(false, "%s\nError: Not a NCSD file", pathstr);
         return 1;
     }
     
@@ -545,7 +570,7 @@ u32 VerifyNcsdFile(const char* path) {
         u32 size = partition->size * NCSD_MEDIA_UNIT;
         if (!size) continue;
         if (VerifyNcchFile(path, offset, size) != 0) {
-            ShowPrompt(false, "%s\nContent%lu (%08lX@%08lX):\nVerification failed",
+            VerifyPrompt(false, "%s\nContent%lu (%08lX@%08lX):\nVerification failed",
                 pathstr, i, size, offset, i);
             return 1;
         }
@@ -569,14 +594,14 @@ u32 VerifyCiaFile(const char* path) {
     if ((LoadCiaStub(cia, path) != 0) ||
         (GetCiaInfo(&info, &(cia->header)) != 0) ||
         (GetTitleKey(titlekey, (Ticket*)&(cia->ticket)) != 0)) {
-        ShowPrompt(false, "%s\nError: Probably not a CIA file", pathstr);
+        VerifyPrompt(false, "%s\nError: Probably not a CIA file", pathstr);
         free(cia);
         return 1;
     }
 
     // verify TMD
     if (VerifyTmd(&(cia->tmd)) != 0) {
-        ShowPrompt(false, "%s\nError: TMD probably corrupted", pathstr);
+        VerifyPrompt(false, "%s\nError: TMD probably corrupted", pathstr);
         free(cia);
         return 1;
     }
@@ -590,7 +615,7 @@ u32 VerifyCiaFile(const char* path) {
         u16 index = getbe16(chunk->index);
         if (!(cnt_index[index/8] & (1 << (7-(index%8))))) continue; // don't check missing contents
         if (VerifyTmdContent(path, next_offset, chunk, titlekey) != 0) {
-            ShowPrompt(false, "%s\nID %08lX (%08llX@%08llX)\nVerification failed",
+            VerifyPrompt(false, "%s\nID %08lX (%08llX@%08llX)\nVerification failed",
                 pathstr, getbe32(chunk->id), getbe64(chunk->size), next_offset, i);
             free(cia);
             return 1;
@@ -622,7 +647,7 @@ u32 VerifyTmdFile(const char* path, bool cdn) {
     TitleMetaData* tmd = (TitleMetaData*) malloc(TMD_SIZE_MAX);
     TmdContentChunk* content_list = (TmdContentChunk*) (tmd + 1);
     if ((LoadTmdFile(tmd, path) != 0) || (VerifyTmd(tmd) != 0)) {
-        ShowPrompt(false, "%s\nError: TMD probably corrupted", pathstr);
+        VerifyPrompt(false, "%s\nError: TMD probably corrupted", pathstr);
         free(tmd);
         return 1;
     }
@@ -635,7 +660,7 @@ u32 VerifyTmdFile(const char* path, bool cdn) {
              (BuildFakeTicket(ticket, tmd->title_id) == 0) &&
              (FindTitleKey(ticket, tmd->title_id) == 0))) ||
             (GetTitleKey(titlekey, ticket) != 0)) {
-            ShowPrompt(false, "%s\nError: CDN titlekey not found", pathstr);
+            VerifyPrompt(false, "%s\nError: CDN titlekey not found", pathstr);
             free(ticket);
             free(tmd);
             return 1;
@@ -653,7 +678,7 @@ u32 VerifyTmdFile(const char* path, bool cdn) {
             (cdn) ? "%08lx" : (dlc) ? "00000000/%08lx.app" : "%08lx.app", getbe32(chunk->id));
         TruncateString(pathstr, path_content, 32, 8);
         if (VerifyTmdContent(path_content, 0, chunk, titlekey) != 0) {
-            ShowPrompt(false, "%s\nVerification failed", pathstr);
+            VerifyPrompt(false, "%s\nVerification failed", pathstr);
             free(tmd);
             return 1;
         }
@@ -685,8 +710,9 @@ u32 VerifyFirmFile(const char* path) {
         FirmSectionHeader* sct = header.sections + i; 
         void* section = ((u8*) firm_buffer) + sct->offset;
         if (!(sct->size)) continue;
+        verify_hashed += sct->size;
         if (sha_cmp(sct->hash, section, sct->size, SHA256_MODE) != 0) {
-            ShowPrompt(false, "%s\nSection %u hash mismatch", pathstr, i);
+            VerifyPrompt(false, "%s\nSection %u hash mismatch", pathstr, i);
             free(firm_buffer);
             return 1;
         }
@@ -694,11 +720,11 @@ u32 VerifyFirmFile(const char* path) {
     
     // no arm11 / arm9 entrypoints?
     if (!header.entry_arm9) {
-        ShowPrompt(false, "%s\nARM9 entrypoint is missing", pathstr);
+        VerifyPrompt(false, "%s\nARM9 entrypoint is missing", pathstr);
         free(firm_buffer);
         return 1;
     } else if (!header.entry_arm11) {
-        ShowPrompt(false, "%s\nWarning: ARM11 entrypoint is missing", pathstr);
+        VerifyPrompt(false, "%s\nWarning: ARM11 entrypoint is missing", pathstr);
     }
     
     free(firm_buffer);
@@ -721,7 +747,7 @@ u32 VerifyBossFile(const char* path) {
     fvx_lseek(&file, 0);
     if ((fvx_read(&file, &boss, sizeof(BossHeader), &btr) != FR_OK) ||
         (btr != sizeof(BossHeader)) || (ValidateBossHeader(&boss, 0) != 0)) {
-        ShowPrompt(false, "%s\nError: Not a BOSS file", pathstr);
+        VerifyPrompt(false, "%s\nError: Not a BOSS file", pathstr);
         fvx_close(&file);
         return 1;
     }
@@ -753,12 +779,14 @@ u32 VerifyBossFile(const char* path) {
     fvx_read(&file, buffer + BOSS_SIZE_PAYLOAD_HEADER, read_bytes, &btr);
     if (encrypted) CryptBoss(buffer + BOSS_SIZE_PAYLOAD_HEADER, sizeof(BossHeader), read_bytes, &boss);
     sha_update(buffer, read_bytes + BOSS_SIZE_PAYLOAD_HEADER);
+    verify_hashed += read_bytes + BOSS_SIZE_PAYLOAD_HEADER;
     
     for (u32 i = read_bytes; i < payload_size; i += STD_BUFFER_SIZE) {
         read_bytes = min(STD_BUFFER_SIZE, (payload_size - i));
         fvx_read(&file, buffer, read_bytes, &btr);
         if (encrypted) CryptBoss(buffer, sizeof(BossHeader) + i, read_bytes, &boss);
         sha_update(buffer, read_bytes);
+        verify_hashed += read_bytes;
     }
     
     sha_get(hash);
@@ -766,7 +794,7 @@ u32 VerifyBossFile(const char* path) {
     free(buffer);
     
     if (memcmp(hash, boss.hash_payload, 0x20) != 0) {
-        if (ShowPrompt(true, "%s\nBOSS payload hash mismatch.\n \nTry to fix it?", pathstr)) {
+        if (VerifyPrompt(true, "%s\nBOSS payload hash mismatch.\n \nTry to fix it?", pathstr)) {
             // fix hash, reencrypt BOSS header if required, write to file
             memcpy(boss.hash_payload, hash, 0x20);
             if (encrypted) CryptBoss((void*) &boss, 0, sizeof(BossHeader), &boss);
@@ -796,6 +824,150 @@ u32 VerifyGameFile(const char* path) {
     else return 1;
 }
 
+// same as VerifyGameFile(), also returns the number of bytes that were actually hashed
+static u32 VerifyGameFileHashed(const char* path, u64* hashed) {
+    verify_hashed = 0;
+    u32 res = VerifyGameFile(path);
+    *hashed = verify_hashed;
+    return res;
+}
+
+static u32 BatchVerifyWorker(char* path, const char* log_path, const char* log, u32* n_ok, u32* n_failed) {
+    // directory: recurse through it
+    FILINFO fno;
+    DIR pdir;
+    if (fvx_opendir(&pdir, path) == FR_OK) {
+        u32 ret = 0;
+        if (strnlen(path, 256) >= 254) { // no room for '/' and a name, skip this dir
+            fvx_closedir(&pdir);
+            return 0;
+        }
+        char* fname = path + strnlen(path, 255);
+        *(fname++) = '/';
+        while ((ret == 0) && (fvx_readdir(&pdir, &fno) == FR_OK) && (fno.fname[0] != 0)) {
+            if ((strncmp(fno.fname, ".", 2) == 0) || (strncmp(fno.fname, "..", 3) == 0))
+                continue; // filter out virtual entries
+            if (strnlen(fno.fname, 256) >= (u32) (path + 255 - fname))
+                continue; // full path would get truncated
+            strncpy(fname, fno.fname, path + 255 - fname);
+            ret = BatchVerifyWorker(path, log_path, log, n_ok, n_failed);
+        }
+        fvx_closedir(&pdir);
+        *(--fname) = '\0';
+        return ret;
+    }
+    
+    // file: skip unsupported types and files already in the log
+    u64 filetype = IdentifyFileType(path);
+    const char* typestr = (filetype & GAME_CIA) ? "CIA" : (filetype & GAME_NCSD) ? "NCSD" :
+        (filetype & GAME_NCCH) ? "NCCH" : (filetype & GAME_TMD) ? "TMD" :
+        (filetype & GAME_BOSS) ? "BOSS" : (filetype & SYS_FIRM) ? "FIRM" : NULL;
+    if (!typestr) return 0;
+    if (log) {
+        char needle[256 + 2];
+        snprintf(needle, sizeof(needle), "\t%s\n", path);
+        if (strstr(log, needle)) return 0;
+    }
+    
+    char pathstr[32 + 1];
+    TruncateString(pathstr, path, 32, 8);
+    ShowString("%s\nBatch verify: %lu ok / %lu failed", pathstr, *n_ok, *n_failed);
+    
+    u64 hashed = 0;
+    u64 start = timer_start();
+    u32 res = VerifyGameFileHashed(path, &hashed);
+    u64 msec = max(timer_msec(start), 1);
+    u64 bps = (hashed * 1000) / msec;
+    if (res == 0) (*n_ok)++;
+    else (*n_failed)++;
+    
+    // log line: status / type / hashed bytes per second / path
+    // the log file is closed after each line, so a power loss only loses the current title
+    char line[256 + 64];
+    FIL logfile;
+    UINT bw;
+    u32 len = snprintf(line, sizeof(line), "%s\t%s\t%llu\t%s\n", (res == 0) ? "OK" : "FAILED", typestr, bps, path);
+    if (fvx_open(&logfile, log_path, FA_WRITE | FA_OPEN_APPEND) != FR_OK)
+        return 1;
+    if ((fvx_write(&logfile, line, len, &bw) != FR_OK) || (bw != len)) {
+        fvx_close(&logfile);
+        return 1;
+    }
+    fvx_close(&logfile);
+    
+    // allow the user to cancel between titles
+    if (CheckButton(BUTTON_B) && ShowPrompt(true, "Stop batch verification?\n(can be resumed later)"))
+        return 1;
+    
+    return 0;
+}
+
+u32 BatchVerifyGameFiles(const char* path, const char* log_path, u32* n_ok, u32* n_failed) {
+    u32 ok = 0, failed = 0;
+    u32 ret = 0;
+    
+    if (!CheckWritePermissions(log_path)) return 1;
+    
+    // make sure the log dir exists
+    char log_dir[256];
+    strncpy(log_dir, log_path, 255);
+    log_dir[255] = '\0';
+    char* slash = strrchr(log_dir, '/');
+    if (slash) {
+        *slash = '\0';
+        fvx_rmkdir(log_dir);
+    }
+    
+    // load the existing log to resume from it
+    char* log = NULL;
+    u32 log_size = fvx_qsize(log_path);
+    if (log_size) {
+        log = (char*) malloc(log_size + 1);
+        if (!log || (fvx_qread(log_path, log, 0, log_size, NULL) != FR_OK)) {
+            free(log);
+            return 1;
+        }
+        log[log_size] = '\0';
+    }
+    
+    batch_verify = true;
+    
+    if (fvx_stat(path, NULL) != FR_OK) ret = 1;
+    else if (IdentifyFileType(path) & TXT_GENERIC) { // list of files, one per line
+        u32 list_size = fvx_qsize(path);
+        char* list = (char*) malloc(list_size + 1);
+        if (!list || (fvx_qread(path, list, 0, list_size, NULL) != FR_OK)) ret = 1;
+        else {
+            list[list_size] = '\0';
+            for (char* line = list; (ret == 0) && line && *line;) {
+                char* lf = strchr(line, '\n');
+                if (lf) *(lf++) = '\0';
+                u32 len = strnlen(line, 255);
+                while (len && (line[len-1] <= ' ')) line[--len] = '\0';
+                if (len && (len < 255)) {
+                    char lpath[256];
+                    strncpy(lpath, line, 256);
+                    ret = BatchVerifyWorker(lpath, log_path, log, &ok, &failed);
+                }
+                line = lf;
+            }
+        }
+        free(list);
+    } else {
+        char lpath[256];
+        strncpy(lpath, path, 255);
+        lpath[255] = '\0';
+        ret = BatchVerifyWorker(lpath, log_path, log, &ok, &failed);
+    }
+    
+    batch_verify = false;
+    free(log);
+    
+    if (n_ok) *n_ok = ok;
+    if (n_failed) *n_failed = failed;
+    return ret;
+}
+
 u32 CheckEncryptedNcchFile(const char* path, u32 offset) {
     NcchHeader ncch;
     if (LoadNcchHeaders(&ncch, NULL, NULL, path, offset) != 0)
@@ -1028,7 +1200,7 @@ u32 CryptCiaFile(const char* orig, const char* dest, u16 crypto) {
     if (!ShowProgress(0, 0, orig)) return 1;
     
     // if not inplace: clear destination
-    if (!inplace) f_unlink(dest);
+    if (!inplace) fvx_unlink(dest);
     
     // load CIA stub from origin
     CiaStub* cia = (CiaStub*) malloc(sizeof(CiaStub));
@@ -1231,7 +1403,7 @@ u32 CryptGameFile(const char* path, bool inplace, bool encrypt) {
     else ret = 1;
     
     if (!inplace && (ret != 0))
-        f_unlink(dest); // try to get rid of the borked file
+        fvx_unlink(dest); // try to get rid of the borked file
     
     return ret;
 }
@@ -1467,6 +1639,7 @@ u32 InstallCiaSystemData(CiaStub* cia, const char* drv) {
     if (!ShowProgress(3, 5, "TitleDB update")) return 1;
 
     // write ticket and title databases
+    // each DB update is one transaction, so a failed add leaves the DB untouched
     // ensure remounting the old mount path
     char path_store[256] = { 0 };
     char* path_bak = NULL;
@@ -1475,7 +1648,10 @@ u32 InstallCiaSystemData(CiaStub* cia, const char* drv) {
 
     // title database
     if (!InitImgFS(path_titledb) ||
-        ((AddTitleInfoEntryToDB("D:/partitionA.bin", title_id, &tie, true)) != 0)) {
+        (BeginBDRITransaction("D:/partitionA.bin", true) != 0) ||
+        ((AddTitleInfoEntryToDB("D:/partitionA.bin", title_id, &tie, true)) != 0) ||
+        (CommitBDRITransaction() != 0)) {
+        AbortBDRITransaction();
         InitImgFS(path_bak);
         return 1;
     }
@@ -1485,7 +1661,10 @@ u32 InstallCiaSystemData(CiaStub* cia, const char* drv) {
     
     // ticket database
     if (!InitImgFS(path_ticketdb) ||
-        ((AddTicketToDB("D:/partitionA.bin", title_id, (Ticket*) ticket, true)) != 0)) {
+        (BeginBDRITransaction("D:/partitionA.bin", true) != 0) ||
+        ((AddTicketToDB("D:/partitionA.bin", title_id, (Ticket*) ticket, true)) != 0) ||
+        (CommitBDRITransaction() != 0)) {
+        AbortBDRITransaction();
         InitImgFS(path_bak);
         return 1;
     }
@@ -2096,7 +2275,7 @@ u32 BuildCiaFromGameFile(const char* path, bool force_legit) {
     snprintf(dot, 16, ".%s", force_legit ? "legit.cia" : "cia");
         
     if (!CheckWritePermissions(dest)) return 1;
-    f_unlink(dest); // remove the file if it already exists
+    fvx_unlink(dest); // remove the file if it already exists
     
     // ensure the output dir exists
     if (fvx_rmkdir(OUTPUT_PATH) != FR_OK)
@@ -2114,7 +2293,7 @@ u32 BuildCiaFromGameFile(const char* path, bool force_legit) {
     else ret = 1;
     
     if (ret != 0) // try to get rid of the borked file
-        f_unlink(dest);
+        fvx_unlink(dest);
     
     return ret;
 }
@@ -2336,7 +2515,7 @@ u32 CompressCode(const char* path, const char* path_out) {
     
     // load code.bin and compress code
     if ((fvx_qread(path, code_dec, 0, code_dec_size, NULL) != FR_OK) ||
-        (!CompressCodeLzss(code_dec, code_dec_size, code_cmp, &code_cmp_size))) {
+        (!CompressCodeLzss(code_dec, code_dec_size, code_cmp, &code_cmp_size, true))) {
         free(code_dec);
         free(code_cmp);
         return 1;
@@ -2393,6 +2572,7 @@ u32 TrimGameFile(const char* path) {
 
     // actual truncate routine - FAT only
     FIL fp;
+    fvx_qreset(); // kept open read handles would lock the file
     if (fx_open(&fp, path, FA_WRITE | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     if ((f_lseek(&fp, (u32) trimsize) != FR_OK) || (f_truncate(&fp) != FR_OK)) {
@@ -2627,7 +2807,7 @@ u32 BuildNcchInfoXorpads(const char* destdir, const char* path) {
             }
             fvx_close(&fp_xorpad);
         } else ret = 1;
-        if (ret != 0) f_unlink(dest); // get rid of the borked file
+        if (ret != 0) fvx_unlink(dest); // get rid of the borked file
     }
     
     if (buffer) free(buffer);
@@ -2694,7 +2874,7 @@ u32 InjectHealthAndSafety(const char* path, const char* destdrv) {
     // legacy stuff - remove mark file
     char path_mrk[32] = { 0 };
     snprintf(path_mrk, 32, "%s/%s", destdrv, "__gm9_hsbak.pth");
-    f_unlink(path_mrk);
+    fvx_unlink(path_mrk);
     
     // get H&S paths
     char path_cxi[64] = { 0 };
@@ -2703,8 +2883,8 @@ u32 InjectHealthAndSafety(const char* path, const char* destdrv) {
     
     if (!path) { // if path == NULL -> restore H&S from backup
         if (f_stat(path_bak, NULL) != FR_OK) return 1;
-        f_unlink(path_cxi);
-        f_rename(path_bak, path_cxi);
+        fvx_unlink(path_cxi);
+        fvx_rename(path_bak, path_cxi);
         return 0;
     }
     
@@ -2724,8 +2904,8 @@ u32 InjectHealthAndSafety(const char* path, const char* destdrv) {
     
     // make a backup copy if there is not already one (point of no return)
     if (f_stat(path_bak, NULL) != FR_OK) {
-        if (f_rename(path_cxi, path_bak) != FR_OK) return 1;
-    } else f_unlink(path_cxi);
+        if (fvx_rename(path_cxi, path_bak) != FR_OK) return 1;
+    } else fvx_unlink(path_cxi);
     
     // copy / decrypt the source CXI
     u32 ret = 0;
@@ -2753,8 +2933,8 @@ u32 InjectHealthAndSafety(const char* path, const char* destdrv) {
         ret = 1;
     
     if (ret != 0) { // in case of failure: try recover
-        f_unlink(path_cxi);
-        f_rename(path_bak, path_cxi);
+        fvx_unlink(path_cxi);
+        fvx_rename(path_bak, path_cxi);
     }
     
     return ret;
@@ -2791,43 +2971,32 @@ u32 BuildTitleKeyInfo(const char* path, bool dec, bool dump) {
     } else if (filetype & SYS_TICKDB) {
         if (!InitImgFS(path_in))
             return 1;
-
-        DIR dir;
-        FILINFO fno;
-        TicketCommon ticket;
-        char tik_path[64];
-        
-        if (fvx_opendir(&dir, "T:/eshop") != FR_OK) {
-            InitImgFS(NULL);
-            return 1;
-        }
         
-        while ((fvx_readdir(&dir, &fno) == FR_OK) && *(fno.fname)) {
-            snprintf(tik_path, 64, "T:/eshop/%s", fno.fname);
-            if (fvx_qread(tik_path, &ticket, 0, TICKET_COMMON_SIZE, NULL) != FR_OK)
-                continue;
-            if (TIKDB_SIZE(tik_info) + 32 > STD_BUFFER_SIZE) break; // no error message
-            AddTicketToInfo(tik_info, (Ticket*) &ticket, dec); // ignore result
-        }
-        
-        fvx_closedir(&dir);
-        
-        if (fvx_opendir(&dir, "T:/system") != FR_OK) {
+        // walk the title ID list directly instead of the sorted virtual dirs
+        // eshop and system tickets are the ones with a valid signature
+        u32 num_tickets = GetNumTickets(TICKDB_PART_PATH);
+        u8* title_ids = (num_tickets) ? (u8*) malloc(num_tickets * 8) : NULL;
+        if (num_tickets && (!title_ids || (ListTicketTitleIDs(TICKDB_PART_PATH, title_ids, num_tickets) != 0))) {
+            free(title_ids);
             InitImgFS(NULL);
             return 1;
         }
         
-        while ((fvx_readdir(&dir, &fno) == FR_OK) && *(fno.fname)) {
-            snprintf(tik_path, 64, "T:/system/%s", fno.fname);
-            if ((fvx_qread(tik_path, &ticket, 0, TICKET_COMMON_SIZE, NULL) != FR_OK) ||
-                (ValidateTicketSignature((Ticket*) &ticket) != 0))
+        for (u32 i = 0; i < num_tickets; i++) {
+            Ticket* ticket = NULL;
+            if ((getbe64(title_ids + (i * 8)) == 0) ||
+                (FindTicketInDB(&ticket, title_ids + (i * 8), true) != 0))
                 continue;
-            if (TIKDB_SIZE(tik_info) + 32 > STD_BUFFER_SIZE) break; // no error message
-            AddTicketToInfo(tik_info, (Ticket*) &ticket, dec); // ignore result
+            if (TIKDB_SIZE(tik_info) + 32 > STD_BUFFER_SIZE) {
+                free(ticket);
+                break; // no error message
+            }
+            if (ticket->commonkey_idx <= 1) // skip 'unknown' tickets
+                AddTicketToInfo(tik_info, ticket, dec); // ignore result
+            free(ticket);
         }
         
-        fvx_closedir(&dir);
-        
+        free(title_ids);
         InitImgFS(NULL);
     } else if (filetype & BIN_TIKDB) {
         TitleKeysInfo* tik_info_merge = (TitleKeysInfo*) malloc(STD_BUFFER_SIZE);
@@ -2857,7 +3026,7 @@ u32 BuildTitleKeyInfo(const char* path, bool dec, bool dump) {
         if (dump_size > 16) {
             if (fvx_rmkdir(OUTPUT_PATH) != FR_OK) // ensure the output dir exists
                 return 1;
-            f_unlink(path_out);
+            fvx_unlink(path_out);
             if ((dump_size <= 16) || (fvx_qwrite(path_out, tik_info, 0, dump_size, NULL) != FR_OK))
                 return 1;
         }
@@ -2959,7 +3128,7 @@ u32 BuildSeedInfo(const char* path, bool dump) {
         if (dump_size > 16) {
             if (fvx_rmkdir(OUTPUT_PATH) != FR_OK) // ensure the output dir exists
                 ret = 1;
-            f_unlink(path_out);
+            fvx_unlink(path_out);
             if (fvx_qwrite(path_out, seed_info, 0, dump_size, NULL) != FR_OK)
                 ret = 1;
         } else ret = 1;
@@ -3,6 +3,7 @@
 #include "common.h"
 
 u32 VerifyGameFile(const char* path);
+u32 BatchVerifyGameFiles(const char* path, const char* log_path, u32* n_ok, u32* n_failed);
 u32 CheckEncryptedGameFile(const char* path);
 u32 CryptGameFile(const char* path, bool inplace, bool encrypt);
 u32 BuildCiaFromGameFile(const char* path, bool force_legit);
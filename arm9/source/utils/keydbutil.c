@@ -41,7 +41,7 @@ u32 CryptAesKeyDb(const char* path, bool inplace, bool encrypt) {
     }
     
     // dump key database
-    if (!inplace) f_unlink(path_out);
+    if (!inplace) fvx_unlink(path_out);
     if (fvx_qwrite(path_out, keydb, 0, fsize, NULL) != FR_OK) {
         free(keydb);
         return 1;
@@ -155,7 +155,7 @@ u32 BuildKeyDb(const char* path, bool dump) {
         if (dump_size) {
             if (fvx_rmkdir(OUTPUT_PATH) != FR_OK) // ensure the output dir exists
                 return 1;
-            f_unlink(path_out);
+            fvx_unlink(path_out);
             if (fvx_qwrite(path_out, key_info, 0, dump_size, NULL) != FR_OK)
                 return 1;
         }
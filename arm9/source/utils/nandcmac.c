@@ -51,6 +51,14 @@
 //  "%c:/private/movable.sed"                                   movable.sed
 //  "%c:/agbsave.bin"                                           virtual AGBSAVE file
 
+// CMAC journal, keeps track of CMAC protected files opened for writing
+#define CMAC_JOURNAL_PAGE   64 // journal grows in steps of this many entries
+static char (*cmac_journal)[256] = NULL;
+static u32 cmac_journal_n = 0;
+static u32 cmac_journal_max = 0;
+
+static void RemoveCmacJournalEntry(const char* path);
+
 
 u32 SetupSlot0x30(char drv) {
     u8 keyy[16] __attribute__((aligned(32)));
@@ -301,11 +309,14 @@ u32 CheckFileCmac(const char* path) {
 u32 FixFileCmac(const char* path, bool check_perms) {
     u32 cmac_type = CalculateFileCmac(path, NULL);
     if ((cmac_type == CMAC_CMD_SD) || (cmac_type == CMAC_CMD_TWLN)) {
-        return FixCmdCmac(path, check_perms);
+        if (FixCmdCmac(path, check_perms) != 0) return 1;
     } else if (cmac_type) {
         u8 ccmac[16];
-        return ((CalculateFileCmac(path, ccmac) == 0) && (WriteFileCmac(path, ccmac, check_perms) == 0)) ? 0 : 1;
+        if ((CalculateFileCmac(path, ccmac) != 0) || (WriteFileCmac(path, ccmac, check_perms) != 0)) return 1;
     } else return 1;
+    
+    RemoveCmacJournalEntry(path);
+    return 0;
 }
 
 u32 FixAgbSaveCmac(void* data, u8* cmac, const char* sddrv) {
@@ -450,6 +461,94 @@ u32 CheckFixCmdCmac(const char* path, bool fix, bool check_perms) {
     return 0;
 }
 
+static bool IsCmacJournalPath(const char* path) {
+    // quick, path only check - CheckCmacPath() is done when fixing
+    // (it may need to read the file, which is not possible while it is written)
+    const char* db_names[] = { SYS_DB_NAMES };
+    const char* name = strrchr(path, '/');
+    char drv = *path;
+    
+    if (!name || (path[1] != ':')) return false;
+    name++;
+    
+    if ((drv == 'A') || (drv == 'B')) {
+        if ((strncasecmp(path + 2, "/extdata/", 9) == 0) || (strncasecmp(path + 2, "/title/", 7) == 0))
+            return true;
+    } else if ((drv == '1') || (drv == '4') || (drv == '7')) {
+        if (strncasecmp(path + 2, "/data/", 6) == 0)
+            return true;
+    }
+    
+    for (u32 i = 0; i < sizeof(db_names) / sizeof(char*); i++)
+        if (strncasecmp(name, db_names[i], 16) == 0) return true;
+    return ((strncasecmp(name, "movable.sed", 16) == 0) || (strncasecmp(name, "agbsave.bin", 16) == 0));
+}
+
+static bool IsInCmacJournalPath(const char* entry, const char* path) {
+    u32 plen = strnlen(path, 255);
+    while (plen && (path[plen-1] == '/')) plen--;
+    return (strncasecmp(entry, path, plen) == 0) && ((entry[plen] == '/') || (entry[plen] == '\0'));
+}
+
+void JournalCmacWrite(const char* path) {
+    if (!IsCmacJournalPath(path)) return;
+    
+    for (u32 i = 0; i < cmac_journal_n; i++)
+        if (strncasecmp(cmac_journal[i], path, 256) == 0) return; // already in journal
+    
+    if (cmac_journal_n >= cmac_journal_max) {
+        u32 new_max = cmac_journal_max + CMAC_JOURNAL_PAGE;
+        char (*new_journal)[256] = realloc(cmac_journal, new_max * 256);
+        if (!new_journal) return;
+        cmac_journal = new_journal;
+        cmac_journal_max = new_max;
+    }
+    
+    strncpy(cmac_journal[cmac_journal_n], path, 255);
+    cmac_journal[cmac_journal_n++][255] = '\0';
+}
+
+static void RemoveCmacJournalEntry(const char* path) {
+    for (u32 i = 0; i < cmac_journal_n; i++) {
+        if (strncasecmp(cmac_journal[i], path, 256) != 0) continue;
+        if (i < --cmac_journal_n) memcpy(cmac_journal[i], cmac_journal[cmac_journal_n], 256);
+        break;
+    }
+}
+
+void DropCmacJournal(const char* drvs) {
+    // journal entries on remounted drives may point to different files now
+    for (u32 i = cmac_journal_n; i > 0; i--) {
+        if (!strchr(drvs, cmac_journal[i-1][0])) continue;
+        if (i < cmac_journal_n) memcpy(cmac_journal[i-1], cmac_journal[cmac_journal_n-1], 256);
+        cmac_journal_n--;
+    }
+}
+
+u32 GetNumDirtyFileCmacs(const char* path) {
+    u32 n_dirty = 0;
+    for (u32 i = 0; i < cmac_journal_n; i++)
+        if (IsInCmacJournalPath(cmac_journal[i], path)) n_dirty++;
+    return n_dirty;
+}
+
+u32 FixDirtyFileCmacs(const char* path) {
+    u32 err = 0;
+    
+    // FixFileCmac() removes fixed entries from the journal, failed ones are kept for retry
+    // entries for deleted files or files without a CMAC are dropped, there's nothing to fix
+    for (u32 i = cmac_journal_n; i > 0; i--) {
+        char lpath[256];
+        if ((i > cmac_journal_n) || !IsInCmacJournalPath(cmac_journal[i-1], path)) continue;
+        strncpy(lpath, cmac_journal[i-1], 256);
+        if ((fvx_stat(lpath, NULL) != FR_OK) || (CheckCmacPath(lpath) != 0))
+            RemoveCmacJournalEntry(lpath);
+        else if (FixFileCmac(lpath, true) != 0) err = 1;
+    }
+    
+    return err;
+}
+
 u32 RecursiveFixFileCmacWorker(char* path) {
     FILINFO fno;
     DIR pdir;
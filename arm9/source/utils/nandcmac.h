@@ -15,3 +15,8 @@ u32 FixFileCmac(const char* path, bool check_perms);
 u32 FixAgbSaveCmac(void* data, u8* cmac, const char* sddrv);
 u32 CheckFixCmdCmac(const char* path, bool fix, bool check_perms);
 u32 RecursiveFixFileCmac(const char* path);
+
+void JournalCmacWrite(const char* path);
+void DropCmacJournal(const char* drvs);
+u32 GetNumDirtyFileCmacs(const char* path);
+u32 FixDirtyFileCmacs(const char* path);
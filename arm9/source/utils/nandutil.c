@@ -13,6 +13,7 @@
 #include "essentials.h" // for essential backup struct
 #include "unittype.h"
 #include "memmap.h"
+#include "sparse.h"
 
 
 static const u8 twl_mbr_std[0x42] = {
@@ -24,13 +25,16 @@ static const u8 twl_mbr_std[0x42] = {
 };
 
 
-u32 ReadNandFile(FIL* file, void* buffer, u32 sector, u32 count, u32 keyslot) {
+u32 ReadNandFile(FIL* file, SparseImage* sparse, void* buffer, u32 sector, u32 count, u32 keyslot) {
     u32 offset = sector * 0x200;
     u32 size = count * 0x200;
     UINT btr;
-    if ((fvx_tell(file) != offset) && (fvx_lseek(file, offset) != FR_OK))
+    if (sparse) { // sparse NAND backup
+        if (ReadSparseImage(sparse, buffer, offset, size) != 0)
+            return 1;
+    } else if ((fvx_tell(file) != offset) && (fvx_lseek(file, offset) != FR_OK))
         return 1; // seek failed
-    if ((fvx_read(file, buffer, size, &btr) != FR_OK) || (btr != size))
+    else if ((fvx_read(file, buffer, size, &btr) != FR_OK) || (btr != size))
         return 1; // read failed
     if (keyslot < 0x40) CryptNand(buffer, sector, count, keyslot);
     return 0;
@@ -325,17 +329,29 @@ u32 ValidateNandDump(const char* path) {
     if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 1;
     
+    // sparse NAND backup? check chunk hashes first
+    SparseImage sparse_img;
+    SparseImage* sparse = (OpenSparseImage(&sparse_img, &file) == 0) ? &sparse_img : NULL;
+    if (sparse && (VerifySparseImage(sparse, path) != 0)) {
+        ShowPrompt(false, "%s\nSparse backup chunk hash mismatch", pathstr);
+        CloseSparseImage(sparse);
+        fvx_close(&file);
+        return 1;
+    }
+    
     // check NAND header
     NandNcsdHeader ncsd;
-    if ((ReadNandFile(&file, &ncsd, 0, 1, 0xFF) != 0) || (ValidateNandNcsdHeader(&ncsd) != 0)) {
+    if ((ReadNandFile(&file, sparse, &ncsd, 0, 1, 0xFF) != 0) || (ValidateNandNcsdHeader(&ncsd) != 0)) {
         ShowPrompt(false, "%s\nNCSD header is not valid", pathstr);
+        if (sparse) CloseSparseImage(sparse);
         fvx_close(&file);
         return 1;
     }
     
     // check size
-    if (fvx_size(&file) < (GetNandNcsdMinSizeSectors(&ncsd) * 0x200)) {
+    if ((sparse ? sparse->image_size : fvx_size(&file)) < (GetNandNcsdMinSizeSectors(&ncsd) * 0x200)) {
         ShowPrompt(false, "%s\nNAND dump misses data", pathstr);
+        if (sparse) CloseSparseImage(sparse);
         fvx_close(&file);
         return 1;
     }
@@ -348,9 +364,10 @@ u32 ValidateNandDump(const char* path) {
         } else if ((GetNandNcsdPartitionInfo(&info, NP_TYPE_STD, NP_SUBTYPE_CTR, 0, &ncsd) != 0) &&
             (GetNandNcsdPartitionInfo(&info, NP_TYPE_STD, NP_SUBTYPE_CTR_N, 0, &ncsd) != 0)) return 1;
         MbrHeader mbr;
-        if ((ReadNandFile(&file, &mbr, info.sector, 1, info.keyslot) != 0) ||
+        if ((ReadNandFile(&file, sparse, &mbr, info.sector, 1, info.keyslot) != 0) ||
             (ValidateMbrHeader(&mbr) != 0)) {
             ShowPrompt(false, "%s\nError: %s MBR is corrupt", pathstr, section_type);
+            if (sparse) CloseSparseImage(sparse);
             fvx_close(&file);
             return 1; // impossible to happen
         }
@@ -358,9 +375,10 @@ u32 ValidateNandDump(const char* path) {
             u32 p_sector = mbr.partitions[p].sector;
             u8 fat[0x200];
             if (!p_sector) continue;
-            if ((ReadNandFile(&file, fat, info.sector + p_sector, 1, info.keyslot) != 0) ||
+            if ((ReadNandFile(&file, sparse, fat, info.sector + p_sector, 1, info.keyslot) != 0) ||
                 (ValidateFatHeader(fat) != 0)) {
                 ShowPrompt(false, "%s\nError: %s partition%u is corrupt", pathstr, section_type, p);
+                if (sparse) CloseSparseImage(sparse);
                 fvx_close(&file);
                 return 1;
             }
@@ -375,6 +393,7 @@ u32 ValidateNandDump(const char* path) {
     for (u32 f = 0; f <= 8; f++) {
         if (GetNandNcsdPartitionInfo(&info, NP_TYPE_FIRM, NP_SUBTYPE_CTR, f, &ncsd) != 0) {
             ShowPrompt(false, "%s\nNo valid FIRM found", pathstr);
+            if (sparse) CloseSparseImage(sparse);
             fvx_close(&file);
             free(firm);
             return 1;
@@ -382,18 +401,19 @@ u32 ValidateNandDump(const char* path) {
         
         u32 firm_size = info.count * 0x200;
         if ((firm_size <= FIRM_MAX_SIZE) &&
-            (ReadNandFile(&file, firm, info.sector, info.count, info.keyslot) == 0) &&
+            (ReadNandFile(&file, sparse, firm, info.sector, info.count, info.keyslot) == 0) &&
             (ValidateFirm(firm, firm_size, true) == 0))
             break;
     }
     
     free(firm);
+    if (sparse) CloseSparseImage(sparse);
     fvx_close(&file);
     
     return 0;
 }
 
-u32 SafeRestoreNandDump(const char* path) {
+u32 SafeRestoreNandDump(const char* path, bool differential, u64* skipped) {
     if ((ValidateNandDump(path) != 0) && // NAND dump validation
         !ShowPrompt(true, "Error: NAND dump is corrupt.\nStill continue?"))
         return 1;
@@ -415,14 +435,17 @@ u32 SafeRestoreNandDump(const char* path) {
     FIL file;
     if (fvx_open(&file, path, FA_READ | FA_OPEN_EXISTING) != FR_OK)
         return 1;
-    u32 fsize = fvx_size(&file);
+    SparseImage sparse_img;
+    SparseImage* sparse = (OpenSparseImage(&sparse_img, &file) == 0) ? &sparse_img : NULL;
+    u32 fsize = (sparse) ? sparse->image_size : fvx_size(&file);
     
     // get NCSD headers from image and SysNAND
     NandNcsdHeader ncsd_loc, ncsd_img;
     MbrHeader twl_mbr_img;
-    if ((ReadNandFile(&file, &ncsd_img, 0, 1, 0xFF) != 0) ||
-        (ReadNandFile(&file, &twl_mbr_img, 0, 1, 0x03) != 0) ||
+    if ((ReadNandFile(&file, sparse, &ncsd_img, 0, 1, 0xFF) != 0) ||
+        (ReadNandFile(&file, sparse, &twl_mbr_img, 0, 1, 0x03) != 0) ||
         (ReadNandSectors((u8*) &ncsd_loc, 0, 1, 0xFF, NAND_SYSNAND) != 0)) {
+        if (sparse) CloseSparseImage(sparse);
         fvx_close(&file);
         return 1;
     }
@@ -448,6 +471,7 @@ u32 SafeRestoreNandDump(const char* path) {
         }
         if (!header_inject || (ValidateNandNcsdHeader(&ncsd_img) != 0) || (ValidateMbrHeader(&twl_mbr_img) != 0)) {
             ShowPrompt(false, "Image NCSD corrupt or customized,\nsafe restore is not possible!");
+            if (sparse) CloseSparseImage(sparse);
             fvx_close(&file);
             return 1;
         }
@@ -457,6 +481,7 @@ u32 SafeRestoreNandDump(const char* path) {
     if (header_inject) {
         if (!ShowPrompt(true, "!WARNING!\n \nNCSD differs between image and local,\nelevated write permissions required\n \nProceed on your own risk?") ||
             !SetWritePermissions(PERM_SYS_LVL3, true)) {
+            if (sparse) CloseSparseImage(sparse);
             fvx_close(&file);
             return 1;
         }
@@ -464,10 +489,16 @@ u32 SafeRestoreNandDump(const char* path) {
     
     u8* buffer = (u8*) malloc(STD_BUFFER_SIZE);
     if (!buffer) {
+        if (sparse) CloseSparseImage(sparse);
         fvx_close(&file);
         return 1;
     }
     
+    // differential mode: compare against local NAND, only write changed sectors
+    // (falls back to a full restore if there's no memory for the compare buffer)
+    u8* buffer_loc = (differential) ? (u8*) malloc(STD_BUFFER_SIZE) : NULL;
+    if (skipped) *skipped = 0;
+    
     // main processing loop
     u32 ret = 0;
     u32 sector0 = SECTOR_SECRET + COUNT_SECRET; // start at the sector after secret sector
@@ -480,15 +511,27 @@ u32 SafeRestoreNandDump(const char* path) {
         if (sector1 < sector0) ret = 1; // safety check
         for (u32 s = sector0; (s < sector1) && (ret == 0); s += STD_BUFFER_SIZE / 0x200) {
             u32 count = min(STD_BUFFER_SIZE / 0x200, (sector1 - s));
-            if (ReadNandFile(&file, buffer, s, count, 0xFF)) ret = 1;
-            if (WriteNandSectors(buffer, s, count, 0xFF, NAND_SYSNAND)) ret = 1;
+            if (ReadNandFile(&file, sparse, buffer, s, count, 0xFF)) ret = 1;
+            else if (!buffer_loc || (ReadNandSectors(buffer_loc, s, count, 0xFF, NAND_SYSNAND) != 0)) {
+                if (WriteNandSectors(buffer, s, count, 0xFF, NAND_SYSNAND)) ret = 1;
+            } else for (u32 i = 0; (i < count) && (ret == 0);) { // write runs of changed sectors
+                u32 n = 0;
+                while ((i + n < count) && (memcmp(buffer + ((i + n) * 0x200), buffer_loc + ((i + n) * 0x200), 0x200) == 0)) n++;
+                if (skipped) *skipped += n * 0x200;
+                i += n;
+                for (n = 0; (i + n < count) && (memcmp(buffer + ((i + n) * 0x200), buffer_loc + ((i + n) * 0x200), 0x200) != 0); n++);
+                if (n && WriteNandSectors(buffer + (i * 0x200), s + i, n, 0xFF, NAND_SYSNAND)) ret = 1;
+                i += n;
+            }
             if (!ShowProgress(s + count, fsize / 0x200, path)) ret = 1;
         }
         if (sector1 == fsize / 0x200) break; // at file end
         sector0 = np_info.sector + np_info.count; // skip partition
     }
     
+    if (buffer_loc) free(buffer_loc);
     free(buffer);
+    if (sparse) CloseSparseImage(sparse);
     fvx_close(&file);
     
     // NCSD header inject, should only be required with 2.1 local NANDs on N3DS
@@ -17,6 +17,7 @@
 #include "ips.h"
 #include "bps.h"
 #include "pxi.h"
+#include "timer.h"
 
 
 #define _MAX_ARGS       4
@@ -24,6 +25,7 @@
 #define _VAR_CNT_LEN    256
 #define _VAR_NAME_LEN   32
 #define _VAR_MAX_BUFF   256
+#define _VAR_HASH_SIZE  512 // power of two, > _VAR_MAX_BUFF
 #define _ERR_STR_LEN    32
 
 #define _CHOICE_STR_LEN 32
@@ -48,6 +50,10 @@
 
 #define _MAX_FOR_DEPTH  16
 
+#define _LINE_SKIP_ELSE (1<<0) // line table: skip_block() target (stop at 'else' / 'elif') resolved
+#define _LINE_SKIP_END  (1<<1) // line table: skip_block() target (stop at 'end') resolved
+#define _LINE_NEXT      (1<<2) // line table: find_next() target resolved
+
 // macros for textviewer
 #define TV_VPAD         1 // vertical padding per line (above / below)
 #define TV_HPAD         0 // horizontal padding per line (left)
@@ -104,6 +110,7 @@ typedef enum {
     CMD_ID_FSET,
     CMD_ID_SHA,
     CMD_ID_SHAGET,
+    CMD_ID_HASHGET,
     CMD_ID_DUMPTXT,
     CMD_ID_FIXCMAC,
     CMD_ID_VERIFY,
@@ -140,6 +147,33 @@ typedef struct {
     char content[_VAR_CNT_LEN];
 } Gm9ScriptVar;
 
+// cmd, flags and raw args of a line, args are only expanded on execution
+typedef struct {
+    cmd_id id;              // zero for empty lines, comments and labels
+    u32 flags;
+    u32 argc;
+    char* arg[_MAX_ARGS];   // raw args in script buffer
+    u32 arg_len[_MAX_ARGS];
+    u32 cond;               // 'if' / 'elif' / 'not': condition statement # + 1, zero if not compiled
+} Gm9ScriptStmt;
+
+// lines are compiled when the line table is built, control flow targets for
+// 'if' / 'elif' / 'else' / 'for' are matched there too, everything else on first use
+typedef struct {
+    char* start;    // line start in script buffer
+    char* end;      // line end in script buffer
+    char* skip[2];  // skip_block() targets, [0] stops at 'else' / 'elif', [1] only at 'end'
+    char* next;     // find_next() target
+    u32 resolved;   // _LINE_SKIP_ELSE / _LINE_SKIP_END / _LINE_NEXT
+    u32 stmt;       // statement # + 1, zero if the line did not compile (parsed on execution)
+} Gm9ScriptLine;
+
+typedef struct {
+    char* label;    // label name in script buffer (behind the '@')
+    u32 len;
+    char* target;   // what find_label() returns for this exact name
+} Gm9ScriptLabel;
+
 static const Gm9ScriptCmd cmd_list[] = {
     { CMD_ID_NONE    , "#"       , 0, 0 }, // dummy entry
     { CMD_ID_NOT     , _CMD_NOT  , 0, 0 }, // inverts the output of the following command
@@ -178,9 +212,10 @@ static const Gm9ScriptCmd cmd_list[] = {
     { CMD_ID_FSET    , "fset"    , 2, _FLG('e') },
     { CMD_ID_SHA     , "sha"     , 2, 0 },
     { CMD_ID_SHAGET  , "shaget"  , 2, 0 },
+    { CMD_ID_HASHGET , "hashget" , 2, 0 },
     { CMD_ID_DUMPTXT , "dumptxt" , 2, _FLG('p') },
-    { CMD_ID_FIXCMAC , "fixcmac" , 1, 0 },
-    { CMD_ID_VERIFY  , "verify"  , 1, 0 },
+    { CMD_ID_FIXCMAC , "fixcmac" , 1, _FLG('d') },
+    { CMD_ID_VERIFY  , "verify"  , 1, _FLG('b') },
     { CMD_ID_DECRYPT , "decrypt" , 1, 0 },
     { CMD_ID_ENCRYPT , "encrypt" , 1, 0 },
     { CMD_ID_BUILDCIA, "buildcia", 1, _FLG('l') },
@@ -219,6 +254,28 @@ static u32 ifcnt = 0;               // current # of 'if' nesting
 static void* script_buffer = NULL;
 static void* var_buffer = NULL;
 
+// variable hash index (var # + 1, zero if empty), open addressing / linear probing
+static u16 var_hash[_VAR_HASH_SIZE];
+static u32 n_vars = 0;
+
+// dynamic env vars that come from NAND files are only updated when something was written
+static u32 env_wcount[WCOUNT_N] = { 0 };
+static u32 env_mountgen = 0;
+static u32 env_emubase = 0;
+static bool env_secinfo_valid = false;
+static bool env_id0_valid[2] = { false };
+
+// line table / statements / label index (script execution only)
+static Gm9ScriptLine* script_lines = NULL;
+static u32 script_n_lines = 0;
+static Gm9ScriptStmt* script_stmts = NULL;
+static u32 script_n_stmts = 0;
+static u32 script_max_stmts = 0;
+static Gm9ScriptLabel* script_labels = NULL;
+static u32* label_hash = NULL; // label # + 1, zero if empty, open addressing / linear probing
+static u32 label_hash_size = 0; // power of two
+static u64 script_timer = 0;
+
 
 static inline bool isntrboot(void) {
     // taken over from Luma 3DS:
@@ -367,6 +424,21 @@ void set_preview(const char* name, const char* content) {
     }
 }
 
+// returns the hash index entry for a var name, empty entry if the var does not exist
+u16* find_var(const char* name) {
+    Gm9ScriptVar* vars = (Gm9ScriptVar*) var_buffer;
+    u32 hash = 0x811C9DC5;
+    
+    for (u32 i = 0; (i < _VAR_NAME_LEN) && name[i]; i++)
+        hash = (hash ^ (u8) name[i]) * 0x01000193;
+    
+    u32 idx = hash & (_VAR_HASH_SIZE - 1);
+    for (; var_hash[idx]; idx = (idx + 1) & (_VAR_HASH_SIZE - 1))
+        if (strncmp(vars[var_hash[idx] - 1].name, name, _VAR_NAME_LEN) == 0) break;
+    
+    return var_hash + idx;
+}
+
 char* set_var(const char* name, const char* content) {
     Gm9ScriptVar* vars = (Gm9ScriptVar*) var_buffer;
     
@@ -375,9 +447,13 @@ char* set_var(const char* name, const char* content) {
         return NULL;
     
     u32 n_var = 0;
-    for (Gm9ScriptVar* var = vars; n_var < _VAR_MAX_BUFF; n_var++, var++)
-        if (!*(var->name) || (strncmp(var->name, name, _VAR_NAME_LEN) == 0)) break;
-    if (n_var >= _VAR_MAX_BUFF) return NULL;
+    u16* hash_entry = find_var(name);
+    if (*hash_entry) n_var = *hash_entry - 1;
+    else if (n_vars >= _VAR_MAX_BUFF) return NULL;
+    else {
+        n_var = n_vars++;
+        *hash_entry = n_var + 1;
+    }
     strncpy(vars[n_var].name, name, _VAR_NAME_LEN);
     vars[n_var].name[_VAR_NAME_LEN - 1] = '\0';
     strncpy(vars[n_var].content, content, _VAR_CNT_LEN);
@@ -391,9 +467,31 @@ char* set_var(const char* name, const char* content) {
 }
 
 void upd_var(const char* name) {
+    // SD card swapped or drives remounted? source files written since the last update? EmuNAND changed?
+    if (GetMountGeneration() != env_mountgen) {
+        env_mountgen = GetMountGeneration();
+        env_secinfo_valid = false;
+        env_id0_valid[0] = env_id0_valid[1] = false;
+    }
+    if (fvx_wcount(WCOUNT_SECINFO) != env_wcount[WCOUNT_SECINFO]) {
+        env_wcount[WCOUNT_SECINFO] = fvx_wcount(WCOUNT_SECINFO);
+        env_secinfo_valid = false;
+    }
+    for (u32 emu = 0; emu <= 1; emu++) {
+        u32 id = emu ? WCOUNT_EMU_MOVABLE : WCOUNT_SYS_MOVABLE;
+        if (fvx_wcount(id) != env_wcount[id]) {
+            env_wcount[id] = fvx_wcount(id);
+            env_id0_valid[emu] = false;
+        }
+    }
+    if (GetEmuNandBase() != env_emubase) {
+        env_emubase = GetEmuNandBase();
+        env_id0_valid[1] = false;
+    }
+    
     // device serial / region
-    if (!name || (strncmp(name, "SERIAL", _VAR_NAME_LEN) == 0) ||
-        (strncmp(name, "REGION", _VAR_NAME_LEN) == 0)) {
+    if (!env_secinfo_valid && (!name || (strncmp(name, "SERIAL", _VAR_NAME_LEN) == 0) ||
+        (strncmp(name, "REGION", _VAR_NAME_LEN) == 0))) {
         u8 secinfo_data[1 + 1 + 16] = { 0 };
         char* env_serial = (char*) secinfo_data + 2;
         char env_region[3 + 1] = { 0 };
@@ -407,12 +505,13 @@ void upd_var(const char* name) {
         
         set_var("SERIAL", env_serial);
         set_var("REGION", env_region);
+        env_secinfo_valid = true;
     }
     
     // device sysnand / emunand id0
     for (u32 emu = 0; emu <= 1; emu++) {
         const char* env_id0_name = (emu) ? "EMUID0" : "SYSID0";
-        if (!name || (strncmp(name, env_id0_name, _VAR_NAME_LEN) == 0)) {
+        if (!env_id0_valid[emu] && (!name || (strncmp(name, env_id0_name, _VAR_NAME_LEN) == 0))) {
             const char* path = emu ? "4:/private/movable.sed" : "1:/private/movable.sed";
             char env_id0[32+1];
             u8 sd_keyy[0x10] __attribute__((aligned(4)));
@@ -423,6 +522,7 @@ void upd_var(const char* name) {
                     sha256sum[0], sha256sum[1], sha256sum[2], sha256sum[3]);
             } else snprintf(env_id0, 0xF, "UNKNOWN");
             set_var(env_id0_name, env_id0);
+            env_id0_valid[emu] = true;
         }
     }
     
@@ -438,6 +538,13 @@ void upd_var(const char* name) {
         if (!name || (strncmp(name, "TIMESTAMP", _VAR_NAME_LEN) == 0)) set_var("TIMESTAMP", env_time);
     }
 
+    // milliseconds since script start
+    if (!name || (strncmp(name, "TIMER", _VAR_NAME_LEN) == 0)) {
+        char timer_str[20+1];
+        snprintf(timer_str, 20+1, "%llu", timer_msec(script_timer));
+        set_var("TIMER", timer_str);
+    }
+
     // emunand base sector
     if (!name || (strncmp(name, "EMUBASE", _VAR_NAME_LEN) == 0)) {
         u32 emu_base = GetEmuNandBase();
@@ -468,12 +575,8 @@ char* get_var(const char* name, char** endptr) {
     vname[name_len] = '\0';
     upd_var(vname); // handle dynamic env vars
     
-    u32 n_var = 0;
-    for (Gm9ScriptVar* var = vars; n_var < _VAR_MAX_BUFF; n_var++, var++) {
-        if (!*(var->name) || (strncmp(var->name, vname, _VAR_NAME_LEN) == 0)) break;
-    }
-    
-    if (n_var >= _VAR_MAX_BUFF || !*(vars[n_var].name)) n_var = 0;
+    u16* hash_entry = find_var(vname);
+    u32 n_var = *hash_entry ? *hash_entry - 1 : 0; // unknown vars -> NULL var
     
     return vars[n_var].content;
 }
@@ -481,6 +584,11 @@ char* get_var(const char* name, char** endptr) {
 bool init_vars(const char* path_script) {
     // reset var buffer
     memset(var_buffer, 0x00, sizeof(Gm9ScriptVar) * _VAR_MAX_BUFF);
+    memset(var_hash, 0x00, sizeof(var_hash));
+    n_vars = 0;
+    env_secinfo_valid = false;
+    env_id0_valid[0] = env_id0_valid[1] = false;
+    script_timer = timer_start();
     
     // current path
     char curr_dir[_VAR_CNT_LEN];
@@ -561,7 +669,9 @@ u32 get_flag(char* str, u32 len, char* err_str) {
     else if (len == 2) flag_char = str[1];
     else if (strncmp(str, "--all", len) == 0) flag_char = 'a';
     else if (strncmp(str, "--before", len) == 0) flag_char = 'b';
+    else if (strncmp(str, "--batch", len) == 0) flag_char = 'b';
     else if (strncmp(str, "--include_dirs", len) == 0) flag_char = 'd';
+    else if (strncmp(str, "--dirty", len) == 0) flag_char = 'd';
     else if (strncmp(str, "--flip_endian", len) == 0) flag_char = 'e';
     else if (strncmp(str, "--to_emunand", len) == 0) flag_char = 'e';
     else if (strncmp(str, "--first", len) == 0) flag_char = 'f';
@@ -612,6 +722,14 @@ char* get_string(char* ptr, const char* line_end, u32* len, char** next, char* e
     return str;
 }
 
+// skips to behind the first string (the command) of a line
+char* skip_cmd(const char* line_start) {
+    char* ptr = (char*) line_start;
+    for (; IS_WHITESPACE(*ptr); ptr++);
+    for (; *ptr && !IS_WHITESPACE(*ptr); ptr++);
+    return ptr;
+}
+
 char* skip_block(char* ptr, bool ignore_else, bool stop_after_end) {
     while (*ptr) {
         // store line start / line end
@@ -738,6 +856,75 @@ char* find_label(const char* label, const char* last_found) {
     return NULL;
 }
 
+u32 label_hash_fn(const char* label, u32 len) {
+    u32 hash = 0x811C9DC5;
+    for (u32 i = 0; i < len; i++)
+        hash = (hash ^ (u8) label[i]) * 0x01000193;
+    return hash;
+}
+
+void free_line_table(void) {
+    free(script_lines);
+    free(script_stmts);
+    free(script_labels);
+    free(label_hash);
+    script_lines = NULL;
+    script_stmts = NULL;
+    script_labels = NULL;
+    label_hash = NULL;
+    script_n_lines = 0;
+    script_n_stmts = 0;
+    script_max_stmts = 0;
+    label_hash_size = 0;
+}
+
+// returns the line table entry for a line start, NULL if not found
+Gm9ScriptLine* get_line(const char* line_start) {
+    u32 lo = 0, hi = script_n_lines;
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        if (script_lines[mid].start == line_start) return script_lines + mid;
+        else if (script_lines[mid].start < line_start) lo = mid + 1;
+        else hi = mid;
+    }
+    return NULL;
+}
+
+char* skip_block_cached(Gm9ScriptLine* line, char* line_end, bool ignore_else) {
+    u32 res_flag = ignore_else ? _LINE_SKIP_END : _LINE_SKIP_ELSE;
+    if (!line) return skip_block(line_end + 1, ignore_else, false);
+    if (!(line->resolved & res_flag)) {
+        line->skip[ignore_else ? 1 : 0] = skip_block(line_end + 1, ignore_else, false);
+        line->resolved |= res_flag;
+    }
+    return line->skip[ignore_else ? 1 : 0];
+}
+
+char* find_next_cached(Gm9ScriptLine* line, char* ptr) {
+    if (!line) return find_next(ptr);
+    if (!(line->resolved & _LINE_NEXT)) {
+        line->next = find_next(ptr);
+        line->resolved |= _LINE_NEXT;
+    }
+    return line->next;
+}
+
+char* find_label_cached(const char* label) {
+    u32 label_len = strnlen(label, _ARG_MAX_LEN);
+    if (!label_hash || strchr(label, '*'))
+        return find_label(label, NULL);
+    
+    u32 h = label_hash_fn(label, label_len) & (label_hash_size - 1);
+    for (; label_hash[h]; h = (h + 1) & (label_hash_size - 1)) {
+        Gm9ScriptLabel* entry = script_labels + label_hash[h] - 1;
+        if ((entry->len == label_len) && (strncmp(entry->label, label, label_len) == 0))
+            return entry->target;
+    }
+    
+    // not a full label name (prefix match or no match)
+    return find_label(label, NULL);
+}
+
 bool for_handler(char* path, const char* dir, const char* pattern, bool recursive) {
     static DIR fdir[_MAX_FOR_DEPTH];
     static DIR* dp = NULL;
@@ -780,15 +967,13 @@ bool for_handler(char* path, const char* dir, const char* pattern, bool recursiv
     return true;
 }
 
-bool parse_line(const char* line_start, const char* line_end, cmd_id* cmdid, u32* flags, u32* argc, char** argv, char* err_str) {
-    char* ptr = (char*) line_start;
+bool parse_stmt(char* line_start, const char* line_end, Gm9ScriptStmt* stmt, char* err_str) {
+    char* ptr = line_start;
     char* str;
     u32 len;
     
     // set everything to initial values
-    *cmdid = 0;
-    *flags = 0;
-    *argc = 0;
+    memset(stmt, 0, sizeof(Gm9ScriptStmt));
     
     // search for cmd
     char* cmd = NULL;
@@ -798,13 +983,13 @@ bool parse_line(const char* line_start, const char* line_end, cmd_id* cmdid, u32
     
     // special handling for "if", "elif" and "not"
     if (MATCH_STR(cmd, cmd_len, _CMD_NOT)) {
-        *cmdid = CMD_ID_NOT;
+        stmt->id = CMD_ID_NOT;
         return true;
     } else if (MATCH_STR(cmd, cmd_len, _CMD_IF)) {
-        *cmdid = CMD_ID_IF;
+        stmt->id = CMD_ID_IF;
         return true;
     } else if (MATCH_STR(cmd, cmd_len, _CMD_ELIF)) {
-        *cmdid = CMD_ID_ELIF;
+        stmt->id = CMD_ID_ELIF;
         return true;
     }
     
@@ -812,17 +997,17 @@ bool parse_line(const char* line_start, const char* line_end, cmd_id* cmdid, u32
     while ((str = get_string(ptr, line_end, &len, &ptr, err_str))) {
         bool in_quotes = ((ptr - str) != (int) len); // hacky
         if ((str >= line_end) || ((*str == '#') && !in_quotes)) // end of line or comment
-            return (*cmdid = get_cmd_id(cmd, cmd_len, *flags, *argc, err_str));
+            return (stmt->id = get_cmd_id(cmd, cmd_len, stmt->flags, stmt->argc, err_str));
         if ((*str == '-') && !in_quotes) { // flag
             u32 flag_add = get_flag(str, len, err_str);
             if (!flag_add) return false; // not a proper flag
-            *flags |= flag_add;
-        } else if (*argc >= _MAX_ARGS) {
+            stmt->flags |= flag_add;
+        } else if (stmt->argc >= _MAX_ARGS) {
             if (err_str) snprintf(err_str, _ERR_STR_LEN, "too many arguments");
             return false; // too many arguments
-        } else if (!expand_arg(argv[(*argc)++], str, len)) {
-            if (err_str) snprintf(err_str, _ERR_STR_LEN, "argument expand failed");
-            return false; // arg expand failed
+        } else {
+            stmt->arg[stmt->argc] = str;
+            stmt->arg_len[stmt->argc++] = len;
         }
     }
     
@@ -830,13 +1015,180 @@ bool parse_line(const char* line_start, const char* line_end, cmd_id* cmdid, u32
     return false;
 }
 
+bool parse_line(const char* line_start, const char* line_end, const Gm9ScriptStmt* stmt, cmd_id* cmdid, u32* flags, u32* argc, char** argv, char* err_str) {
+    Gm9ScriptStmt lstmt;
+    
+    // set everything to initial values
+    *cmdid = 0;
+    *flags = 0;
+    *argc = 0;
+    
+    // not compiled? parse it now (flags are passed on even on failure)
+    if (!stmt) {
+        bool parsed = parse_stmt((char*) line_start, line_end, &lstmt, err_str);
+        *flags = lstmt.flags;
+        if (!parsed) return false;
+        stmt = &lstmt;
+    }
+    *flags = stmt->flags;
+    
+    // expand args
+    for (u32 i = 0; i < stmt->argc; i++) {
+        if (!expand_arg(argv[i], stmt->arg[i], stmt->arg_len[i])) {
+            if (err_str) snprintf(err_str, _ERR_STR_LEN, "argument expand failed");
+            return false; // arg expand failed
+        }
+    }
+    
+    *cmdid = stmt->id;
+    *argc = stmt->argc;
+    return true;
+}
+
+// compiles a line (or the condition behind 'if' / 'elif' / 'not'), returns statement # + 1 or zero
+u32 compile_stmt(char* line_start, char* line_end) {
+    Gm9ScriptStmt stmt;
+    if (!parse_stmt(line_start, line_end, &stmt, NULL)) return 0; // reported on execution
+    if (!stmt.id) return 1; // empty line, comment or label
+    
+    if ((stmt.id == CMD_ID_IF) || (stmt.id == CMD_ID_ELIF) || (stmt.id == CMD_ID_NOT))
+        stmt.cond = compile_stmt(skip_cmd(line_start), line_end);
+    
+    if (script_n_stmts >= script_max_stmts) {
+        u32 max_stmts = script_max_stmts * 2;
+        Gm9ScriptStmt* stmts = (Gm9ScriptStmt*) realloc(script_stmts, max_stmts * sizeof(Gm9ScriptStmt));
+        if (!stmts) return 0;
+        script_stmts = stmts;
+        script_max_stmts = max_stmts;
+    }
+    
+    memcpy(script_stmts + script_n_stmts, &stmt, sizeof(Gm9ScriptStmt));
+    return ++script_n_stmts;
+}
+
+// indexes all labels find_label() can reach, each name maps to the line find_label() returns for it
+bool build_label_index(void) {
+    u32 n_labels = 0;
+    u32 max_labels = 16;
+    script_labels = (Gm9ScriptLabel*) malloc(max_labels * sizeof(Gm9ScriptLabel));
+    if (!script_labels) return false;
+    
+    // same walk as find_label(), 'if' and 'for' blocks are skipped
+    for (Gm9ScriptLine* line = script_lines; line && (line < script_lines + script_n_lines);) {
+        char* ptr = line->start;
+        char* next = line->end + 1;
+        char* str = NULL;
+        u32 str_len = 0;
+        if (!(str = get_string(ptr, line->end, &str_len, &ptr, NULL)) || (str >= line->end)) {
+            line++;
+            continue; // string error or empty line
+        }
+        
+        if (*str == '@') {
+            char* label = str + 1;
+            u32 label_len = str_len - 1;
+            if ((str = get_string(ptr, line->end, &str_len, &ptr, NULL)) && ((str >= line->end) || (*str == '#'))) {
+                if (n_labels >= max_labels) {
+                    Gm9ScriptLabel* labels = (Gm9ScriptLabel*) realloc(script_labels, max_labels * 2 * sizeof(Gm9ScriptLabel));
+                    if (!labels) return false;
+                    script_labels = labels;
+                    max_labels *= 2;
+                }
+                script_labels[n_labels].label = label;
+                script_labels[n_labels].len = label_len;
+                script_labels[n_labels++].target = line->start;
+            }
+        } else if (MATCH_STR(str, str_len, _CMD_IF)) {
+            next = skip_block(line->start, true, true);
+        } else if (MATCH_STR(str, str_len, _CMD_FOR)) {
+            next = find_next(line->start);
+        }
+        
+        line = next ? get_line(next) : NULL;
+    }
+    
+    // a name matches the first label it is a prefix of, not necessarily its own line
+    for (u32 i = 0; i < n_labels; i++) {
+        Gm9ScriptLabel* entry = script_labels + i;
+        for (u32 j = 0; j < i; j++) {
+            if ((script_labels[j].len >= entry->len) && (strncmp(script_labels[j].label, entry->label, entry->len) == 0)) {
+                entry->target = script_labels[j].target;
+                break;
+            }
+        }
+    }
+    
+    // hash index, first occurrence of a name wins
+    for (label_hash_size = 16; label_hash_size < 2 * n_labels; label_hash_size <<= 1);
+    label_hash = (u32*) malloc(label_hash_size * sizeof(u32));
+    if (!label_hash) return false;
+    memset(label_hash, 0, label_hash_size * sizeof(u32));
+    
+    for (u32 i = 0; i < n_labels; i++) {
+        Gm9ScriptLabel* entry = script_labels + i;
+        u32 h = label_hash_fn(entry->label, entry->len) & (label_hash_size - 1);
+        for (; label_hash[h]; h = (h + 1) & (label_hash_size - 1)) {
+            Gm9ScriptLabel* other = script_labels + label_hash[h] - 1;
+            if ((other->len == entry->len) && (strncmp(other->label, entry->label, entry->len) == 0)) break;
+        }
+        if (!label_hash[h]) label_hash[h] = i + 1;
+    }
+    
+    return true;
+}
+
+bool build_line_table(char* script, u32 len) {
+    u32 n_lines = 1;
+    for (u32 i = 0; i < len; i++)
+        if (script[i] == '\n') n_lines++;
+    
+    script_lines = (Gm9ScriptLine*) malloc(n_lines * sizeof(Gm9ScriptLine));
+    if (!script_lines) return false;
+    memset(script_lines, 0, n_lines * sizeof(Gm9ScriptLine));
+    
+    script_lines[0].start = script;
+    for (u32 i = 0, l = 1; i < len; i++)
+        if (script[i] == '\n') script_lines[l++].start = script + i + 1;
+    script_n_lines = n_lines;
+    
+    // compile all lines, statement #0 is shared by empty lines, comments and labels
+    script_max_stmts = (n_lines / 2) + 1;
+    script_stmts = (Gm9ScriptStmt*) malloc(script_max_stmts * sizeof(Gm9ScriptStmt));
+    if (script_stmts) {
+        memset(script_stmts, 0, sizeof(Gm9ScriptStmt));
+        script_n_stmts = 1;
+    }
+    for (Gm9ScriptLine* line = script_lines; line < script_lines + n_lines; line++) {
+        line->end = strchr(line->start, '\n');
+        if (!line->end) line->end = line->start + strlen(line->start);
+        if (script_stmts) line->stmt = compile_stmt(line->start, line->end);
+    }
+    
+    // match 'if' / 'elif' / 'else' / 'for' targets (nothing to match behind the last line)
+    for (Gm9ScriptLine* line = script_lines; line < script_lines + n_lines; line++) {
+        cmd_id id = line->stmt ? script_stmts[line->stmt - 1].id : CMD_ID_NONE;
+        if (!*(line->end)) break;
+        if ((id == CMD_ID_IF) || (id == CMD_ID_ELIF)) skip_block_cached(line, line->end, false);
+        if ((id == CMD_ID_ELIF) || (id == CMD_ID_ELSE)) skip_block_cached(line, line->end, true);
+        if (id == CMD_ID_FOR) find_next_cached(line, line->start);
+    }
+    
+    // label index for 'goto', falls back to find_label() if incomplete
+    if (!build_label_index()) {
+        free(label_hash);
+        label_hash = NULL;
+    }
+    
+    return true;
+}
+
 bool run_cmd(cmd_id id, u32 flags, char** argv, char* err_str) {
     bool ret = true; // true unless some cmd messes up
     
     // process arg0 @string
     u64 at_org = 0;
     u64 sz_org = 0;
-    if ((id == CMD_ID_FGET) || (id == CMD_ID_FSET) || (id == CMD_ID_SHA) || (id == CMD_ID_SHAGET) || (id == CMD_ID_INJECT) || (id == CMD_ID_FILL)) {
+    if ((id == CMD_ID_FGET) || (id == CMD_ID_FSET) || (id == CMD_ID_SHA) || (id == CMD_ID_SHAGET) || (id == CMD_ID_HASHGET) || (id == CMD_ID_INJECT) || (id == CMD_ID_FILL)) {
         char* atstr_org = strrchr(argv[0], '@');
         if (atstr_org) {
             *(atstr_org++) = '\0';
@@ -948,7 +1300,7 @@ bool run_cmd(cmd_id id, u32 flags, char** argv, char* err_str) {
         }
     }
     else if (id == CMD_ID_GOTO) {
-        jump_ptr = find_label(argv[0], NULL);
+        jump_ptr = find_label_cached(argv[0]);
         if (!jump_ptr) {
             ret = false;
             if (err_str) snprintf(err_str, _ERR_STR_LEN, "label not found");
@@ -1293,6 +1645,39 @@ bool run_cmd(cmd_id id, u32 flags, char** argv, char* err_str) {
             if (err_str) snprintf(err_str, _ERR_STR_LEN, "sha write fail");
         }
     }
+    else if (id == CMD_ID_HASHGET) {
+        u8 sha256_fil[0x20];
+        u8 sha1_fil[0x14];
+        u32 crc32_fil;
+        char sha256_str[64+1];
+        char sha1_str[40+1];
+        char crc32_str[8+1];
+        if (!(ret = FileGetDigests(argv[0], sha256_fil, sha1_fil, &crc32_fil, at_org, sz_org))) {
+            if (err_str) snprintf(err_str, _ERR_STR_LEN, "hash arg0 fail");
+        } else {
+            snprintf(sha256_str, 64+1, "%016llX%016llX%016llX%016llX", getbe64(sha256_fil + 0), getbe64(sha256_fil + 8),
+                getbe64(sha256_fil + 16), getbe64(sha256_fil + 24));
+            snprintf(sha1_str, 40+1, "%016llX%016llX%08lX", getbe64(sha1_fil + 0), getbe64(sha1_fil + 8),
+                getbe32(sha1_fil + 16));
+            snprintf(crc32_str, 8+1, "%08lX", crc32_fil);
+            if (!strchr(argv[1], ':')) { // -> <var>_SHA256 / <var>_SHA1 / <var>_CRC32
+                char var_name[_VAR_NAME_LEN + 8];
+                snprintf(var_name, sizeof(var_name), "%s_SHA256", argv[1]);
+                ret = set_var(var_name, sha256_str);
+                snprintf(var_name, sizeof(var_name), "%s_SHA1", argv[1]);
+                ret = set_var(var_name, sha1_str) && ret;
+                snprintf(var_name, sizeof(var_name), "%s_CRC32", argv[1]);
+                ret = set_var(var_name, crc32_str) && ret;
+                if (err_str) snprintf(err_str, _ERR_STR_LEN, "var fail");
+            } else {
+                char hash_txt[128];
+                u32 len = snprintf(hash_txt, sizeof(hash_txt), "SHA256: %s\nSHA1: %s\nCRC32: %s\n", sha256_str, sha1_str, crc32_str);
+                if (!(ret = FileSetData(argv[1], hash_txt, len, 0, true))) {
+                    if (err_str) snprintf(err_str, _ERR_STR_LEN, "hash write fail");
+                }
+            }
+        }
+    }
     else if (id == CMD_ID_DUMPTXT) {
         size_t offset = 0;
         u32 len = strnlen(argv[1], _ARG_MAX_LEN);
@@ -1304,14 +1689,21 @@ bool run_cmd(cmd_id id, u32 flags, char** argv, char* err_str) {
     }
     else if (id == CMD_ID_FIXCMAC) {
         ShowString("Fixing CMACs...");
-        ret = (RecursiveFixFileCmac(argv[0]) == 0);
+        if (flags & _FLG('d')) ret = (FixDirtyFileCmacs(argv[0]) == 0);
+        else ret = (RecursiveFixFileCmac(argv[0]) == 0);
         if (err_str) snprintf(err_str, _ERR_STR_LEN, "fixcmac failed");
     }
     else if (id == CMD_ID_VERIFY) {
-        u64 filetype = IdentifyFileType(argv[0]);
-        if (filetype & IMG_NAND) ret = (ValidateNandDump(argv[0]) == 0);
-        else ret = (VerifyGameFile(argv[0]) == 0);
-        if (err_str) snprintf(err_str, _ERR_STR_LEN, "verification failed");
+        if (flags & _FLG('b')) {
+            u32 n_ok = 0, n_failed = 0;
+            ret = (BatchVerifyGameFiles(argv[0], OUTPUT_PATH "/verify.log", &n_ok, &n_failed) == 0) && !n_failed;
+            if (err_str) snprintf(err_str, _ERR_STR_LEN, "%lu/%lu verifications failed", n_failed, n_ok + n_failed);
+        } else {
+            u64 filetype = IdentifyFileType(argv[0]);
+            if (filetype & IMG_NAND) ret = (ValidateNandDump(argv[0]) == 0);
+            else ret = (VerifyGameFile(argv[0]) == 0);
+            if (err_str) snprintf(err_str, _ERR_STR_LEN, "verification failed");
+        }
     }
     else if (id == CMD_ID_DECRYPT) {
         u64 filetype = IdentifyFileType(argv[0]);
@@ -1484,7 +1876,7 @@ bool run_cmd(cmd_id id, u32 flags, char** argv, char* err_str) {
     return ret;
 }
 
-bool run_line(const char* line_start, const char* line_end, u32* flags, char* err_str, bool if_cond) {
+bool run_line(const char* line_start, const char* line_end, const Gm9ScriptStmt* stmt, u32* flags, char* err_str, bool if_cond) {
     char args[_MAX_ARGS][_ARG_MAX_LEN];
     char* argv[_MAX_ARGS];
     u32 argc = 0;
@@ -1500,7 +1892,7 @@ bool run_line(const char* line_start, const char* line_end, u32* flags, char* er
     *flags = 0;
     
     // parse current line, grab cmd / flags / args
-    if (!parse_line(line_start, line_end, &cmdid, flags, &argc, argv, err_str)) {
+    if (!parse_line(line_start, line_end, stmt, &cmdid, flags, &argc, argv, err_str)) {
         syntax_error = true;
         return false;
     }
@@ -1525,13 +1917,9 @@ bool run_line(const char* line_start, const char* line_end, u32* flags, char* er
         argc = 1;
         strncpy(argv[0], _ARG_FALSE, _ARG_MAX_LEN - 1);
         
-        // skip to behind the command
-        char* line_start_next = (char*) line_start;
-        for (; IS_WHITESPACE(*line_start_next); line_start_next++);
-        for (; *line_start_next && !IS_WHITESPACE(*line_start_next); line_start_next++);
-        
-        // run condition, take over result
-        if (run_line(line_start_next, line_end, flags, err_str, true))
+        // run condition (behind the command), take over result
+        const Gm9ScriptStmt* cond = (stmt && stmt->cond) ? script_stmts + stmt->cond - 1 : NULL;
+        if (run_line(skip_cmd(line_start), line_end, cond, flags, err_str, true))
             strncpy(argv[0], _ARG_TRUE, _ARG_MAX_LEN - 1);
     }
     
@@ -1838,6 +2226,9 @@ bool ExecuteGM9Script(const char* path_script) {
     // initialise variables
     init_vars(path_script);
     
+    // line table, compiled lines and control flow (not required, just faster)
+    build_line_table(script, script_size);
+    
     // setup script preview (only if used)
     u32 preview_mode_local = 0;
     if (MAIN_SCREEN != TOP_SCREEN) {
@@ -1853,9 +2244,11 @@ bool ExecuteGM9Script(const char* path_script) {
     bool result = true;
     while (ptr < end) {
         u32 flags = 0;
+        Gm9ScriptLine* line = ((lno <= script_n_lines) && (script_lines[lno-1].start == ptr)) ?
+            script_lines + (lno-1) : NULL;
 
         // find line end
-        char* line_end = strchr(ptr, '\n');
+        char* line_end = line ? line->end : strchr(ptr, '\n');
         if (!line_end) line_end = ptr + strlen(ptr);
 
         // update script viewer
@@ -1912,20 +2305,21 @@ bool ExecuteGM9Script(const char* path_script) {
         
         // run command
         char err_str[_ERR_STR_LEN+1] = { 0 };
-        result = run_line(ptr, line_end, &flags, err_str, false);
+        const Gm9ScriptStmt* stmt = (line && line->stmt) ? script_stmts + line->stmt - 1 : NULL;
+        result = run_line(ptr, line_end, stmt, &flags, err_str, false);
         
         
         // skip state handling
         char* skip_ptr = ptr;
         if ((skip_state == _SKIP_BLOCK) || (skip_state == _SKIP_TILL_END)) {
-            skip_ptr = skip_block(line_end + 1, (skip_state == _SKIP_TILL_END), false);
+            skip_ptr = skip_block_cached(line, line_end, (skip_state == _SKIP_TILL_END));
             if (!skip_ptr) {
                 snprintf(err_str, _ERR_STR_LEN, "unclosed conditional");
                 result = false;
                 syntax_error = true;
             }
         } else if (skip_state == _SKIP_TO_NEXT) {
-            skip_ptr = find_next(ptr);
+            skip_ptr = find_next_cached(line, ptr);
             if (!skip_ptr) {
                 snprintf(err_str, _ERR_STR_LEN, "'for' without 'next'");
                 result = false;
@@ -1973,10 +2367,12 @@ bool ExecuteGM9Script(const char* path_script) {
         // reposition pointer
         if (skip_ptr != ptr) {
             ptr = skip_ptr;
-            lno = get_lno(script, script_size, ptr);
+            line = get_line(ptr);
+            lno = line ? (line - script_lines) + 1 : get_lno(script, script_size, ptr);
         } else if (jump_ptr) {
             ptr = jump_ptr;
-            lno = get_lno(script, script_size, ptr);
+            line = get_line(ptr);
+            lno = line ? (line - script_lines) + 1 : get_lno(script, script_size, ptr);
             ifcnt = 0; // jumping into conditional block is unexpected/unsupported
             jump_ptr = NULL;
             for_ptr = NULL;
@@ -2006,6 +2402,7 @@ bool ExecuteGM9Script(const char* path_script) {
     }
     
     
+    free_line_table();
     free(var_buffer);
     free(script_buffer);
     return result;
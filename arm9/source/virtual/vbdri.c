@@ -4,9 +4,16 @@
 #include "vdisadiff.h"
 #include "bdri.h"
 #include "vff.h"
+#include "support.h"
+#include "sha.h"
 #include "ui.h"
 
 #define VBDRI_MAX_ENTRIES   8192 // Completely arbitrary
+#define VBDRI_CACHE_ENTRIES 8 // decoded tickets / title info entries kept in memory
+
+#define VBDRI_INDEX_MAGIC   'V', 'B', 'D', 'R', 'I', 'D', 'X', 0x01
+#define VBDRI_INDEX_TICKDB  "vbdri_ticket.idx" // SD card support dir only, never write to NAND just for browsing
+#define VBDRI_INDEX_TITLEDB "vbdri_title.idx"
 
 #define VFLAG_UNKNOWN       (1UL<<28)
 #define VFLAG_HOMEBREW      (1UL<<29)
@@ -28,6 +35,22 @@ typedef struct {
     u8  console_id[4];
 } PACKED_STRUCT TickInfoEntry;
 
+// persistent title index (SD support dir), valid for one DB generation
+// header / title ids (8 byte each) / ticket info (ticket.db only)
+typedef struct {
+    u8  magic[8];
+    u8  db_hash[0x20]; // SHA-256 over the DB header
+    u32 num_entries;
+    u32 has_tick_info;
+    u8  reserved[0x10];
+} PACKED_STRUCT VBDRIIndexHeader;
+
+typedef struct {
+    int index; // -1 if unused
+    u32 age;
+    u8* data;
+} VBDRICacheEntry;
+
 // only for the main directory
 static const VirtualFile VTickDbFileTemplates[] = {
     { "system"  , 0x00000000, 0x00000000, 0xFF, VFLAG_DIR | VFLAG_SYSTEM },
@@ -40,18 +63,174 @@ static bool is_tickdb;
 static u32 num_entries = 0;
 static u8* title_ids = NULL;
 static TickInfoEntry* tick_info = NULL;
-static u8* cached_entry = NULL;
-static int cache_index;
+static u32* tid_order = NULL; // entry indices sorted by title id, for binary search
+static u32 num_sorted = 0;
+static u8 db_hash[0x20];
+static VBDRICacheEntry entry_cache[VBDRI_CACHE_ENTRIES];
+static u32 cache_age = 0;
+
+static void FlushVBDRICache(int index) {
+    for (u32 i = 0; i < VBDRI_CACHE_ENTRIES; i++) {
+        if ((index >= 0) && (entry_cache[i].index != index)) continue;
+        free(entry_cache[i].data);
+        entry_cache[i].data = NULL;
+        entry_cache[i].index = -1;
+    }
+}
+
+static VBDRICacheEntry* GetVBDRICacheEntry(u32 index) {
+    VBDRICacheEntry* entry = NULL;
+    
+    // already cached? otherwise replace the least recently used entry
+    for (u32 i = 0; i < VBDRI_CACHE_ENTRIES; i++) {
+        if (entry_cache[i].index == (int) index) {
+            entry = &(entry_cache[i]);
+            break;
+        } else if (!entry || (entry_cache[i].index < 0) ||
+            ((entry->index >= 0) && (entry_cache[i].age < entry->age)))
+            entry = &(entry_cache[i]);
+    }
+    
+    if (entry->index != (int) index) {
+        free(entry->data);
+        entry->data = NULL;
+        entry->index = -1;
+        if (is_tickdb) {
+            if (ReadTicketFromDB(PART_PATH, title_ids + index * 8, (Ticket**) &(entry->data)) != 0)
+                return NULL;
+        } else {
+            if (!(entry->data = malloc(sizeof(TitleInfoEntry))))
+                return NULL;
+            if (ReadTitleInfoEntryFromDB(PART_PATH, title_ids + index * 8, (TitleInfoEntry*)(void*) entry->data) != 0) {
+                free(entry->data);
+                entry->data = NULL;
+                return NULL;
+            }
+        }
+        entry->index = (int) index;
+    }
+    
+    entry->age = ++cache_age;
+    return entry;
+}
+
+static int CompareVBDRITitleIds(const void* a, const void* b) {
+    return memcmp(title_ids + *((const u32*) a) * 8, title_ids + *((const u32*) b) * 8, 8);
+}
+
+// returns the position in tid_order where the title id is or would be inserted
+static u32 FindVBDRITitleIdPos(const u8* tid, bool* found) {
+    u32 lo = 0, hi = num_sorted;
+    *found = false;
+    while (lo < hi) {
+        u32 mid = (lo + hi) / 2;
+        int cmp = memcmp(title_ids + tid_order[mid] * 8, tid, 8);
+        if (cmp == 0) {
+            *found = true;
+            return mid;
+        } else if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static bool BuildVBDRITitleIdOrder(void) {
+    free(tid_order);
+    num_sorted = 0;
+    if (!(tid_order = (u32*) malloc(num_entries * sizeof(u32))))
+        return false;
+    for (u32 i = 0; i < num_entries; i++) {
+        if (getbe64(title_ids + (i * 8)) != 0)
+            tid_order[num_sorted++] = i;
+    }
+    qsort(tid_order, num_sorted, sizeof(u32), CompareVBDRITitleIds);
+    return true;
+}
+
+static bool GetVBDRIDbHash(u8* hash) {
+    // the DB header includes the partition hash, it changes with every modification
+    u8 header[0x200];
+    const char* path = GetMountPath();
+    if (!path || (fvx_qread(path, header, 0, 0x200, NULL) != FR_OK))
+        return false;
+    sha_quick(hash, header, 0x200, SHA256_MODE);
+    return true;
+}
+
+static bool LoadVBDRIIndex(void) {
+    static const u8 magic[] = { VBDRI_INDEX_MAGIC };
+    char path[256];
+    GetSupportFilePathSD(path, is_tickdb ? VBDRI_INDEX_TICKDB : VBDRI_INDEX_TITLEDB);
+    u32 max_len = sizeof(VBDRIIndexHeader) + (VBDRI_MAX_ENTRIES * (8 + sizeof(TickInfoEntry))) + 1;
+    u8* buffer = (u8*) malloc(max_len);
+    if (!buffer) return false;
+    
+    VBDRIIndexHeader* hdr = (VBDRIIndexHeader*)(void*) buffer;
+    UINT len = 0;
+    if (fvx_qread(path, buffer, 0, max_len, &len) != FR_OK) len = 0;
+    if ((len < sizeof(VBDRIIndexHeader)) ||
+        (memcmp(hdr->magic, magic, sizeof(magic)) != 0) ||
+        (memcmp(hdr->db_hash, db_hash, 0x20) != 0) ||
+        !hdr->num_entries || (hdr->num_entries > VBDRI_MAX_ENTRIES) ||
+        (hdr->has_tick_info && !is_tickdb) ||
+        (len != sizeof(VBDRIIndexHeader) + (hdr->num_entries * (8 + (hdr->has_tick_info ? sizeof(TickInfoEntry) : 0))))) {
+        free(buffer);
+        return false;
+    }
+    
+    num_entries = hdr->num_entries;
+    title_ids = (u8*) malloc(num_entries * 8);
+    tick_info = hdr->has_tick_info ? (TickInfoEntry*) malloc(num_entries * sizeof(TickInfoEntry)) : NULL;
+    if (!title_ids || (hdr->has_tick_info && !tick_info)) {
+        free(buffer);
+        DeinitVBDRIDrive();
+        return false;
+    }
+    
+    memcpy(title_ids, buffer + sizeof(VBDRIIndexHeader), num_entries * 8);
+    if (tick_info) memcpy(tick_info, buffer + sizeof(VBDRIIndexHeader) + (num_entries * 8), num_entries * sizeof(TickInfoEntry));
+    
+    free(buffer);
+    return true;
+}
+
+static bool SaveVBDRIIndex(void) {
+    static const u8 magic[] = { VBDRI_INDEX_MAGIC };
+    char path[256];
+    GetSupportFilePathSD(path, NULL);
+    if (fvx_rmkdir(path) != FR_OK)
+        return false; // no SD card, no index
+    GetSupportFilePathSD(path, is_tickdb ? VBDRI_INDEX_TICKDB : VBDRI_INDEX_TITLEDB);
+    
+    u32 len = sizeof(VBDRIIndexHeader) + (num_entries * (8 + (tick_info ? sizeof(TickInfoEntry) : 0)));
+    u8* buffer = (u8*) malloc(len);
+    if (!buffer) return false;
+    
+    VBDRIIndexHeader* hdr = (VBDRIIndexHeader*)(void*) buffer;
+    memset(hdr, 0, sizeof(VBDRIIndexHeader));
+    memcpy(hdr->magic, magic, sizeof(magic));
+    memcpy(hdr->db_hash, db_hash, 0x20);
+    hdr->num_entries = num_entries;
+    hdr->has_tick_info = tick_info ? 1 : 0;
+    memcpy(buffer + sizeof(VBDRIIndexHeader), title_ids, num_entries * 8);
+    if (tick_info) memcpy(buffer + sizeof(VBDRIIndexHeader) + (num_entries * 8), tick_info, num_entries * sizeof(TickInfoEntry));
+    
+    fvx_unlink(path);
+    bool res = (fvx_qwrite(path, buffer, 0, len, NULL) == FR_OK);
+    free(buffer);
+    return res;
+}
 
 void DeinitVBDRIDrive(void) {
     free(title_ids);
     free(tick_info);
-    free(cached_entry);
+    free(tid_order);
+    FlushVBDRICache(-1);
     title_ids = NULL;
     tick_info = NULL;
-    cached_entry = NULL;
+    tid_order = NULL;
     num_entries = 0;
-    cache_index = -1;
+    num_sorted = 0;
 }
 
 bool SortVBDRITickets() {
@@ -67,9 +246,12 @@ bool SortVBDRITickets() {
 
     ShowString("Sorting tickets, please wait ...");
 
+    // keep the DB open for all reads (not required, just faster)
+    bool batch = (BeginBDRITransaction(PART_PATH, false) == 0);
     for (u32 i = 0; i < num_entries - 1; i++) {
         Ticket* ticket;
         if (ReadTicketFromDB(PART_PATH, title_ids + (i * 8), &ticket) != 0) {
+            if (batch) AbortBDRITransaction();
             free(tick_info);
             tick_info = NULL;
             return false;
@@ -80,8 +262,12 @@ bool SortVBDRITickets() {
         memcpy(tick_info[i].console_id, ticket->console_id, 4);
         free(ticket);
     }
+    if (batch) AbortBDRITransaction();
 
     ClearScreenF(true, false, COLOR_STD_BG);
+    
+    // the sorted state is stored in the index, to be reused for this DB generation
+    SaveVBDRIIndex();
 
     return true;
 }
@@ -93,15 +279,21 @@ u64 InitVBDRIDrive(void) { // prerequisite: .db file mounted as virtual diff ima
     
     DeinitVBDRIDrive();
     
-    num_entries = min((is_tickdb ? GetNumTickets(PART_PATH) : GetNumTitleInfoEntries(PART_PATH)) + 1, VBDRI_MAX_ENTRIES);
-    title_ids = (u8*) malloc(num_entries * 8);
-    if (!title_ids ||
-        ((is_tickdb ? ListTicketTitleIDs(PART_PATH, title_ids, num_entries) : ListTitleInfoEntryTitleIDs(PART_PATH, title_ids, num_entries)) != 0)) {
-        DeinitVBDRIDrive();
-        return 0;
+    // try the persistent index first, only rebuild if the DB changed since
+    bool have_hash = GetVBDRIDbHash(db_hash);
+    if (!have_hash || !LoadVBDRIIndex()) {
+        num_entries = min((is_tickdb ? GetNumTickets(PART_PATH) : GetNumTitleInfoEntries(PART_PATH)) + 1, VBDRI_MAX_ENTRIES);
+        title_ids = (u8*) malloc(num_entries * 8);
+        if (!title_ids ||
+            ((is_tickdb ? ListTicketTitleIDs(PART_PATH, title_ids, num_entries) : ListTitleInfoEntryTitleIDs(PART_PATH, title_ids, num_entries)) != 0)) {
+            DeinitVBDRIDrive();
+            return 0;
+        }
+        // ticket.db index is saved once the tickets are sorted
+        if (have_hash && !is_tickdb) SaveVBDRIIndex();
     }
     
-    if (!is_tickdb && ((cached_entry = malloc(sizeof(TitleInfoEntry))) == NULL)) {
+    if (!BuildVBDRITitleIdOrder()) {
         DeinitVBDRIDrive();
         return 0;
     }
@@ -189,13 +381,15 @@ bool GetNewVBDRIFile(VirtualFile* vfile, VirtualDir* vdir, const char* path) {
         return false;
     tid = getbe64((u8*)&tid);
 
+    bool found;
+    u32 order_pos = FindVBDRITitleIdPos((u8*)&tid, &found);
+    if (found)
+        return false;
+    
     int entry_index = -1;
-    for (u32 i = 0; i < num_entries; i++) {
-        if ((entry_index == -1) && (*((u64*)(void*)(title_ids + 8 * i)) == 0))
+    for (u32 i = 0; (entry_index == -1) && (i < num_entries); i++) {
+        if (*((u64*)(void*)(title_ids + 8 * i)) == 0)
             entry_index = i;
-            
-        if (memcmp(&tid, title_ids + 8 * i, 8) == 0)
-            return false;
     }
     
     if (entry_index == -1) {
@@ -206,16 +400,20 @@ bool GetNewVBDRIFile(VirtualFile* vfile, VirtualDir* vdir, const char* path) {
         u8* new_title_ids = realloc(title_ids, new_num_entries * 8);
         if (!new_title_ids)
             return false;
+        title_ids = new_title_ids;
         if (tick_info) {
             TickInfoEntry* new_tick_info = realloc(tick_info, new_num_entries * sizeof(TickInfoEntry));
             if (!new_tick_info)
                 return false;
             tick_info = new_tick_info;
         }
+        u32* new_tid_order = realloc(tid_order, new_num_entries * sizeof(u32));
+        if (!new_tid_order)
+            return false;
+        tid_order = new_tid_order;
         
         entry_index = num_entries;
         num_entries = new_num_entries;
-        title_ids = new_title_ids;
         
         memset(title_ids + entry_index * 8, 0, (num_entries - entry_index) * 8);
     }
@@ -229,6 +427,9 @@ bool GetNewVBDRIFile(VirtualFile* vfile, VirtualDir* vdir, const char* path) {
         return false;
      
     memcpy(title_ids + entry_index * 8, &tid, 8);
+    memmove(tid_order + order_pos + 1, tid_order + order_pos, (num_sorted - order_pos) * sizeof(u32));
+    tid_order[order_pos] = entry_index;
+    num_sorted++;
     
     if (tick_info) {
         tick_info[entry_index].type = 3;
@@ -247,19 +448,11 @@ bool GetNewVBDRIFile(VirtualFile* vfile, VirtualDir* vdir, const char* path) {
 }
 
 int ReadVBDRIFile(const VirtualFile* vfile, void* buffer, u64 offset, u64 count) {
-    if ((int) vfile->offset == cache_index) {
-        memcpy(buffer, cached_entry + offset, count);
-        return 0;
-    }
-    
-    if (is_tickdb && (cache_index != -1))
-        free(cached_entry);
-    if ((is_tickdb ? ReadTicketFromDB(PART_PATH, title_ids + vfile->offset * 8, (Ticket**) &cached_entry) :
-        ReadTitleInfoEntryFromDB(PART_PATH, title_ids + vfile->offset * 8, (TitleInfoEntry*) cached_entry)) != 0)
+    VBDRICacheEntry* entry = GetVBDRICacheEntry(vfile->offset);
+    if (!entry)
         return 1;
-    cache_index = (int) vfile->offset;
     
-    memcpy(buffer, cached_entry + offset, count);
+    memcpy(buffer, entry->data + offset, count);
     return 0;
 }
 
@@ -273,48 +466,43 @@ int WriteVBDRIFile(VirtualFile* vfile, const void* buffer, u64 offset, u64 count
         resize = true;
     }
 
-    if (is_tickdb && (cache_index != -1))
-        free(cached_entry);
-    if ((is_tickdb ? ReadTicketFromDB(PART_PATH, title_ids + vfile->offset * 8, (Ticket**) &cached_entry) :
-        ReadTitleInfoEntryFromDB(PART_PATH, title_ids + vfile->offset * 8, (TitleInfoEntry*) cached_entry)) != 0) {
+    VBDRICacheEntry* entry = GetVBDRICacheEntry(vfile->offset);
+    if (!entry) {
         if (resize) vfile->size = tick_info[vfile->offset].size;
         return 1;
     }
-    cache_index = (int) vfile->offset;
         
     if (resize) {
-        u8* new_cached_entry = realloc(cached_entry, vfile->size);
-        if (!new_cached_entry) {
+        u8* new_data = realloc(entry->data, vfile->size);
+        if (!new_data) {
             vfile->size = tick_info[vfile->offset].size;
             return 1;
         }
         
-        cached_entry = new_cached_entry;
-        
-        if (RemoveTicketFromDB(PART_PATH, title_ids + vfile->offset * 8) != 0) {
-            vfile->size = tick_info[vfile->offset].size;
-            return 1;
-        }
+        entry->data = new_data;
     }
     
-    memcpy(cached_entry + offset, buffer, count);
+    memcpy(entry->data + offset, buffer, count);
     
-    if ((is_tickdb ? AddTicketToDB(PART_PATH, title_ids + vfile->offset * 8, (Ticket*)(void*)cached_entry, true) : 
-        AddTitleInfoEntryToDB(PART_PATH, title_ids + vfile->offset * 8, (TitleInfoEntry*)(void*)cached_entry, true)) != 0) {
+    // remove + add in one transaction, the new entry may reuse the blocks of the old one
+    // (not possible if a batch is already open, the DB is reused in that case)
+    bool trans = (BeginBDRITransaction(PART_PATH, true) == 0);
+    if ((resize && (RemoveTicketFromDB(PART_PATH, title_ids + vfile->offset * 8) != 0)) ||
+        ((is_tickdb ? AddTicketToDB(PART_PATH, title_ids + vfile->offset * 8, (Ticket*)(void*)entry->data, true) : 
+        AddTitleInfoEntryToDB(PART_PATH, title_ids + vfile->offset * 8, (TitleInfoEntry*)(void*)entry->data, true)) != 0) ||
+        (trans && (CommitBDRITransaction() != 0))) {
+        if (trans) AbortBDRITransaction();
         if (resize) vfile->size = tick_info[vfile->offset].size;
-        if (is_tickdb) {
-            free(cached_entry);
-            cached_entry = NULL;
-        }
-        cache_index = -1;
+        FlushVBDRICache(vfile->offset);
         return 1;
     }
     
     if (resize) tick_info[vfile->offset].size = vfile->size;
     
-    if (tick_info && ((offset <= 0x1F1 && offset + count > 0x1F1) || (cached_entry[0x1F1] == 0 && offset <= 0x104 && offset + count > 4)))
-        tick_info[vfile->offset].type = (cached_entry[0x1F1] > 1) ? 3 : 
-            ((ValidateTicketSignature((Ticket*)(void*)cached_entry) != 0) ? 1 : ((cached_entry[0x1F1] == 1) ? 2 : 0));
+    u8* data = entry->data;
+    if (tick_info && ((offset <= 0x1F1 && offset + count > 0x1F1) || (data[0x1F1] == 0 && offset <= 0x104 && offset + count > 4)))
+        tick_info[vfile->offset].type = (data[0x1F1] > 1) ? 3 : 
+            ((ValidateTicketSignature((Ticket*)(void*)data) != 0) ? 1 : ((data[0x1F1] == 1) ? 2 : 0));
     
     return 0;
 }
@@ -323,12 +511,13 @@ int DeleteVBDRIFile(const VirtualFile* vfile) {
     int ret = (int) (is_tickdb ? RemoveTicketFromDB(PART_PATH, title_ids + vfile->offset * 8) : RemoveTitleInfoEntryFromDB(PART_PATH, title_ids + vfile->offset * 8));
 
     if (ret == 0) {
-        if ((int) vfile->offset == cache_index) {
-            cache_index = -1;
-            if (is_tickdb) {
-                free(cached_entry);
-                cached_entry = NULL;
-            }
+        FlushVBDRICache(vfile->offset);
+        
+        bool found;
+        u32 order_pos = FindVBDRITitleIdPos(title_ids + vfile->offset * 8, &found);
+        if (found) {
+            memmove(tid_order + order_pos, tid_order + order_pos + 1, (num_sorted - order_pos - 1) * sizeof(u32));
+            num_sorted--;
         }
 
         memset(title_ids + vfile->offset * 8, 0, 8);
@@ -337,6 +526,18 @@ int DeleteVBDRIFile(const VirtualFile* vfile) {
     return ret;
 }
 
+bool BeginVBDRIBatch(void) {
+    return CheckVBDRIDrive() && (BeginBDRITransaction(PART_PATH, true) == 0);
+}
+
+bool EndVBDRIBatch(void) {
+    if (CommitBDRITransaction() == 0)
+        return true;
+    // DB tables were not written, the in-memory title list no longer matches
+    InitVBDRIDrive();
+    return false;
+}
+
 u64 GetVBDRIDriveSize(void) {
     return CheckVBDRIDrive() ? fvx_qsize(PART_PATH) : 0;
 }
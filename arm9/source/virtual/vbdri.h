@@ -12,4 +12,6 @@ bool GetNewVBDRIFile(VirtualFile* vfile, VirtualDir* vdir, const char* path);
 int ReadVBDRIFile(const VirtualFile* vfile, void* buffer, u64 offset, u64 count);
 int WriteVBDRIFile(VirtualFile* vfile, const void* buffer, u64 offset, u64 count);
 int DeleteVBDRIFile(const VirtualFile* vfile);
+bool BeginVBDRIBatch(void);
+bool EndVBDRIBatch(void);
 u64 GetVBDRIDriveSize(void);
@@ -6,126 +6,85 @@
 
 #define VFLAG_PARTITION_B (1 << 31)
 
-#define MAX_IVFC_RANGES 1024
+#define VDISADIFF_CACHE_SIZE 0x10000 // read cache & read-ahead window per partition
 
 typedef struct {
-    u32 offset;
-    u32 size;
-} PACKED_STRUCT DisaDiffIvfcRange;
-
-typedef struct {
-    u32 n_ivfc_ranges;
-    DisaDiffIvfcRange ivfc_lvl4_ranges[MAX_IVFC_RANGES];
+    u8* dirty_lvl4; // bitmap of IVFC lvl4 blocks written since the last hash chain fix
+    bool dirty;
     DisaDiffRWInfo rw_info;
+    u8* cache; // IVFC lvl4 read cache, allocated on first use
+    u32 cache_offset;
+    u32 cache_size;
 } PACKED_STRUCT VDisaDiffPartitionInfo;
 
 static VDisaDiffPartitionInfo* partitionA_info = NULL;
 static VDisaDiffPartitionInfo* partitionB_info = NULL;
 
-static void AlignDisaDiffIvfcRange(DisaDiffIvfcRange* range, u32 log_block_size) {
-    u32 end_offset = align(range->offset + range->size, 1 << log_block_size);
-    range->offset = (range->offset >> log_block_size) << log_block_size;
-    range->size = end_offset - range->offset;
+static u32 GetDisaDiffIvfcLevelBlocks(const DisaDiffRWInfo* rw_info, u32 level, u32* log_block_size) {
+    const u32 size_ivfc_lvl = (&(rw_info->size_ivfc_lvl1))[level - 1];
+    const u32 log_ivfc_lvl = (&(rw_info->log_ivfc_lvl1))[level - 1];
+    if (log_block_size) *log_block_size = log_ivfc_lvl;
+    return align(size_ivfc_lvl, 1 << log_ivfc_lvl) >> log_ivfc_lvl;
 }
 
-static u32 MergeDisaDiffIvfcRange(DisaDiffIvfcRange new_range, DisaDiffIvfcRange* ranges, u32* n_ranges) {
-    const u32 new_end_offset = new_range.offset + new_range.size;
-    bool add_range = true;
-    
-    if (*n_ranges > MAX_IVFC_RANGES)
-        return 1;
-    
-    for (u32 i = 0; i < *n_ranges; i++) {
-        u32 end_offset = ranges[i].offset + ranges[i].size;
-        
-        if (new_range.offset > ranges[i].offset) {
-            if (end_offset >= new_range.offset) {
-                add_range = false;
-                
-                if (end_offset < new_end_offset) {
-                    ranges[i].size += new_end_offset - end_offset;
-                }
-                
-                break;
-            }
-            
-            continue;
-        } else if (ranges[i].offset > new_range.offset) {
-            if (new_end_offset >= ranges[i].offset) {
-                add_range = false;
-                
-                if (new_end_offset < end_offset) {
-                    ranges[i].offset = new_range.offset;
-                    ranges[i].size = new_range.size + end_offset - new_end_offset;
-                } else {
-                    ranges[i] = new_range;
-                }
-                
-                break;
-            }
-            
-            continue;
-        } else {
-            add_range = false;
-            ranges[i].size = max(new_range.size, ranges[i].size);
-            break;
-        }
-    }
-    
-    if (add_range) {
-        if (*n_ranges == MAX_IVFC_RANGES - 1)
-            return 1;
-        
-        ranges[(*n_ranges)++] = new_range;
-    }
-    
-    return 0;
+static void MarkDisaDiffIvfcBlocks(u8* bitmap, u32 offset, u32 size, u32 log_block_size) {
+    if (!size) return;
+    u32 b_last = (offset + size - 1) >> log_block_size;
+    for (u32 b = offset >> log_block_size; b <= b_last; b++)
+        bitmap[b >> 3] |= 1 << (b & 0x7);
 }
 
 static u32 FixVDisaDiffIvfcHashChain(bool partitionB) {
     VDisaDiffPartitionInfo* info = partitionB ? partitionB_info : partitionA_info;
     if (!info) return 1;
     
-    if (info->n_ivfc_ranges == 0)
+    if (!info->dirty)
         return 0;
     
-    DisaDiffIvfcRange* ivfc_range_buffer = malloc(sizeof(DisaDiffIvfcRange) * MAX_IVFC_RANGES);
-    if (!ivfc_range_buffer)
-        return 1;
-    
-    u32 n_ivfc_ranges = 0;
+    // one bottom-up pass: rehash each run of dirty blocks once per level,
+    // mark the hash blocks touched by that in the next level up
+    DisaDiffRWInfo* rw_info = &(info->rw_info);
+    u8* dirty = info->dirty_lvl4;
+    u32 ret = 0;
     
-    for (u32 i = 0; i < info->n_ivfc_ranges; i++) {
-        if (MergeDisaDiffIvfcRange(info->ivfc_lvl4_ranges[i], ivfc_range_buffer, &n_ivfc_ranges) != 0)
-            return 1;
-    }
-    
-    for (u32 level = 4; level > 0; level--) {
-        u32 next_n_ivfc_ranges = 0;
-        DisaDiffIvfcRange* ivfc_ranges = (level % 2) ? info->ivfc_lvl4_ranges : ivfc_range_buffer;
-        DisaDiffIvfcRange* next_ivfc_ranges = (level % 2) ? ivfc_range_buffer : info->ivfc_lvl4_ranges;
+    for (u32 level = 4; (level > 0) && (ret == 0); level--) {
+        u32 log_lvl, log_next = 0;
+        const u32 n_blocks = GetDisaDiffIvfcLevelBlocks(rw_info, level, &log_lvl);
+        u8* dirty_next = NULL;
         
-        for (u32 j = 0; j < n_ivfc_ranges; j++) {
-            DisaDiffIvfcRange next_range;
-            
-            if (FixDisaDiffIvfcLevel(&(info->rw_info), level, ivfc_ranges[j].offset, ivfc_ranges[j].size, &(next_range.offset), &(next_range.size)) != 0)
-                return 1;
-            
-            if (next_ivfc_ranges) {
-                AlignDisaDiffIvfcRange(&next_range, (&(info->rw_info.log_ivfc_lvl1))[level - 2]);
-                if (MergeDisaDiffIvfcRange(next_range, next_ivfc_ranges, &next_n_ivfc_ranges) != 0)
-                    return 1;
+        if (level > 1) {
+            u32 bitmap_size = (GetDisaDiffIvfcLevelBlocks(rw_info, level - 1, &log_next) + 7) >> 3;
+            if (!(dirty_next = (u8*) malloc(bitmap_size))) ret = 1;
+            else memset(dirty_next, 0, bitmap_size);
+        }
+        
+        for (u32 b = 0; (b < n_blocks) && (ret == 0);) {
+            u32 b_end = b;
+            while ((b_end < n_blocks) && ((dirty[b_end >> 3] >> (b_end & 0x7)) & 1)) b_end++;
+            if (b_end == b) {
+                b++;
+                continue;
             }
+            
+            u32 next_offset, next_size;
+            if (FixDisaDiffIvfcLevel(rw_info, level, b << log_lvl, (b_end - b) << log_lvl, &next_offset, &next_size) != 0)
+                ret = 1;
+            else if (dirty_next)
+                MarkDisaDiffIvfcBlocks(dirty_next, next_offset, next_size, log_next);
+            b = b_end;
         }
-        n_ivfc_ranges = next_n_ivfc_ranges;
+        
+        if (dirty != info->dirty_lvl4) free(dirty);
+        dirty = dirty_next;
     }
     
-    free(ivfc_range_buffer);
+    if (dirty != info->dirty_lvl4) free(dirty);
     
-    if (FixDisaDiffIvfcLevel(&(info->rw_info), 0, 0, 0, NULL, NULL) != 0)
+    if ((ret != 0) || (FixDisaDiffIvfcLevel(rw_info, 0, 0, 0, NULL, NULL) != 0))
         return 1;
     
-    info->n_ivfc_ranges = 0;
+    memset(info->dirty_lvl4, 0, (GetDisaDiffIvfcLevelBlocks(rw_info, 4, NULL) + 7) >> 3);
+    info->dirty = false;
     return 0;
 }
 
@@ -134,6 +93,8 @@ void DeinitVDisaDiffDrive(void) {
         FixVDisaDiffIvfcHashChain(false);
         if (partitionA_info->rw_info.dpfs_lvl2_cache)
             free(partitionA_info->rw_info.dpfs_lvl2_cache);
+        free(partitionA_info->cache);
+        free(partitionA_info->dirty_lvl4);
         free(partitionA_info);
         partitionA_info = NULL;
     }
@@ -142,6 +103,8 @@ void DeinitVDisaDiffDrive(void) {
         FixVDisaDiffIvfcHashChain(true);
         if (partitionB_info->rw_info.dpfs_lvl2_cache)
             free(partitionB_info->rw_info.dpfs_lvl2_cache);
+        free(partitionB_info->cache);
+        free(partitionB_info->dirty_lvl4);
         free(partitionB_info);
         partitionB_info = NULL;
     }
@@ -226,25 +189,64 @@ bool ReadVDisaDiffDir(VirtualFile* vfile, VirtualDir* vdir) {
 int ReadVDisaDiffFile(const VirtualFile* vfile, void* buffer, u64 offset, u64 count) {
     VDisaDiffPartitionInfo* info = (vfile->flags & VFLAG_PARTITION_B) ? partitionB_info : partitionA_info;
     if (!info) return 1;
-    u32 ret = ReadDisaDiffIvfcLvl4(NULL, &(info->rw_info), offset, count, buffer);
-    //ShowPrompt(false, "Ret: %X\nCount: %X", ret, count);
-    return (ret == count) ? 0 : 1;
+    
+    // large reads (or no cache memory): read directly
+    if ((count >= VDISADIFF_CACHE_SIZE) ||
+        (!info->cache && !(info->cache = (u8*) malloc(VDISADIFF_CACHE_SIZE)))) {
+        u32 ret = ReadDisaDiffIvfcLvl4(NULL, &(info->rw_info), offset, count, buffer);
+        return (ret == count) ? 0 : 1;
+    }
+    
+    // small reads: serve from cache, refill (with read-ahead) on miss
+    if (offset + count > info->rw_info.size_ivfc_lvl4) return 1;
+    for (u8* buffer8 = (u8*) buffer; count;) {
+        if ((offset < info->cache_offset) || (offset >= info->cache_offset + info->cache_size)) {
+            u32 cache_offset = offset & ~0x1FF;
+            u32 cache_size = min(VDISADIFF_CACHE_SIZE, info->rw_info.size_ivfc_lvl4 - cache_offset);
+            info->cache_size = 0;
+            if (ReadDisaDiffIvfcLvl4(NULL, &(info->rw_info), cache_offset, cache_size, info->cache) != cache_size)
+                return 1;
+            info->cache_offset = cache_offset;
+            info->cache_size = cache_size;
+        }
+        u32 pos = offset - info->cache_offset;
+        u32 len = min(count, info->cache_size - pos);
+        memcpy(buffer8, info->cache + pos, len);
+        buffer8 += len;
+        offset += len;
+        count -= len;
+    }
+    
+    return 0;
 }
 
 int WriteVDisaDiffFile(const VirtualFile* vfile, const void* buffer, u64 offset, u64 count) {
     VDisaDiffPartitionInfo* info = (vfile->flags & VFLAG_PARTITION_B) ? partitionB_info : partitionA_info;
     if (!info) return 1;
     
-    if (WriteDisaDiffIvfcLvl4(NULL, &(info->rw_info), offset, count, buffer) != count) return 1;
+    // dirty block bitmap, allocated on first write
+    if (!info->dirty_lvl4) {
+        u32 bitmap_size = (GetDisaDiffIvfcLevelBlocks(&(info->rw_info), 4, NULL) + 7) >> 3;
+        if (!(info->dirty_lvl4 = (u8*) malloc(bitmap_size))) return 1;
+        memset(info->dirty_lvl4, 0, bitmap_size);
+    }
+    
+    // hash chain is fixed in one go later (on unmount)
+    // blocks are marked first, so a partial write is still covered
+    MarkDisaDiffIvfcBlocks(info->dirty_lvl4, offset, count, info->rw_info.log_ivfc_lvl4);
+    info->dirty = true;
     
-    DisaDiffIvfcRange range;
-    range.offset = offset;
-    range.size = count;
-    AlignDisaDiffIvfcRange(&range, info->rw_info.log_ivfc_lvl4);
-    if ((MergeDisaDiffIvfcRange(range, info->ivfc_lvl4_ranges, &(info->n_ivfc_ranges)) != 0) &&
-        ((FixVDisaDiffIvfcHashChain(vfile->flags & VFLAG_PARTITION_B) != 0) ||
-        (MergeDisaDiffIvfcRange(range, info->ivfc_lvl4_ranges, &(info->n_ivfc_ranges)) != 0)))
+    if (WriteDisaDiffIvfcLvl4(NULL, &(info->rw_info), offset, count, buffer) != count) {
+        info->cache_size = 0; // unknown state, drop the cache
         return 1;
-        
+    }
+    
+    // keep the read cache up to date
+    if ((offset < info->cache_offset + info->cache_size) && (offset + count > info->cache_offset)) {
+        u32 start = max(offset, info->cache_offset);
+        u32 end = min(offset + count, info->cache_offset + info->cache_size);
+        memcpy(info->cache + (start - info->cache_offset), (const u8*) buffer + (start - offset), end - start);
+    }
+    
     return 0;
 }
@@ -107,6 +107,7 @@ static u64 offset_nitro = (u64) -1;
 static u64 offset_ccnt  = (u64) -1;
 static u64 offset_tad   = (u64) -1;
 static u32 index_ccnt   = (u32) -1;
+static u32 vgame_state  = 0; // changes whenever any of the above changes
 
 static CiaStub* cia       = NULL;
 static TwlHeader* twl     = NULL;
@@ -741,6 +742,7 @@ void DeinitVGameDrive(void) {
     if (vgame_fs_buffer) free(vgame_fs_buffer);
     vgame_buffer = NULL;
     vgame_fs_buffer = NULL;
+    vgame_state++;
 }
 
 u64 InitVGameDrive(void) { // prerequisite: game file mounted as image
@@ -819,15 +821,18 @@ bool OpenVGameDir(VirtualDir* vdir, VirtualFile* ventry) {
     
     // CIA content special handling
     if (vdir->flags & VFLAG_CIA) { // disable content crypto
+        if (offset_ccnt != (u64) -1) vgame_state++;
         offset_ccnt = (u64) -1;
         index_ccnt = (u32) -1;
     } else if (vdir->flags & VFLAG_CIA_CONTENT) { // enable content crypto
+        if ((offset_ccnt != vdir->offset) || (index_ccnt != ventry->keyslot)) vgame_state++;
         offset_ccnt = vdir->offset;
         index_ccnt = ventry->keyslot;
     }
     
     // build directories where required
     if ((vdir->flags & VFLAG_FIRM) && (offset_firm != vdir->offset)) {
+        vgame_state++;
         if ((ReadImageBytes((u8*) firm, 0, sizeof(FirmHeader)) != 0) ||
             (ValidateFirmHeader(firm, 0) != 0)) return false;
         offset_firm = vdir->offset;
@@ -838,9 +843,11 @@ bool OpenVGameDir(VirtualDir* vdir, VirtualFile* ventry) {
             offset_a9bin = arm9s->offset + ARM9BIN_OFFSET;
         if (!BuildVGameFirmDir()) return false;
     } else if ((vdir->flags & VFLAG_TAD) && (offset_tad != vdir->offset)) {
+        vgame_state++;
         offset_tad = vdir->offset; // always zero(!)
         if (!BuildVGameTadDir()) return false;
     } else if ((vdir->flags & VFLAG_CIA) && (offset_cia != vdir->offset)) {
+        vgame_state++;
         CiaInfo info;
         if ((ReadImageBytes((u8*) cia, 0, 0x20) != 0) ||
             (ValidateCiaHeader(&(cia->header)) != 0) ||
@@ -851,12 +858,14 @@ bool OpenVGameDir(VirtualDir* vdir, VirtualFile* ventry) {
         GetTitleKey(cia_titlekey, (Ticket*)&(cia->ticket));
         if (!BuildVGameCiaDir()) return false;
     } else if ((vdir->flags & VFLAG_NCSD) && (offset_ncsd != vdir->offset)) {
+        vgame_state++;
         if ((ReadImageBytes((u8*) ncsd, 0, sizeof(NcsdHeader)) != 0) ||
             (ValidateNcsdHeader(ncsd) != 0))
             return false;
         offset_ncsd = vdir->offset; // always zero(!)
         if (!BuildVGameNcsdDir()) return false;
     } else if ((vdir->flags & VFLAG_NCCH) && (offset_ncch != vdir->offset)) {
+        vgame_state++;
         offset_ncch = (u64) -1;
         if ((ReadNcchImageBytes((u8*) ncch, vdir->offset, sizeof(NcchHeader)) != 0) ||
             (ValidateNcchHeader(ncch) != 0))
@@ -872,12 +881,14 @@ bool OpenVGameDir(VirtualDir* vdir, VirtualFile* ventry) {
             if (!BuildVGameExeFsDir()) return false;
         }
     } else if ((vdir->flags & VFLAG_EXEFS) && (offset_exefs != vdir->offset)) {
+        vgame_state++;
         if ((ReadNcchImageBytes((u8*) exefs, vdir->offset, sizeof(ExeFsHeader)) != 0) ||
             (ValidateExeFsHeader(exefs, ncch->size_exefs * NCCH_MEDIA_UNIT) != 0))
             return false;
         offset_exefs = vdir->offset;
         if (!BuildVGameExeFsDir()) return false;
     } else if ((vdir->flags & VFLAG_ROMFS) && (offset_romfs != vdir->offset)) {
+        vgame_state++;
         offset_nitro = (u64) -1; // mutually exclusive
         // validate ivfc header
         RomFsIvfcHeader ivfc;
@@ -902,12 +913,14 @@ bool OpenVGameDir(VirtualDir* vdir, VirtualFile* ventry) {
         offset_romfs = vdir->offset;
         BuildLv3Index(&lv3idx, vgame_fs_buffer);
     } else if ((vdir->flags & VFLAG_NDS) && (offset_nds != vdir->offset)) {
+        vgame_state++;
         if ((ReadGameImageBytes(twl, vdir->offset, 0x200) != 0) ||
             (ValidateTwlHeader(twl) != 0))
             return false;
         offset_nds = vdir->offset;
         if (!BuildVGameNdsDir()) return false;
     } else if ((vdir->flags & VFLAG_NITRO_DIR) && (offset_nitro != offset_nds)) {
+        vgame_state++;
         offset_romfs = (u64) -1; // mutually exclusive
         // sanity checks
         if (!twl->fnt_size || !twl->fat_size ||
@@ -1199,3 +1212,7 @@ bool MatchVGameFilename(const char* name, const VirtualFile* vfile, u32 n_chars)
 u64 GetVGameDriveSize(void) {
     return (vgame_type) ? GetMountSize() : 0;
 }
+
+u32 GetVGameState(void) {
+    return vgame_state;
+}
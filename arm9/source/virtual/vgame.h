@@ -18,3 +18,4 @@ bool GetVGameFilename(char* name, const VirtualFile* vfile, u32 n_chars);
 bool MatchVGameFilename(const char* name, const VirtualFile* vfile, u32 n_chars);
 
 u64 GetVGameDriveSize(void);
+u32 GetVGameState(void);
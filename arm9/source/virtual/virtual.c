@@ -9,13 +9,60 @@
 #include "vdisadiff.h"
 #include "ff.h"
 
+// only image based drives are cached, NAND / memory lookups are cheap and cart contents can change anytime
+#define VCACHE_SOURCES  (VRT_GAME|VRT_BDRI|VRT_KEYDB|VRT_VRAM|VRT_DISADIFF)
+#define VCACHE_ENTRIES  16
+
 typedef struct {
     char drv_letter;
     u32 virtual_src;
 } PACKED_STRUCT VirtualDrive;
 
+typedef struct {
+    char path[256];
+    u32 generation; // 0 -> unused entry
+    u32 vgame_state;
+    VirtualFile vfile;
+} VirtualFileCacheEntry;
+
 static const VirtualDrive virtualDrives[] = { VRT_DRIVES };
 
+static VirtualFileCacheEntry vcache[VCACHE_ENTRIES];
+static u32 vcache_generation = 1;
+static u32 vcache_next = 0;
+
+static void InvalidateVirtualFileCache(void) {
+    // (re)mounts and changes to the directory structure make all cached lookups stale
+    if (!++vcache_generation) vcache_generation = 1;
+    vcache_next = 0;
+}
+
+static VirtualFileCacheEntry* FindVirtualFileCacheEntry(const char* path) {
+    for (u32 i = 0; i < VCACHE_ENTRIES; i++) {
+        VirtualFileCacheEntry* entry = vcache + i;
+        if ((entry->generation != vcache_generation) || (strncmp(entry->path, path, 256) != 0))
+            continue;
+        // vgame files depend on the dir / crypto state set up while walking the path
+        if ((entry->vfile.flags & VRT_GAME) && (entry->vgame_state != GetVGameState()))
+            continue;
+        return entry;
+    }
+    return NULL;
+}
+
+static void AddVirtualFileCacheEntry(const char* path, const VirtualFile* vfile) {
+    VirtualFileCacheEntry* entry = FindVirtualFileCacheEntry(path);
+    if (!entry) { // round robin replacement
+        entry = vcache + vcache_next;
+        vcache_next = (vcache_next + 1) % VCACHE_ENTRIES;
+    }
+    strncpy(entry->path, path, 256);
+    entry->path[255] = '\0';
+    entry->generation = vcache_generation;
+    entry->vgame_state = GetVGameState();
+    memcpy(&(entry->vfile), vfile, sizeof(VirtualFile));
+}
+
 u32 GetVirtualSource(const char* path) {
     // check path validity
     if ((strnlen(path, 16) < 2) || (path[1] != ':') || ((path[2] != '/') && (path[2] != '\0')))
@@ -27,6 +74,7 @@ u32 GetVirtualSource(const char* path) {
 }
 
 void DeinitVirtualImageDrive(void) {
+    InvalidateVirtualFileCache();
     DeinitVGameDrive();
     DeinitVBDRIDrive();
     DeinitVKeyDbDrive();
@@ -123,6 +171,15 @@ bool GetVirtualFile(VirtualFile* vfile, const char* path, u8 mode) {
     vfile->flags = VFLAG_ROOT|virtual_src;
     if (strnlen(lpath, 256) <= 3) return true;
     
+    // check the lookup cache first
+    if (virtual_src & VCACHE_SOURCES) {
+        VirtualFileCacheEntry* entry = FindVirtualFileCacheEntry(lpath);
+        if (entry) {
+            memcpy(vfile, &(entry->vfile), sizeof(VirtualFile));
+            return true;
+        }
+    }
+    
     // tokenize / parse path
     char* name;
     VirtualDir vdir;
@@ -130,8 +187,12 @@ bool GetVirtualFile(VirtualFile* vfile, const char* path, u8 mode) {
     for (name = strtok(lpath + 3, "/"); name && vdir.flags; name = strtok(NULL, "/")) {
         if (!(vdir.flags & VFLAG_LV3)) { // standard method
             while (true) {
-                if (!ReadVirtualDir(vfile, &vdir)) 
-                    return ((mode & FA_WRITE) && (vdir.flags & VRT_BDRI) && GetNewVBDRIFile(vfile, &vdir, path));
+                if (!ReadVirtualDir(vfile, &vdir)) {
+                    if (!(mode & FA_WRITE) || !(vdir.flags & VRT_BDRI) || !GetNewVBDRIFile(vfile, &vdir, path))
+                        return false;
+                    InvalidateVirtualFileCache();
+                    return true;
+                }
                 if ((!(vfile->flags & (VRT_GAME|VRT_VRAM)) && (strncasecmp(name, vfile->name, 32) == 0)) ||
                     ((vfile->flags & VRT_GAME) && MatchVGameFilename(name, vfile, 256)) ||
                     ((vfile->flags & VRT_VRAM) && MatchVVramFilename(name, vfile)))
@@ -145,7 +206,10 @@ bool GetVirtualFile(VirtualFile* vfile, const char* path, u8 mode) {
             vdir.flags = 0;
     }
     
-    return (name == NULL); // if name is NULL, this succeeded
+    if (name != NULL) return false;
+    if (virtual_src & VCACHE_SOURCES)
+        AddVirtualFileCacheEntry(path, vfile);
+    return true; // if name is NULL, this succeeded
 }
 
 bool GetVirtualDir(VirtualDir* vdir, const char* path) {
@@ -209,18 +273,31 @@ int WriteVirtualFile(VirtualFile* vfile, const void* buffer, u64 offset, u64 cou
     } else if (vfile->flags & VRT_CART) {
         return WriteVCartFile(vfile, buffer, offset, count);
     } else if (vfile->flags & VRT_BDRI) {
+        InvalidateVirtualFileCache(); // BDRI entries may get resized
         return WriteVBDRIFile(vfile, buffer, offset, count);
     } // no write support for virtual game / keydb / vram files
     
     return -1;
 }
 
+bool BeginVirtualBatch(const char* path) {
+    // only BDRI (ticket / title DB) changes can be batched for now
+    return (GetVirtualSource(path) & VRT_BDRI) && BeginVBDRIBatch();
+}
+
+bool EndVirtualBatch(void) {
+    InvalidateVirtualFileCache();
+    return EndVBDRIBatch();
+}
+
 int DeleteVirtualFile(const VirtualFile* vfile) {
     if (!(vfile->flags & VFLAG_DELETABLE)) return -1;
     
     // Special handling for deleting BDRI entries
-    if (vfile->flags & VRT_BDRI)
+    if (vfile->flags & VRT_BDRI) {
+        InvalidateVirtualFileCache();
         return DeleteVBDRIFile(vfile);
+    }
     
     // For anything else, "deleting" is just filling with 0s
     u32 zeroes_size = STD_BUFFER_SIZE;
@@ -64,5 +64,7 @@ bool GetVirtualFilename(char* name, const VirtualFile* vfile, u32 n_chars);
 int ReadVirtualFile(const VirtualFile* vfile, void* buffer, u64 offset, u64 count, u32* bytes_read);
 int WriteVirtualFile(VirtualFile* vfile, const void* buffer, u64 offset, u64 count, u32* bytes_written);
 int DeleteVirtualFile(const VirtualFile* vfile);
+bool BeginVirtualBatch(const char* path);
+bool EndVirtualBatch(void);
 
 u64 GetVirtualDriveSize(const char* path);